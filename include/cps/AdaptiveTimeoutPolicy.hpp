@@ -0,0 +1,145 @@
+#ifndef CPS_ADAPTIVETIMEOUTPOLICY_HPP
+#define CPS_ADAPTIVETIMEOUTPOLICY_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace CPS
+{
+
+/**
+ * @brief Sliding window of most recent request times
+ *
+ * Not thread-safe, owner has to guard it
+ */
+class LatencyWindow
+{
+public:
+    LatencyWindow(unsigned int size = 1000) :
+        size(size), next(0) {
+    }
+
+    /**
+     * Adds request time in seconds, replacing the oldest one when window is full
+     */
+    void add(double seconds) {
+        if (samples.size() < size) {
+            samples.push_back(seconds);
+        } else if (size > 0) {
+            samples[next] = seconds;
+            next = (next + 1) % size;
+        }
+    }
+
+    /**
+     * Returns number of request times in window
+     */
+    unsigned int count() const {
+        return samples.size();
+    }
+
+    /**
+     * Returns request time in seconds below which given percentage of times in window are
+     * @param percentile percentage (0..100]
+     */
+    double getPercentile(double percentile) const {
+        if (samples.empty())
+            return 0.0;
+        std::vector<double> sorted(samples);
+        size_t index = static_cast<size_t>(percentile / 100.0 * sorted.size());
+        index = std::min(index, sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+    /**
+     * Removes all times and sets window size
+     */
+    void reset(unsigned int size) {
+        this->size = size;
+        samples.clear();
+        next = 0;
+    }
+
+private:
+    std::vector<double> samples;
+    unsigned int size; /// Maximum number of times kept
+    unsigned int next; /// Position of oldest time once window is full
+};
+
+/**
+ * @brief Derives receive timeout of each command from its recent reply times
+ *
+ * Timeout is the given percentile of reply times multiplied by factor and
+ * clamped to bounds. Until enough replies of a command are seen,
+ * socket receive timeout is used. Replies that time out are counted with the
+ * time they took, so timeout grows again when server becomes slower.
+ * Only commands that do not modify data are adapted by default, as time of
+ * modifying commands grows with size of documents sent and their timeout does
+ * not tell whether server has applied the change
+ * @see Connection::setAdaptiveTimeoutPolicy()
+ */
+class AdaptiveTimeoutPolicy
+{
+public:
+    AdaptiveTimeoutPolicy() :
+        percentile(99.9), factor(3.0), minTimeout(50), maxTimeout(60000), window(1000), minSamples(100) {
+        const char *commands[] = {"search", "lookup", "retrieve", "retrieve-first", "retrieve-last",
+                "list-first", "list-last", "similar"};
+        adaptedCommands.insert(commands, commands + sizeof(commands) / sizeof(commands[0]));
+    }
+
+    /**
+     * Returns policy that keeps fixed socket timeouts
+     */
+    static AdaptiveTimeoutPolicy none() {
+        AdaptiveTimeoutPolicy policy;
+        policy.factor = 0.0;
+        return policy;
+    }
+
+    bool isEnabled() const {
+        return factor > 0.0;
+    }
+
+    bool isAdapted(const std::string &command) const {
+        return isEnabled() && adaptedCommands.count(command) > 0;
+    }
+
+    void addAdaptedCommand(const std::string &command) {
+        adaptedCommands.insert(command);
+    }
+
+    void removeAdaptedCommand(const std::string &command) {
+        adaptedCommands.erase(command);
+    }
+
+    /**
+     * Returns timeout in milliseconds for reply times in window
+     */
+    long getTimeout(const LatencyWindow &latencies) const {
+        long timeout = static_cast<long>(latencies.getPercentile(percentile) * factor * 1000.0 + 0.5);
+        return std::max(minTimeout, std::min(maxTimeout, timeout));
+    }
+
+    /** Percentile (0..100] of reply times timeout is derived from */
+    double percentile;
+    /** Multiplier of percentile, 0 disables adaptive timeouts */
+    double factor;
+    /** Lower bound of timeout in milliseconds */
+    long minTimeout;
+    /** Upper bound of timeout in milliseconds */
+    long maxTimeout;
+    /** Number of recent reply times of each command that are kept */
+    unsigned int window;
+    /** Number of reply times of command needed before its timeout is adapted */
+    unsigned int minSamples;
+
+private:
+    std::set<std::string> adaptedCommands;
+};
+}
+
+#endif //#ifndef CPS_ADAPTIVETIMEOUTPOLICY_HPP
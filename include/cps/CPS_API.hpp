@@ -7,6 +7,13 @@
 
 #include "Exception.hpp"
 #include "Connection.hpp"
+#include "Protocol.hpp"
+#include "RetryPolicy.hpp"
+#include "CancellationToken.hpp"
+#include "AdaptiveTimeoutPolicy.hpp"
+#include "ConnectionPool.hpp"
+#include "Transaction.hpp"
+#include "ClusterConnection.hpp"
 #include "Request.hpp"
 #include "Response.hpp"
 #include "Xmldocument.hpp"
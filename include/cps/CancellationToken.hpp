@@ -0,0 +1,150 @@
+#ifndef CPS_CANCELLATIONTOKEN_HPP
+#define CPS_CANCELLATIONTOKEN_HPP
+
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace CPS
+{
+
+/**
+ * @brief Allows aborting requests from another thread
+ *
+ * Copies of token share the same state, so token given to requests can be
+ * cancelled through any copy. Requests that have not completed when token
+ * is cancelled fail with error 9009
+ * @see Request::setCancellationToken()
+ */
+class CancellationToken
+{
+public:
+    typedef boost::function<void ()> Callback;
+
+    CancellationToken() :
+        state(new State()) {
+    }
+
+    /**
+     * Returns token that can not be cancelled
+     */
+    static CancellationToken none() {
+        return CancellationToken(boost::shared_ptr<State>());
+    }
+
+    /**
+     * Cancels all requests using this token, can be called from any thread
+     */
+    void cancel() {
+        if (!state)
+            return;
+        boost::mutex::scoped_lock lock(state->mutex);
+        if (state->cancelled)
+            return;
+        state->cancelled = true;
+        state->runningThread = boost::this_thread::get_id();
+        // Callbacks are called one at a time, so unsubscribe() knows which one to wait for
+        while (!state->callbacks.empty()) {
+            Callback callback = state->callbacks.begin()->second;
+            state->runningId = state->callbacks.begin()->first;
+            state->callbacks.erase(state->callbacks.begin());
+            lock.unlock();
+            try {
+                callback();
+            } catch (...) {
+                lock.lock();
+                finishCallback();
+                throw;
+            }
+            lock.lock();
+            finishCallback();
+        }
+    }
+
+    /**
+     * Returns false for token returned by none()
+     */
+    bool canBeCancelled() const {
+        return state.get() != NULL;
+    }
+
+    bool isCancelled() const {
+        if (!state)
+            return false;
+        boost::mutex::scoped_lock lock(state->mutex);
+        return state->cancelled;
+    }
+
+    /**
+     * Registers callback that is called once when token is cancelled,
+     * immediately if it already is
+     * @return id for unsubscribe(), 0 if callback will not be called later
+     */
+    unsigned long long subscribe(Callback callback) {
+        if (!state)
+            return 0;
+        {
+            boost::mutex::scoped_lock lock(state->mutex);
+            if (!state->cancelled) {
+                state->callbacks[++state->lastId] = callback;
+                return state->lastId;
+            }
+        }
+        callback();
+        return 0;
+    }
+
+    /**
+     * Removes callback registered by subscribe(). If cancel() is calling the callback
+     * in another thread, waits for it to return, so objects used by callback can be
+     * destroyed afterwards
+     * @param id id returned by subscribe()
+     */
+    void unsubscribe(unsigned long long id) {
+        if (!state || id == 0)
+            return;
+        boost::mutex::scoped_lock lock(state->mutex);
+        state->callbacks.erase(id);
+        if (state->runningThread == boost::this_thread::get_id())
+            return;
+        while (state->runningId == id) {
+            state->callbackFinished.wait(lock);
+        }
+    }
+
+private:
+    struct State {
+        State() :
+            cancelled(false), lastId(0), runningId(0) {
+        }
+
+        boost::mutex mutex;
+        bool cancelled;
+        unsigned long long lastId; /// Id of last registered callback
+        std::map<unsigned long long, Callback> callbacks;
+        unsigned long long runningId; /// Id of callback cancel() is calling, 0 if none
+        boost::thread::id runningThread; /// Thread that called cancel()
+        boost::condition_variable callbackFinished;
+    };
+
+    /**
+     * Called with mutex locked after callback returns
+     */
+    void finishCallback() {
+        state->runningId = 0;
+        state->callbackFinished.notify_all();
+    }
+
+    CancellationToken(boost::shared_ptr<State> state) :
+        state(state) {
+    }
+
+    boost::shared_ptr<State> state;
+};
+}
+
+#endif //#ifndef CPS_CANCELLATIONTOKEN_HPP
@@ -0,0 +1,873 @@
+#ifndef CPS_CLUSTERCONNECTION_HPP
+#define CPS_CLUSTERCONNECTION_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Connection.hpp"
+#include "ConnectionPool.hpp"
+#include "RetryPolicy.hpp"
+#include "AdaptiveTimeoutPolicy.hpp"
+#include "Request.hpp"
+#include "Response.hpp"
+#include "Exception.hpp"
+#include "requests/StatusRequest.hpp"
+
+namespace CPS
+{
+
+/**
+ * @brief Snapshot of state of one ClusterConnection node
+ * @see ClusterConnection::getNodeStatistics()
+ */
+class NodeStatistics
+{
+public:
+    NodeStatistics() :
+        healthy(true), outstanding(0), latency(0.0), requests(0), failures(0) {
+    }
+
+    /** Connection string of the node */
+    std::string connectionString;
+    /** Was last request or health check to the node successful */
+    bool healthy;
+    /** Number of requests currently in progress on the node */
+    unsigned int outstanding;
+    /** Exponentially weighted moving average of request time in seconds */
+    double latency;
+    /** Number of completed requests, including health checks */
+    unsigned long long requests;
+    /** Number of requests that failed because of connection problems */
+    unsigned long long failures;
+};
+
+/**
+ * @brief Decides when read request is also sent to a second node
+ *
+ * Request is hedged when first node has not answered within given percentile
+ * of recent request times. Reply that arrives first is used and the other request is cancelled.
+ * Cancelling request that has been sent closes its connection, so the connection is free for
+ * other requests at once, but next request over it has to connect again. Time of cancelled
+ * request is not used as latency of its node.
+ * Only commands that do not modify data are hedged
+ * @see ClusterConnection::setHedgePolicy()
+ */
+class HedgePolicy
+{
+public:
+    HedgePolicy() :
+        percentile(95.0), minDelay(1), maxRate(0.1), window(1000), minSamples(20) {
+        const char *commands[] = {"search", "lookup", "retrieve", "retrieve-first", "retrieve-last",
+                "list-first", "list-last", "similar"};
+        hedgedCommands.insert(commands, commands + sizeof(commands) / sizeof(commands[0]));
+    }
+
+    /**
+     * Returns policy that never hedges
+     */
+    static HedgePolicy none() {
+        HedgePolicy policy;
+        policy.maxRate = 0.0;
+        return policy;
+    }
+
+    bool isHedged(const std::string &command) const {
+        return maxRate > 0.0 && hedgedCommands.count(command) > 0;
+    }
+
+    void addHedgedCommand(const std::string &command) {
+        hedgedCommands.insert(command);
+    }
+
+    void removeHedgedCommand(const std::string &command) {
+        hedgedCommands.erase(command);
+    }
+
+    /** Percentile (0..100] of recent request times after which request is hedged */
+    double percentile;
+    /** Minimal time in milliseconds before request is hedged */
+    int minDelay;
+    /** Maximal fraction of requests that are hedged, limits extra load when all nodes slow down */
+    double maxRate;
+    /** Number of recent request times the percentile is taken from */
+    unsigned int window;
+    /** Number of request times needed before requests are hedged */
+    unsigned int minSamples;
+
+private:
+    std::set<std::string> hedgedCommands;
+};
+
+/**
+ * @brief Counters of hedged requests
+ * @see ClusterConnection::getHedgeStatistics()
+ */
+class HedgeStatistics
+{
+public:
+    HedgeStatistics() :
+        requests(0), hedged(0), wins(0) {
+    }
+
+    /**
+     * Returns fraction of requests that were sent to second node
+     */
+    double getHedgeRate() const {
+        return (requests > 0) ? static_cast<double>(hedged) / requests : 0.0;
+    }
+
+    /** Number of requests that could be hedged */
+    unsigned long long requests;
+    /** Number of requests sent to second node */
+    unsigned long long hedged;
+    /** Number of hedged requests answered by second node first */
+    unsigned long long wins;
+};
+
+/**
+ * @brief Thread-safe connection to several nodes of a cluster
+ *
+ * Keeps a ConnectionPool for every node and sends each request to the node that is
+ * expected to answer first: the one with fewest requests in progress or with lowest
+ * average latency, depending on balancing strategy.
+ * Requests of type "single" are always sent to the first available node in the order
+ * nodes were given, as they are processed only on the node receiving them.
+ * Requests with cluster label are sent only to nodes that have the label assigned,
+ * if there are any.
+ *
+ * Nodes that fail with connection errors are skipped until they answer StatusRequest,
+ * which is sent to them after health check interval. Idempotent requests that
+ * failed this way are sent to the next node.
+ *
+ * When constructed with io_service, read requests can be hedged, see setHedgePolicy().
+ */
+class ClusterConnection: private boost::noncopyable
+{
+public:
+    enum BalancingStrategy {
+        LEAST_OUTSTANDING, LOWEST_LATENCY
+    };
+
+    /**
+     * Constructs connection to cluster. Connections are not opened until
+     * they are first used or connect() is called.
+     *
+     * @param connectionStrings connection strings of cluster nodes, such as tcp://127.0.0.1:5550
+     * @param storageName The name of the storage you want to connect to
+     * @param username Username for authenticating with the storage
+     * @param password Password for this user
+     * @param documentRootXpath Document root tag name. Default is "document"
+     * @param documentIdXpath Document ID xpath. Default is "document/id"
+     * @param customEnvelopeParams additional envelope parameters sent with every request
+     * @param connectionsPerNode number of connections to each node
+     */
+    ClusterConnection(const std::vector<std::string> &connectionStrings, std::string storageName,
+                      std::string username, std::string password,
+                      std::string documentRootXpath = "document",
+                      std::string documentIdXpath = "document/id",
+                      std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType(),
+                      unsigned int connectionsPerNode = 1) {
+        init(NULL, connectionStrings, storageName, username, password,
+                documentRootXpath, documentIdXpath, customEnvelopeParams, connectionsPerNode);
+    }
+
+    /**
+     * @brief Constructs connection to cluster using external io_service
+     *
+     * Socket operations are run by the threads that run io_service, which allows
+     * hedging requests. Requests must not be sent from a handler running on
+     * the same io_service when it is run by a single thread.
+     *
+     * @param io_service io_service to run socket operations on
+     * @see ClusterConnection(const std::vector<std::string> &connectionStrings, std::string storageName, std::string username, std::string password, std::string documentRootXpath, std::string documentIdXpath, std::map<std::string, std::string> customEnvelopeParams, unsigned int connectionsPerNode)
+     */
+    ClusterConnection(asio::io_service &io_service, const std::vector<std::string> &connectionStrings,
+                      std::string storageName, std::string username, std::string password,
+                      std::string documentRootXpath = "document",
+                      std::string documentIdXpath = "document/id",
+                      std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType(),
+                      unsigned int connectionsPerNode = 1) {
+        init(&io_service, connectionStrings, storageName, username, password,
+                documentRootXpath, documentIdXpath, customEnvelopeParams, connectionsPerNode);
+    }
+
+    /**
+     * Waits for cancelled hedged requests to complete, so io_service must still be running
+     */
+    virtual ~ClusterConnection() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        while (this->runningAttempts > 0) {
+            this->attemptFinished.wait(lock);
+        }
+    }
+
+    /**
+     * Opens connections to all nodes, nodes that can not be reached are marked unhealthy
+     */
+    void connect() {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            try {
+                this->nodes[i]->pool->connect();
+            } catch (CPS::Exception &e) {
+                if (!Connection::isTransient(e))
+                    throw;
+                markFailed(*this->nodes[i]);
+            }
+        }
+    }
+
+    /**
+     * @brief Sends the request to the best node
+     *
+     * If node fails because of connection problems and request is idempotent
+     * according to retry policy, it is sent to the next best node
+     * @see Connection::sendRequest(const Request &request)
+     */
+    template<class ResponseType>
+    ResponseType* sendRequest(const Request &request) {
+        probeNodes();
+        bool idempotent = this->retryPolicy.maxRetries > 0 && this->retryPolicy.isIdempotent(request.getCommand());
+        std::vector<bool> tried(this->nodes.size(), false);
+        boost::posix_time::time_duration hedgeDelay;
+        if (getHedgeDelay(request, hedgeDelay)) {
+            ResponseType *resp = sendHedged<ResponseType>(request, tried, hedgeDelay);
+            if (resp)
+                return resp;
+        }
+        while (true) {
+            Node &node = selectNode(request, tried);
+            boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+            try {
+                boost::shared_ptr<Connection> conn = node.pool->acquire(request);
+                ResponseType *resp = conn->sendRequest<ResponseType>(request);
+                finishRequest(node, start, true);
+                return resp;
+            } catch (CPS::Exception &e) {
+                bool failed = Connection::isTransient(e);
+                finishRequest(node, start, reachedNode(e));
+                if (failed)
+                    markFailed(node);
+                if (!failed || !idempotent || std::find(tried.begin(), tried.end(), false) == tried.end())
+                    throw;
+            }
+        }
+    }
+
+    /**
+     * Sends the request and returns generic response
+     * @see sendRequest(const Request &request)
+     */
+    Response *sendRequest(const Request &request) {
+        return sendRequest<Response>(request);
+    }
+
+    /**
+     * @brief Sends StatusRequest to every node and updates their health
+     *
+     * Can be called periodically to detect failed and recovered nodes
+     * before requests are sent to them
+     * @return number of healthy nodes
+     */
+    unsigned int checkHealth() {
+        unsigned int healthy = 0;
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            if (checkNode(*this->nodes[i]))
+                healthy++;
+        }
+        return healthy;
+    }
+
+    /**
+     * Assigns cluster label to node, requests with this label are sent only to labeled nodes
+     * @param connectionString connection string of node as given to constructor
+     * @param label cluster nodeset label
+     * @see Request::setClusterLabel()
+     */
+    void addNodeLabel(const std::string &connectionString, const std::string &label) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            if (this->nodes[i]->stats.connectionString == connectionString) {
+                this->nodes[i]->labels.insert(label);
+                return;
+            }
+        }
+        BOOST_THROW_EXCEPTION(CPS::Exception("Unknown cluster node", 9006));
+    }
+
+    /**
+     * Sets how node for request of type other than "single" is chosen
+     */
+    void setBalancingStrategy(BalancingStrategy strategy) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->strategy = strategy;
+    }
+
+    /**
+     * Sets weight (0..1] of latest request time in average latency of node
+     */
+    void setLatencyWeight(double weight) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->latencyWeight = weight;
+    }
+
+    /**
+     * Sets time after which unhealthy node is checked again before sending request
+     * @param interval in milliseconds, negative value disables automatic checks
+     */
+    void setHealthCheckInterval(int interval = 5000) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->healthCheckInterval = interval;
+    }
+
+    /**
+     * @brief Sets policy of sending read requests to second node when first one is slow
+     *
+     * Hedging is disabled by default and needs cluster constructed with io_service.
+     * Requests of type "single" are never hedged
+     * @see HedgePolicy
+     */
+    void setHedgePolicy(const HedgePolicy &hedgePolicy) {
+        if (!this->io_service && hedgePolicy.maxRate > 0.0) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Hedging requires cluster connection with io_service", 9006));
+        }
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->hedgePolicy = hedgePolicy;
+        this->latencies.reset(hedgePolicy.window);
+    }
+
+    const HedgePolicy &getHedgePolicy() const {
+        return this->hedgePolicy;
+    }
+
+    /**
+     * Returns hedging counters accumulated since construction or last resetHedgeStatistics()
+     */
+    HedgeStatistics getHedgeStatistics() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        return this->hedgeStats;
+    }
+
+    void resetHedgeStatistics() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->hedgeStats = HedgeStatistics();
+    }
+
+    /**
+     * Sets the default time to wait for a free connection to a node
+     * @see ConnectionPool::setAcquireTimeout()
+     */
+    void setAcquireTimeout(int timeout = -1) {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setAcquireTimeout(timeout);
+        }
+    }
+
+    /**
+     * Sets the application ID on all connections
+     * @see Connection::setApplicationId()
+     */
+    void setApplicationId(const std::string &applicationId = "CPS_CPP_API") {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setApplicationId(applicationId);
+        }
+    }
+
+    /**
+     * Sets the debugging mode on all connections
+     * @see Connection::setDebug()
+     */
+    void setDebug(bool debug) {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setDebug(debug);
+        }
+    }
+
+    /**
+     * Sets socket timeouts in seconds on all connections
+     * @see Connection::setSocketTimeouts()
+     */
+    void setSocketTimeouts(int connectTimeout = 5, int sendTimeout = 30, int recieveTimeout = 60) {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setSocketTimeouts(connectTimeout, sendTimeout, recieveTimeout);
+        }
+    }
+
+    /**
+     * Sets socket options on all connections
+     * @see Connection::setSocketOptions()
+     */
+    void setSocketOptions(const SocketOptions &options) {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setSocketOptions(options);
+        }
+    }
+
+    /**
+     * Sets retry policy of all connections. Policy also decides which
+     * requests are sent to another node after connection failure
+     * @see Connection::setRetryPolicy()
+     */
+    void setRetryPolicy(const RetryPolicy &retryPolicy) {
+        this->retryPolicy = retryPolicy;
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setRetryPolicy(retryPolicy);
+        }
+    }
+
+    /**
+     * Sets adaptive timeout policy of all connections
+     * @see Connection::setAdaptiveTimeoutPolicy()
+     */
+    void setAdaptiveTimeoutPolicy(const AdaptiveTimeoutPolicy &adaptiveTimeoutPolicy) {
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            this->nodes[i]->pool->setAdaptiveTimeoutPolicy(adaptiveTimeoutPolicy);
+        }
+    }
+
+    /**
+     * Returns number of nodes in the cluster
+     */
+    unsigned int size() const {
+        return this->nodes.size();
+    }
+
+    /**
+     * Returns state of all nodes in the order they were given to constructor
+     */
+    std::vector<NodeStatistics> getNodeStatistics() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        std::vector<NodeStatistics> result;
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            result.push_back(this->nodes[i]->stats);
+        }
+        return result;
+    }
+
+private:
+    void init(asio::io_service *io_service, const std::vector<std::string> &connectionStrings,
+              const std::string &storageName, const std::string &username, const std::string &password,
+              const std::string &documentRootXpath, const std::string &documentIdXpath,
+              const std::map<std::string, std::string> &customEnvelopeParams, unsigned int connectionsPerNode) {
+        if (connectionStrings.empty()) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Cluster must have at least one node", 9006));
+        }
+        for (unsigned int i = 0; i < connectionStrings.size(); i++) {
+            boost::shared_ptr<Node> node(new Node());
+            node->stats.connectionString = connectionStrings[i];
+            node->pool.reset(io_service ?
+                    new ConnectionPool(*io_service, connectionsPerNode, connectionStrings[i], storageName,
+                            username, password, documentRootXpath, documentIdXpath, customEnvelopeParams) :
+                    new ConnectionPool(connectionsPerNode, connectionStrings[i], storageName,
+                            username, password, documentRootXpath, documentIdXpath, customEnvelopeParams));
+            this->nodes.push_back(node);
+        }
+        this->io_service = io_service;
+        this->strategy = LEAST_OUTSTANDING;
+        this->latencyWeight = 0.2;
+        this->healthCheckInterval = 5000;
+        this->nextNode = 0;
+        this->hedgePolicy = HedgePolicy::none();
+        this->runningAttempts = 0;
+    }
+
+    /**
+     * Cluster node with its connections and routing state, guarded by cluster mutex
+     */
+    struct Node {
+        Node() :
+            checking(false) {
+        }
+
+        boost::shared_ptr<ConnectionPool> pool;
+        std::set<std::string> labels; /// Cluster labels assigned to node
+        NodeStatistics stats;
+        boost::posix_time::ptime nextCheck; /// Time when unhealthy node is checked again
+        bool checking; /// Is health check of node in progress
+    };
+
+    /**
+     * Chooses node that has not been tried yet for request and counts request as outstanding on it
+     */
+    Node &selectNode(const Request &request, std::vector<bool> &tried) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        std::vector<unsigned int> candidates;
+        std::string label = request.getClusterLabel();
+        if (!label.empty()) {
+            for (unsigned int i = 0; i < this->nodes.size(); i++) {
+                if (!tried[i] && this->nodes[i]->labels.count(label))
+                    candidates.push_back(i);
+            }
+        }
+        if (candidates.empty()) {
+            for (unsigned int i = 0; i < this->nodes.size(); i++) {
+                if (!tried[i])
+                    candidates.push_back(i);
+            }
+        }
+        if (candidates.empty()) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("No cluster node available", 9006));
+        }
+
+        // When all candidates are unhealthy, request itself checks whether they recovered
+        std::vector<unsigned int> healthy;
+        for (unsigned int i = 0; i < candidates.size(); i++) {
+            if (this->nodes[candidates[i]]->stats.healthy)
+                healthy.push_back(candidates[i]);
+        }
+        if (!healthy.empty())
+            candidates.swap(healthy);
+
+        unsigned int best = candidates[0];
+        if (request.getRequestType() != "single") {
+            // Start from rotating position, so equally loaded nodes share requests
+            unsigned int offset = this->nextNode++ % candidates.size();
+            best = candidates[offset];
+            for (unsigned int i = 1; i < candidates.size(); i++) {
+                unsigned int index = candidates[(offset + i) % candidates.size()];
+                if (isBetter(this->nodes[index]->stats, this->nodes[best]->stats))
+                    best = index;
+            }
+        }
+        tried[best] = true;
+        this->nodes[best]->stats.outstanding++;
+        return *this->nodes[best];
+    }
+
+    bool isBetter(const NodeStatistics &a, const NodeStatistics &b) const {
+        if (this->strategy == LOWEST_LATENCY) {
+            if (a.latency != b.latency)
+                return a.latency < b.latency;
+            return a.outstanding < b.outstanding;
+        }
+        if (a.outstanding != b.outstanding)
+            return a.outstanding < b.outstanding;
+        return a.latency < b.latency;
+    }
+
+    /**
+     * Removes request from outstanding ones and adds its time to node latency
+     * @param measured was request answered by server
+     */
+    void finishRequest(Node &node, const boost::posix_time::ptime &start, bool measured) {
+        double seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+        boost::mutex::scoped_lock lock(this->mutex);
+        node.stats.outstanding--;
+        node.stats.requests++;
+        if (measured) {
+            node.stats.latency = (node.stats.latency == 0.0) ? seconds :
+                    this->latencyWeight * seconds + (1.0 - this->latencyWeight) * node.stats.latency;
+            node.stats.healthy = true;
+            if (this->hedgePolicy.maxRate > 0.0)
+                this->latencies.add(seconds);
+        }
+    }
+
+    /**
+     * Returns time after which request is sent to second node, if request should be hedged
+     */
+    bool getHedgeDelay(const Request &request, boost::posix_time::time_duration &delay) {
+        if (!this->io_service || request.getRequestType() == "single" || this->nodes.size() < 2)
+            return false;
+        boost::mutex::scoped_lock lock(this->mutex);
+        if (!this->hedgePolicy.isHedged(request.getCommand())
+                || this->latencies.count() == 0 || this->latencies.count() < this->hedgePolicy.minSamples)
+            return false;
+        long milliseconds = std::max(static_cast<long>(this->latencies.getPercentile(this->hedgePolicy.percentile) * 1000.0 + 0.5),
+                static_cast<long>(this->hedgePolicy.minDelay));
+        delay = boost::posix_time::milliseconds(milliseconds);
+        return true;
+    }
+
+    /**
+     * Request sent to up to two nodes, guarded by its own mutex
+     */
+    template<class ResponseType>
+    struct HedgedRequest {
+        struct Attempt {
+            Attempt() :
+                node(NULL), finished(false), cancelled(false) {
+            }
+
+            Node *node;
+            boost::shared_ptr<Connection> connection; /// Checked out connection, released when attempt finishes
+            boost::posix_time::ptime start;
+            bool finished;
+            bool cancelled;
+        };
+
+        HedgedRequest() :
+            response(NULL), winner(0), sent(0), completed(0) {
+        }
+
+        Attempt attempts[2];
+        ResponseType *response; /// First successful reply
+        unsigned int winner; /// Attempt that delivered response
+        boost::exception_ptr error; /// First error if no attempt succeeded
+        unsigned int sent;
+        unsigned int completed;
+        boost::mutex mutex;
+        boost::condition_variable done;
+    };
+
+    /**
+     * Sends request to best node and, if it does not answer within delay, also to the next one
+     * @return reply or NULL if all attempts failed because of connection problems and other nodes remain
+     */
+    template<class ResponseType>
+    ResponseType *sendHedged(const Request &request, std::vector<bool> &tried,
+            const boost::posix_time::time_duration &delay) {
+        boost::shared_ptr<HedgedRequest<ResponseType> > hedged(new HedgedRequest<ResponseType>());
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            this->hedgeStats.requests++;
+        }
+        Node &node = selectNode(request, tried);
+        try {
+            startAttempt(hedged, 0, node, request, -1);
+        } catch (CPS::Exception &e) {
+            // Node without connection is skipped like when request to it fails
+            bool failed = Connection::isTransient(e);
+            if (failed)
+                markFailed(node);
+            if ((!failed && e.errorCode != 9006) || std::find(tried.begin(), tried.end(), false) == tried.end())
+                throw;
+            return NULL;
+        }
+
+        boost::mutex::scoped_lock lock(hedged->mutex);
+        boost::posix_time::ptime hedgeAt = hedged->attempts[0].start + delay;
+        bool hedgeTried = false;
+        while (!hedged->response && hedged->completed < hedged->sent) {
+            if (hedgeTried) {
+                hedged->done.wait(lock);
+            } else if (!hedged->done.timed_wait(lock, hedgeAt)) {
+                hedgeTried = true;
+                lock.unlock();
+                startHedge(hedged, request, tried);
+                lock.lock();
+            }
+        }
+
+        if (hedged->response) {
+            for (unsigned int i = 0; i < hedged->sent; i++) {
+                if (!hedged->attempts[i].finished) {
+                    hedged->attempts[i].cancelled = true;
+                    hedged->attempts[i].connection->cancel();
+                }
+            }
+            ResponseType *resp = hedged->response;
+            unsigned int winner = hedged->winner;
+            lock.unlock();
+            if (winner > 0) {
+                boost::mutex::scoped_lock statsLock(this->mutex);
+                this->hedgeStats.wins++;
+            }
+            return resp;
+        }
+
+        boost::exception_ptr error = hedged->error;
+        lock.unlock();
+        try {
+            boost::rethrow_exception(error);
+        } catch (CPS::Exception &e) {
+            if (!Connection::isTransient(e) || std::find(tried.begin(), tried.end(), false) == tried.end())
+                throw;
+        }
+        return NULL;
+    }
+
+    template<class ResponseType>
+    void startHedge(boost::shared_ptr<HedgedRequest<ResponseType> > hedged, const Request &request,
+            std::vector<bool> &tried) {
+        if (std::find(tried.begin(), tried.end(), false) == tried.end())
+            return;
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            if (this->hedgeStats.hedged >= this->hedgePolicy.maxRate * this->hedgeStats.requests)
+                return;
+            this->hedgeStats.hedged++;
+        }
+        try {
+            // Second node is used only if it has a free connection
+            startAttempt(hedged, 1, selectNode(request, tried), request, 0);
+        } catch (CPS::Exception &) {
+        }
+    }
+
+    /**
+     * Checks out connection of node and sends request over it asynchronously
+     * @param acquireTimeout time to wait for free connection, negative value uses pool default
+     */
+    template<class ResponseType>
+    void startAttempt(boost::shared_ptr<HedgedRequest<ResponseType> > hedged, unsigned int slot, Node &node,
+            const Request &request, int acquireTimeout) {
+        typename HedgedRequest<ResponseType>::Attempt &attempt = hedged->attempts[slot];
+        attempt.node = &node;
+        attempt.start = boost::posix_time::microsec_clock::universal_time();
+        boost::shared_ptr<Connection> conn;
+        boost::shared_ptr<Connection::PendingRequest> pending;
+        try {
+            conn = node.pool->acquire(request, acquireTimeout);
+            pending = conn->createPendingRequest(request);
+        } catch (CPS::Exception &) {
+            finishRequest(node, attempt.start, false);
+            throw;
+        }
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            this->runningAttempts++;
+        }
+        {
+            boost::mutex::scoped_lock lock(hedged->mutex);
+            attempt.connection = conn;
+            hedged->sent++;
+        }
+        conn->enqueueRequest<ResponseType>(pending,
+                boost::bind(&ClusterConnection::completeAttempt<ResponseType>, this, hedged, slot, _1, _2));
+    }
+
+    /**
+     * Receives reply or error of one attempt in thread running io_service
+     */
+    template<class ResponseType>
+    void completeAttempt(boost::shared_ptr<HedgedRequest<ResponseType> > hedged, unsigned int slot,
+            ResponseType *resp, boost::exception_ptr error) {
+        typename HedgedRequest<ResponseType>::Attempt &attempt = hedged->attempts[slot];
+        bool aborted;
+        {
+            boost::mutex::scoped_lock lock(hedged->mutex);
+            aborted = attempt.cancelled;
+        }
+        bool failed = false;
+        if (error && !aborted) {
+            try {
+                boost::rethrow_exception(error);
+            } catch (CPS::Exception &e) {
+                failed = Connection::isTransient(e);
+                aborted = e.errorCode == 9008 || e.errorCode == 9009;
+            } catch (...) {
+            }
+        }
+        // Time of attempt cancelled by the other one, by caller or past its deadline tells nothing about node
+        finishRequest(*attempt.node, attempt.start, !failed && !aborted);
+        if (failed)
+            markFailed(*attempt.node);
+
+        boost::shared_ptr<Connection> conn;
+        {
+            boost::mutex::scoped_lock lock(hedged->mutex);
+            if (resp && !hedged->response) {
+                hedged->response = resp;
+                hedged->winner = slot;
+                resp = NULL;
+            } else if (error && !hedged->error) {
+                hedged->error = error;
+            }
+            attempt.finished = true;
+            conn.swap(attempt.connection);
+            hedged->completed++;
+            hedged->done.notify_all();
+        }
+        // Reply that lost the race
+        delete resp;
+        // Connection goes back to pool
+        conn.reset();
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            this->runningAttempts--;
+        }
+        this->attemptFinished.notify_all();
+    }
+
+    void markFailed(Node &node) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        node.stats.failures++;
+        node.stats.healthy = false;
+        node.nextCheck = boost::posix_time::microsec_clock::universal_time()
+                + boost::posix_time::milliseconds(this->healthCheckInterval);
+    }
+
+    /**
+     * Checks unhealthy nodes whose health check interval has passed
+     */
+    void probeNodes() {
+        std::vector<Node*> due;
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            if (this->healthCheckInterval < 0)
+                return;
+            boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+            for (unsigned int i = 0; i < this->nodes.size(); i++) {
+                Node &node = *this->nodes[i];
+                if (!node.stats.healthy && !node.checking && node.nextCheck <= now) {
+                    node.checking = true;
+                    due.push_back(&node);
+                }
+            }
+        }
+        for (unsigned int i = 0; i < due.size(); i++) {
+            checkNode(*due[i]);
+            boost::mutex::scoped_lock lock(this->mutex);
+            due[i]->checking = false;
+        }
+    }
+
+    /**
+     * Returns true if request that failed with given error was answered by node,
+     * as error replies from server still show that node is alive
+     */
+    static bool reachedNode(const CPS::Exception &e) {
+        return !Connection::isTransient(e) && e.errorCode != 9006 && e.errorCode != 9008 && e.errorCode != 9009;
+    }
+
+    bool checkNode(Node &node) {
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            node.stats.outstanding++;
+        }
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        try {
+            // Node whose connections are all in use is not waited for, replies to those requests show its health
+            boost::shared_ptr<Connection> conn = node.pool->acquire(0);
+            delete conn->sendRequest(StatusRequest());
+        } catch (CPS::Exception &e) {
+            bool failed = Connection::isTransient(e);
+            finishRequest(node, start, reachedNode(e));
+            if (failed)
+                markFailed(node);
+            return !failed;
+        }
+        finishRequest(node, start, true);
+        return true;
+    }
+
+private:
+    std::vector<boost::shared_ptr<Node> > nodes; /// Nodes in the order given to constructor
+    BalancingStrategy strategy;
+    double latencyWeight; /// Weight of latest request time in average latency
+    int healthCheckInterval; /// Time in milliseconds before unhealthy node is checked again
+    unsigned int nextNode; /// Rotating start position of node selection
+    RetryPolicy retryPolicy;
+
+    asio::io_service *io_service; /// io_service running socket operations, NULL if connections run their own
+    HedgePolicy hedgePolicy;
+    HedgeStatistics hedgeStats;
+    LatencyWindow latencies; /// Recent request times used to decide when to hedge
+    unsigned int runningAttempts; /// Asynchronous attempts that have not completed yet
+
+    boost::mutex mutex;
+    boost::condition_variable attemptFinished;
+};
+}
+
+#endif //#ifndef CPS_CLUSTERCONNECTION_HPP
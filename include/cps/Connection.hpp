@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <algorithm>
 
 #ifndef USE_HEADER_ONLY_ASIO
     #include "boost/asio.hpp"
@@ -18,8 +20,21 @@
 #include "Request.hpp"
 #include "Exception.hpp"
 #include "Protobuf.hpp"
+#include "Protocol.hpp"
 #include "Utils.hpp"
 #include "Socket.hpp"
+#include "Transport.hpp"
+#include "RetryPolicy.hpp"
+#include "CancellationToken.hpp"
+#include "AdaptiveTimeoutPolicy.hpp"
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 namespace CPS
 {
@@ -32,6 +47,16 @@ enum ConnectionType {
     SOCKET, TCP, HTTP
 };
 
+/**
+ * @brief Completion handler type of asynchronous requests
+ * Handler receives either response or exception that occurred while processing the request
+ * @see Connection::sendRequestAsync()
+ */
+template<class ResponseType>
+struct AsyncResponseHandler {
+    typedef boost::function<void (boost::shared_ptr<ResponseType>, boost::exception_ptr)> type;
+};
+
 class Connection
 {
 public:
@@ -41,8 +66,10 @@ public:
      * Constructs an instance of the Connection class. Note that it doesn't
      * necessarily make a connection to CPS when the constructor is called.
      *
-     * @param connectionString Specifies the connection string, such as tcp://127.0.0.1:5550
-     * @param storageName The name of the storage you want to connect to
+     * @param connectionString Specifies the connection string, such as tcp://127.0.0.1:5550.
+     * Schemes other than tcp://, unix:// and http:// are looked up in TransportRegistry
+     * @param storageName The name of the storage you want to connect to.
+     * Requests can be sent to other storages over the same socket with Request::setStorage()
      * @param username Username for authenticating with the storage
      * @param password Password for this user
      * @param documentRootXpath Document root tag name. Default is "document"
@@ -52,7 +79,85 @@ public:
                std::string username, std::string password,
                std::string documentRootXpath = "document",
                std::string documentIdXpath = "document/id",
-               std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType()) {
+               std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType()) :
+        ownedIoService(new asio::io_service()), io_service(*ownedIoService) {
+        init(connectionString, storageName, username, password, documentRootXpath, documentIdXpath, customEnvelopeParams);
+    }
+
+    /**
+     * @brief Connection API to Clusterpoint Server using external io_service
+     *
+     * Socket operations of this connection are run by the threads that run io_service,
+     * so many connections can share one io_service and keep requests in flight at the same time.
+     * Synchronous calls wait for those threads to complete the request and must not be
+     * made from a handler running on the same io_service when it is run by a single thread.
+     * Timeouts of all connections on io_service share one TimerWheel and idle connection
+     * holds no buffers, so thousands of connections, e.g. one per storage, are cheap.
+     *
+     * @param io_service io_service to run socket operations on
+     * @see Connection(std::string connectionString, std::string storageName, std::string username, std::string password, std::string documentRootXpath, std::string documentIdXpath, std::map<std::string, std::string> customEnvelopeParams)
+     */
+    Connection(asio::io_service &io_service, std::string connectionString, std::string storageName,
+               std::string username, std::string password,
+               std::string documentRootXpath = "document",
+               std::string documentIdXpath = "document/id",
+               std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType()) :
+        io_service(io_service) {
+        init(connectionString, storageName, username, password, documentRootXpath, documentIdXpath, customEnvelopeParams);
+    }
+
+    /**
+     * Closes the connection.
+     * Connection must not be destroyed while asynchronous requests are outstanding
+     */
+    virtual ~Connection() {
+        if (socket)
+            socket->close();
+    }
+
+    /**
+     * Connect to server
+     */
+    void connect() {
+        // Connect to server if needed
+        if (socket->isConnected() == false) {
+            // Connecting is done in socket strand, like sending of requests
+            boost::shared_ptr<boost::promise<ErrorCode> > promise(new boost::promise<ErrorCode>());
+            boost::unique_future<ErrorCode> result = promise->get_future();
+            socket->getStrand().post(boost::bind(&Connection::startConnect, this, promise));
+            if (this->ownedIoService)
+                runUntilReady(result);
+            ErrorCode ec = result.get();
+            if (ec) {
+                BOOST_THROW_EXCEPTION(socketException("Connection error - Could not connect. ", ec));
+            }
+        }
+    }
+
+    /**
+     * Returns io_service that runs socket operations of this connection.
+     * When connection owns io_service, it has to be run to process asynchronous requests
+     */
+    asio::io_service &getIoService() {
+        return this->io_service;
+    }
+
+    /**
+     * @brief Aborts asynchronous requests of this connection that have not completed yet
+     *
+     * Connection is closed if replies are awaited, so they are not read anymore.
+     * Aborted requests fail with operation_aborted error and are not retried.
+     * Connection is opened again for following requests
+     */
+    void cancel() {
+        socket->getStrand().post(boost::bind(&Connection::cancelRequests, this));
+    }
+
+private:
+    void init(std::string connectionString, std::string storageName,
+              std::string username, std::string password,
+              std::string documentRootXpath, std::string documentIdXpath,
+              std::map<std::string, std::string> customEnvelopeParams) {
         this->connectionString = connectionString;
         this->storageName = storageName;
         this->username = username;
@@ -69,6 +174,14 @@ public:
         this->documentRootXpath = documentRootXpath;
         this->documentIdXpath = documentIdXpath;
         this->customEnvelopeParams = customEnvelopeParams;
+        // Socket options can be given as query parameters, e.g. tcp://host:5550?keepalive=60&sndbuf=65536.
+        // Query of HTTP URL belongs to the URL
+        SocketOptions options;
+        size_t queryPos = connectionString.find('?');
+        if (queryPos != std::string::npos && strncmp(connectionString.c_str(), "http://", 7) != 0) {
+            options = parseSocketOptions(connectionString.substr(queryPos + 1));
+            connectionString = connectionString.substr(0, queryPos);
+        }
         // Parse connection string
         if (connectionString.empty() || connectionString == "unix://") {
             // Default connection
@@ -122,33 +235,29 @@ public:
                 this->port = atoi(connectionString.substr(portDelim + 1).c_str());
             }
             socket = boost::shared_ptr<AbstractSocket>(new TcpSocket(this->io_service));
+        } else if ((socket = TransportRegistry::instance().create(this->io_service, connectionString, this->host))) {
+            // Registered transport, e.g. inproc://name, carries the same frames as TCP
+            this->connectionType = TCP;
+            this->port = 0;
         } else {
             BOOST_THROW_EXCEPTION(CPS::Exception("Invalid connection protocol", 9004));
         }
+        socket->setOptions(options);
 
         this->applicationId = "CPS_CPP_API";
+        updateEnvelopePrefix();
         this->debug = false;
         this->noCdata = false;
         this->createXML = false;
         this->transactionId = -1;
+        this->connecting = false;
+        this->writing = false;
+        this->reading = false;
+        this->maxPipelinedRequests = 1;
+        this->lastRequestId = 0;
     }
 
-    virtual ~Connection() {
-    }
-
-    /**
-     * Connect to server
-     */
-    void connect() {
-        // Connect to server if needed
-        if (socket->isConnected() == false) {
-            try {
-                socket->connect(this->host, this->port);
-            } catch (std::exception &e) {
-                BOOST_THROW_EXCEPTION(CPS::Exception(std::string("Connection error - ") + e.what()));
-            }
-        }
-    }
+public:
 
     /**
      * Sends raw xml message (no parsing or formatting is performed)
@@ -156,68 +265,15 @@ public:
      * @param xml string
      */
     template<class ResponseType>
-    ResponseType *sendRequestRaw(std::string message) {
-        if (this->debug)
-            std::cout << "Request:\n" << message << std::endl;
-
-        this->connect();
-
-        try {
-            if (this->connectionType == HTTP) {
-                // Only HTTP requests send unformatted data
-                std::vector<unsigned char> reply = socket->send(message);
-                if (this->debug)
-                            std::cout << "Response:\n" << std::string(reply.begin(), reply.end()) << std::endl;
-                return new ResponseType(std::string(reply.begin(), reply.end()));
-            } else {
-                // Other requests send data formated using ProtoBuffers
-                // (http://code.google.com/apis/protocolbuffers/docs/encoding.html)
-                std::string frame = "";
-
-                Protobuf pb;
-                pb.newFieldString(1, message);
-                if (this->storageName.size() > 0) pb.newFieldString(2, this->storageName);
-//                pb.newFieldBool(12, true);
-//                pb.newFieldString(13, std::to_string(rand()));
-                frame += pb.toString();
-
-                frame = header(frame.size()) + frame;
-
-                // Send request and get reply
-                std::vector<unsigned char> reply = socket->send(frame);
-
-                pb.fromBytes(reply);
-
-                if (this->debug)
-                            std::cout << "Response:\n" << pb.getField(1)->data << std::endl;
-
-                ResponseType *resp = new ResponseType(pb.getField(1)->data);
-                resp->documentRootXpath = this->documentRootXpath;
-                resp->documentIdXpath = this->documentIdXpath;
-                if (resp->getCommand() == "begin-transaction") {
-                	this->transactionId = resp->getParam("transaction_id", -1LL);
-                } else if (resp->getCommand() == "commit-transaction" || resp->getCommand() == "rollback-transaction") {
-                	this->transactionId = -1;
-                }
-                if (resp->getErrors().size() > 0 && resp->hasFailed()) {
-                	std::vector <Error> errors = resp->getErrors();
-                	BOOST_THROW_EXCEPTION(CPS::Exception(errors[0].message, boost::lexical_cast<int>(errors[0].code), resp));
-                }
-                return resp;
-            }
-        } catch (CPS::Exception &e) {
-        	// Redirect valid exception up the chain
-        	throw e;
-        } catch (std::exception &e) {
-            BOOST_THROW_EXCEPTION(CPS::Exception(std::string("Error while sending - ") + e.what()));
-        }
+    ResponseType *sendRequestRaw(const std::string &message) {
+        return sendMessage<ResponseType>(message, this->storageName, boost::posix_time::ptime(), CancellationToken::none());
     }
 
     /**
      * Sends the raw xml request and returns generic response
      * @see sendRequest(string message)
      */
-    Response *sendRequestRaw(std::string message) {
+    Response *sendRequestRaw(const std::string &message) {
         return sendRequestRaw<Response>(message);
     }
 
@@ -232,28 +288,8 @@ public:
      */
     template<class ResponseType>
     ResponseType* sendRequest(const Request &request) {
-        // Create request
-        std::map<std::string, std::vector<std::string> > envelopeParams;
-        for (std::map<std::string, std::string>::iterator it = this->customEnvelopeParams.begin(); it != this->customEnvelopeParams.end(); ++it) {
-        	envelopeParams[it->first].push_back(it->second);
-        }
-        envelopeParams["storage"].push_back(this->storageName);
-        envelopeParams["user"].push_back(this->username);
-        envelopeParams["password"].push_back(this->password);
-        envelopeParams["command"].push_back(request.getCommand());
-        if (!request.getRequestId().empty())
-            envelopeParams["requestid"].push_back(request.getRequestId());
-        if (!this->applicationId.empty())
-            envelopeParams["application"].push_back(this->applicationId);
-        if (!request.getRequestType().empty())
-            envelopeParams["type"].push_back(request.getRequestType());
-        if (!request.getClusterLabel().empty())
-            envelopeParams["label"].push_back(request.getClusterLabel());
-
-        std::string message = request.getRequestXml(this->documentRootXpath,
-                              this->documentIdXpath, envelopeParams, this->createXML, this->transactionId);
-
-        return sendRequestRaw<ResponseType>(message);
+        return sendMessage<ResponseType>(getRequestMessage(request), getRequestStorage(request),
+                request.getDeadline(), request.getCancellationToken());
     }
 
     /**
@@ -264,6 +300,57 @@ public:
         return sendRequest<Response>(request);
     }
 
+    /**
+     * @brief Sends the request to CPS without waiting for the reply
+     *
+     * Requests are sent in the order they were made, handler is called from a thread
+     * running getIoService() once the reply is received or request has failed.
+     * Request object can be destroyed as soon as this method returns.
+     *
+     * @param request An object of the class Request
+     * @param handler function receiving response or exception
+     */
+    template<class ResponseType>
+    void sendRequestAsync(const Request &request, typename AsyncResponseHandler<ResponseType>::type handler) {
+        sendPendingAsync<ResponseType>(createPendingRequest(request), handler);
+    }
+
+    /**
+     * @brief Sends the request to CPS without waiting for the reply
+     *
+     * @param request An object of the class Request
+     * @return future that becomes ready once the reply is received or request has failed
+     * @see sendRequestAsync(const Request &request, typename AsyncResponseHandler<ResponseType>::type handler)
+     */
+    template<class ResponseType>
+    boost::unique_future<boost::shared_ptr<ResponseType> > sendRequestAsync(const Request &request) {
+        return sendPendingAsync<ResponseType>(createPendingRequest(request));
+    }
+
+    /**
+     * Sends raw xml message without waiting for the reply
+     * @see sendRequestAsync(const Request &request, typename AsyncResponseHandler<ResponseType>::type handler)
+     */
+    template<class ResponseType>
+    void sendRequestRawAsync(const std::string &message, typename AsyncResponseHandler<ResponseType>::type handler) {
+        boost::shared_ptr<PendingRequest> pending(new PendingRequest());
+        pending->data = message;
+        pending->storage = this->storageName;
+        sendPendingAsync<ResponseType>(pending, handler);
+    }
+
+    /**
+     * Sends raw xml message without waiting for the reply
+     * @see sendRequestAsync(const Request &request)
+     */
+    template<class ResponseType>
+    boost::unique_future<boost::shared_ptr<ResponseType> > sendRequestRawAsync(const std::string &message) {
+        boost::shared_ptr<PendingRequest> pending(new PendingRequest());
+        pending->data = message;
+        pending->storage = this->storageName;
+        return sendPendingAsync<ResponseType>(pending);
+    }
+
     /**
      * @brief Sets the application ID for the request
      *
@@ -274,6 +361,7 @@ public:
      */
     void setApplicationId(const std::string &applicationId = "CPS_CPP_API") {
         this->applicationId = applicationId;
+        updateEnvelopePrefix();
     }
 
     /**
@@ -347,7 +435,9 @@ public:
     }
 
     /**
-     * Sets corresponding socket timeouts in seconds
+     * Sets corresponding socket timeouts in seconds.
+     * They limit each operation, total time of request is limited by its deadline
+     * @see Request::setDeadline()
      * @param connectTimeout in seconds
      * @param sendTimeout in seconds
      * @param recieveTimeout in seconds
@@ -359,22 +449,862 @@ public:
     	socket->recieveTimeout = recieveTimeout;
     }
 
+    /**
+     * @brief Sets options of socket, such as TCP_NODELAY, keepalive and buffer sizes
+     *
+     * Options are applied when connection is (re)established.
+     * They can also be given as connection string query parameters:
+     * nodelay, keepalive, keepalive_interval, keepalive_count, sndbuf, rcvbuf and busy_poll,
+     * e.g. tcp://127.0.0.1:5550?keepalive=60&keepalive_interval=10&rcvbuf=262144.
+     * Value of keepalive is idle time in seconds, keepalive=1 uses system default idle time.
+     * Query of http:// connection string is part of the URL, so options of HTTP connections
+     * are set only with this method
+     * @see SocketOptions
+     */
+    void setSocketOptions(const SocketOptions &options) {
+        if (!socket) return;
+        socket->setOptions(options);
+    }
+
+    SocketOptions getSocketOptions() const {
+        return socket->getOptions();
+    }
+
+    /**
+     * @brief Sets policy of sending requests again after connection failures
+     *
+     * By default read-only commands and update are retried up to 2 times
+     * @see RetryPolicy
+     */
+    void setRetryPolicy(const RetryPolicy &retryPolicy) {
+        this->retryPolicy = retryPolicy;
+    }
+
+    const RetryPolicy &getRetryPolicy() const {
+        return this->retryPolicy;
+    }
+
+    /**
+     * Returns retry counters accumulated since construction or last resetRetryStatistics().
+     * Should not be called while asynchronous requests are in progress
+     */
+    RetryStatistics getRetryStatistics() const {
+        return this->retryStatistics;
+    }
+
+    void resetRetryStatistics() {
+        this->retryStatistics = RetryStatistics();
+    }
+
+    /**
+     * @brief Sets policy of deriving receive timeout of each command from its recent reply times
+     *
+     * Adaptive timeouts are disabled by default, socket receive timeout is used then.
+     * Timeouts learned so far are discarded
+     * @see AdaptiveTimeoutPolicy
+     */
+    void setAdaptiveTimeoutPolicy(const AdaptiveTimeoutPolicy &adaptiveTimeoutPolicy) {
+        this->adaptiveTimeoutPolicy = adaptiveTimeoutPolicy;
+        this->commandLatencies.clear();
+    }
+
+    const AdaptiveTimeoutPolicy &getAdaptiveTimeoutPolicy() const {
+        return this->adaptiveTimeoutPolicy;
+    }
+
+    /**
+     * Returns current receive timeouts in milliseconds of commands that have enough reply times.
+     * Should not be called while asynchronous requests are in progress
+     */
+    std::map<std::string, long> getAdaptiveTimeouts() const {
+        std::map<std::string, long> timeouts;
+        for (std::map<std::string, CommandLatency>::const_iterator it = this->commandLatencies.begin();
+                it != this->commandLatencies.end(); ++it) {
+            if (it->second.timeout >= 0)
+                timeouts[it->first] = it->second.timeout;
+        }
+        return timeouts;
+    }
+
+    /**
+     * Checks whether error was caused by connection or HTTP gateway failure
+     * and may go away when request is sent again, possibly to another server.
+     * Exceptions are classified by their socket error like failures of asynchronous requests,
+     * errors without one, e.g. invalid replies, are not transient
+     * @see SocketError
+     */
+    static bool isTransient(const CPS::Exception &e) {
+        const ErrorCode *ec = boost::get_error_info<SocketError>(e);
+        return ec && isTransient(*ec);
+    }
+
     void clearTransactionId() {
-    	this->transactionId = -1;
+        setTransactionId(-1);
+    }
+
+    /**
+     * @brief Sets how many asynchronous requests can wait for reply on the socket at the same time
+     *
+     * With value above 1 requests are written to the socket one after another without waiting
+     * for replies. Each request is tagged with an id that server returns with its reply,
+     * so replies are matched to requests even if they arrive out of order.
+     * HTTP connections always wait for reply before sending next request.
+     * Should be called before sending asynchronous requests
+     *
+     * @param maxPipelinedRequests maximum number of requests in flight, default is 1 (no pipelining)
+     */
+    void setMaxPipelinedRequests(unsigned int maxPipelinedRequests = 1) {
+        this->maxPipelinedRequests = (maxPipelinedRequests > 0) ? maxPipelinedRequests : 1;
+    }
+
+    /**
+     * Returns maximum number of requests in flight
+     * @see setMaxPipelinedRequests()
+     */
+    unsigned int getMaxPipelinedRequests() const {
+        return this->maxPipelinedRequests;
     }
 
 private:
-    std::string header(unsigned int length) {
-        std::string res = "";
-        res.push_back(0x09);
-        res.push_back(0x09);
-        res.push_back(0x00);
-        res.push_back(0x00);
-        res.push_back((length & 0x000000FF));
-        res.push_back((length & 0x0000FF00) >> 8);
-        res.push_back((length & 0x00FF0000) >> 16);
-        res.push_back((length & 0xFF000000) >> 24);
-        return res;
+    /**
+     * Framing of request message, sent as separate buffers around the message
+     */
+    class Frame: public ProtocolEngine::Frame
+    {
+    public:
+        /**
+         * Returns buffers of the whole frame, message is sent from its own buffer
+         */
+        AbstractSocket::ConstBuffers buffers(const std::string &message) const {
+            Buffer parts[maxBuffers];
+            size_t count = getBuffers(parts, message.data());
+            AbstractSocket::ConstBuffers result;
+            result.reserve(count);
+            for (size_t i = 0; i < count; i++)
+                result.push_back(asio::buffer(parts[i].data, parts[i].size));
+            return result;
+        }
+    };
+
+    /**
+     * Request waiting to be sent or reply
+     */
+    class PendingRequest: private boost::noncopyable
+    {
+    public:
+        PendingRequest() :
+            message(&data), idempotent(false), retries(0),
+            token(CancellationToken::none()), cancelSubscription(0), finished(false) {
+        }
+
+        /** Request message owned by this request */
+        std::string data;
+        /** Message to send, either data or message of the caller waiting for reply */
+        const std::string *message;
+        /** Storage the message is addressed to */
+        std::string storage;
+        /** Framing sent around the message */
+        Frame frame;
+        /** Id that matches pipelined request to its reply */
+        std::string id;
+        /** Command of message */
+        std::string command;
+        /** Time request was last written */
+        boost::posix_time::ptime sent;
+        /** Can request be sent again after connection failure */
+        bool idempotent;
+        /** Number of times request has been sent again */
+        unsigned int retries;
+        /** Time request was queued, retry budget is counted from it */
+        boost::posix_time::ptime started;
+        /** Called with reply or exception */
+        boost::function<void (std::vector<unsigned char> *, boost::exception_ptr)> completion;
+        /** Time by which request has to complete, not_a_date_time if there is no limit */
+        boost::posix_time::ptime deadline;
+        /** Token that aborts request */
+        CancellationToken token;
+        /** Id of callback registered with token */
+        unsigned long long cancelSubscription;
+        /** Timer that aborts request at deadline */
+        boost::shared_ptr<TimerWheel::Timer> timer;
+        /** Has completion been called, reply that arrives later is discarded */
+        bool finished;
+    };
+
+    /** Lists do not allocate while empty, unlike deques, so idle connections stay small */
+    typedef std::list<boost::shared_ptr<PendingRequest> > RequestQueue;
+
+    /**
+     * Parses socket options from connection string query
+     */
+    static SocketOptions parseSocketOptions(const std::string &query) {
+        SocketOptions options;
+        size_t start = 0;
+        while (start < query.size()) {
+            size_t end = query.find('&', start);
+            if (end == std::string::npos)
+                end = query.size();
+            std::string param = query.substr(start, end - start);
+            start = end + 1;
+            if (param.empty())
+                continue;
+            size_t eq = param.find('=');
+            std::string name = param.substr(0, eq);
+            int value = (eq == std::string::npos) ? 1 : atoi(param.substr(eq + 1).c_str());
+            if (name == "nodelay") {
+                options.noDelay = (value != 0);
+            } else if (name == "keepalive") {
+                // Value is idle time in seconds
+                options.keepAlive = (value != 0);
+                options.keepAliveIdle = (value > 1) ? value : 0;
+            } else if (name == "keepalive_interval") {
+                options.keepAliveInterval = value;
+            } else if (name == "keepalive_count") {
+                options.keepAliveCount = value;
+            } else if (name == "sndbuf") {
+                options.sendBufferSize = value;
+            } else if (name == "rcvbuf") {
+                options.receiveBufferSize = value;
+            } else if (name == "busy_poll") {
+                options.busyPoll = value;
+            } else {
+                BOOST_THROW_EXCEPTION(CPS::Exception("Invalid connection option " + name, 9004));
+            }
+        }
+        return options;
+    }
+
+    /**
+     * Returns storage request is sent to
+     */
+    std::string getRequestStorage(const Request &request) const {
+        return request.getStorage().empty() ? this->storageName : request.getStorage();
+    }
+
+    /**
+     * Creates request XML with envelope of this connection,
+     * storage, credentials and envelope params set on request take precedence
+     */
+    std::string getRequestMessage(const Request &request) {
+        return getRequestMessage(request, getRequestStorage(request), getTransactionId());
+    }
+
+    /**
+     * Serializes envelope params that are the same for all requests of connection
+     */
+    void updateEnvelopePrefix() {
+        std::string envelope;
+        for (std::map<std::string, std::string>::iterator it = this->customEnvelopeParams.begin(); it != this->customEnvelopeParams.end(); ++it) {
+            Request::appendEnvelopeParam(envelope, it->first, it->second);
+        }
+        Request::appendEnvelopeParam(envelope, "storage", this->storageName);
+        Request::appendEnvelopeParam(envelope, "user", this->username);
+        Request::appendEnvelopeParam(envelope, "password", this->password);
+        if (!this->applicationId.empty())
+            Request::appendEnvelopeParam(envelope, "application", this->applicationId);
+        this->envelopePrefix.swap(envelope);
+    }
+
+    /**
+     * Returns id of transaction begun on this connection, -1 if none.
+     * Replies set it from threads running io_service, requests read it when they are created
+     */
+    long long getTransactionId() const {
+        boost::mutex::scoped_lock lock(this->transactionMutex);
+        return this->transactionId;
+    }
+
+    void setTransactionId(long long transactionId) {
+        boost::mutex::scoped_lock lock(this->transactionMutex);
+        this->transactionId = transactionId;
+    }
+
+    /**
+     * Creates request XML for given storage and transaction
+     * @param transactionId id of transaction request belongs to, -1 if none
+     */
+    std::string getRequestMessage(const Request &request, const std::string &storage, long long transactionId) {
+        if (!this->createXML && request.getEnvelopeParams().empty() && request.getUsername().empty()
+                && storage == this->storageName) {
+            // Envelope params of connection are serialized already, only those of request are added
+            std::string envelope;
+            envelope.reserve(this->envelopePrefix.size() + 128);
+            envelope = this->envelopePrefix;
+            Request::appendEnvelopeParam(envelope, "command", request.getCommand());
+            if (!request.getRequestId().empty())
+                Request::appendEnvelopeParam(envelope, "requestid", request.getRequestId());
+            if (!request.getRequestType().empty())
+                Request::appendEnvelopeParam(envelope, "type", request.getRequestType());
+            if (!request.getClusterLabel().empty())
+                Request::appendEnvelopeParam(envelope, "label", request.getClusterLabel());
+            return request.getRequestXml(this->documentRootXpath, this->documentIdXpath, envelope, transactionId);
+        }
+
+        std::map<std::string, std::vector<std::string> > envelopeParams;
+        for (std::map<std::string, std::string>::iterator it = this->customEnvelopeParams.begin(); it != this->customEnvelopeParams.end(); ++it) {
+        	envelopeParams[it->first].push_back(it->second);
+        }
+        const std::map<std::string, std::string> &requestParams = request.getEnvelopeParams();
+        for (std::map<std::string, std::string>::const_iterator it = requestParams.begin(); it != requestParams.end(); ++it) {
+            envelopeParams[it->first].assign(1, it->second);
+        }
+        envelopeParams["storage"].push_back(storage);
+        if (request.getUsername().empty()) {
+            envelopeParams["user"].push_back(this->username);
+            envelopeParams["password"].push_back(this->password);
+        } else {
+            envelopeParams["user"].push_back(request.getUsername());
+            envelopeParams["password"].push_back(request.getPassword());
+        }
+        envelopeParams["command"].push_back(request.getCommand());
+        if (!request.getRequestId().empty())
+            envelopeParams["requestid"].push_back(request.getRequestId());
+        if (!this->applicationId.empty())
+            envelopeParams["application"].push_back(this->applicationId);
+        if (!request.getRequestType().empty())
+            envelopeParams["type"].push_back(request.getRequestType());
+        if (!request.getClusterLabel().empty())
+            envelopeParams["label"].push_back(request.getClusterLabel());
+
+        return request.getRequestXml(this->documentRootXpath,
+                              this->documentIdXpath, envelopeParams, this->createXML, transactionId);
+    }
+
+    /**
+     * Wraps message into the format expected by the socket
+     */
+    void buildFrame(Frame &frame, const std::string &message, const std::string &storage, const std::string &requestId = "") {
+        if (this->connectionType == HTTP) {
+            // Only HTTP requests send unformatted data
+            frame.clear(message.size());
+            return;
+        }
+        frame.encode(message.size(), storage, requestId);
+    }
+
+    /**
+     * Creates response object from reply received from socket
+     */
+    template<class ResponseType>
+    ResponseType *parseReply(std::vector<unsigned char> &reply) {
+        if (this->connectionType == HTTP) {
+            if (this->debug)
+                std::cout << "Response:\n" << std::string(reply.begin(), reply.end()) << std::endl;
+            return ProtocolEngine::newResponse<ResponseType>(reply, 0, reply.size());
+        }
+
+        ProtobufSlice message, id;
+        ProtocolEngine::decodeReply(reply, message, id);
+
+        if (this->debug)
+                    std::cout << "Response:\n" << message.toString() << std::endl;
+
+        // Reply is parsed where it was received, response takes over its buffer
+        size_t offset = message.data - &reply[0];
+        ResponseType *resp = ProtocolEngine::newResponse<ResponseType>(reply, offset, message.size);
+        resp->documentRootXpath = this->documentRootXpath;
+        resp->documentIdXpath = this->documentIdXpath;
+        if (resp->getCommand() == "begin-transaction") {
+            setTransactionId(resp->getParam("transaction_id", -1LL));
+        } else if (resp->getCommand() == "commit-transaction" || resp->getCommand() == "rollback-transaction") {
+            setTransactionId(-1);
+        }
+        ProtocolEngine::checkErrors(resp);
+        return resp;
+    }
+
+    /**
+     * Sends message and waits for reply.
+     * Message is queued after asynchronous requests made before it, so frames of blocking
+     * and asynchronous requests never interleave on the socket
+     * @param storage storage the message is addressed to
+     * @param deadline time by which request has to complete, not_a_date_time if there is no limit
+     * @param token token that aborts request
+     */
+    template<class ResponseType>
+    ResponseType *sendMessage(const std::string &message, const std::string &storage,
+            const boost::posix_time::ptime &deadline, const CancellationToken &token) {
+        if (this->debug)
+            std::cout << "Request:\n" << message << std::endl;
+
+        boost::shared_ptr<boost::promise<ResponseType*> > promise(new boost::promise<ResponseType*>());
+        boost::unique_future<ResponseType*> result = promise->get_future();
+        boost::shared_ptr<PendingRequest> request(new PendingRequest());
+        request->storage = storage;
+        request->deadline = deadline;
+        request->token = token;
+        if (deadline.is_not_a_date_time() && !token.canBeCancelled()) {
+            // Caller waits for the reply, so its message is sent without copying
+            request->message = &message;
+        } else {
+            // Aborted request returns before its message is sent
+            request->data = message;
+        }
+        enqueueRequest<ResponseType>(request,
+                boost::bind(&Connection::deliverToPromise<ResponseType, ResponseType*>, promise, _1, _2));
+        if (this->ownedIoService) {
+            // Socket operations of this request and those queued before it are run by calling thread
+            runUntilReady(result);
+        }
+        return result.get();
+    }
+
+    /**
+     * Runs io_service owned by connection in calling thread until result is ready.
+     * Other threads may run it at the same time
+     */
+    template<class ResultType>
+    void runUntilReady(boost::unique_future<ResultType> &result) {
+        while (!result.is_ready()) {
+            // io_service stops when it runs out of work, e.g. after run() of asynchronous requests
+            if (this->io_service.stopped())
+                this->io_service.reset();
+            if (this->io_service.run_one() == 0) {
+                // Last handler was run by another thread, it completes the result
+                result.wait();
+            }
+        }
+        // Asynchronous requests queued later are processed by next run() of io_service
+        if (this->io_service.stopped())
+            this->io_service.reset();
+    }
+
+    /**
+     * Checks whether given number of milliseconds from now is before deadline
+     */
+    static bool beforeDeadline(const boost::posix_time::ptime &deadline, int milliseconds) {
+        return deadline.is_not_a_date_time() || boost::posix_time::microsec_clock::universal_time()
+                + boost::posix_time::milliseconds(milliseconds) < deadline;
+    }
+
+    /**
+     * Creates request to be sent asynchronously
+     */
+    boost::shared_ptr<PendingRequest> createPendingRequest(const Request &request) {
+        return createPendingRequest(request, getRequestStorage(request), getTransactionId());
+    }
+
+    boost::shared_ptr<PendingRequest> createPendingRequest(const Request &request, const std::string &storage,
+            long long transactionId) {
+        boost::shared_ptr<PendingRequest> pending(new PendingRequest());
+        getRequestMessage(request, storage, transactionId).swap(pending->data);
+        pending->storage = storage;
+        pending->deadline = request.getDeadline();
+        pending->token = request.getCancellationToken();
+        return pending;
+    }
+
+    /**
+     * Queues request, reply is passed to handler
+     */
+    template<class ResponseType>
+    void sendPendingAsync(boost::shared_ptr<PendingRequest> request, typename AsyncResponseHandler<ResponseType>::type handler) {
+        if (this->debug)
+            std::cout << "Request:\n" << *request->message << std::endl;
+        enqueueRequest<ResponseType>(request, boost::bind(&Connection::deliverToHandler<ResponseType>, handler, _1, _2));
+    }
+
+    /**
+     * Queues request, reply is passed to returned future
+     */
+    template<class ResponseType>
+    boost::unique_future<boost::shared_ptr<ResponseType> > sendPendingAsync(boost::shared_ptr<PendingRequest> request) {
+        if (this->debug)
+            std::cout << "Request:\n" << *request->message << std::endl;
+        boost::shared_ptr<boost::promise<boost::shared_ptr<ResponseType> > > promise(
+                new boost::promise<boost::shared_ptr<ResponseType> >());
+        enqueueRequest<ResponseType>(request,
+                boost::bind(&Connection::deliverToPromise<ResponseType, boost::shared_ptr<ResponseType> >, promise, _1, _2));
+        return promise->get_future();
+    }
+
+    /**
+     * Queues request for sending, completion receives raw response or exception
+     */
+    template<class ResponseType>
+    void enqueueRequest(boost::shared_ptr<PendingRequest> request,
+            boost::function<void (ResponseType *, boost::exception_ptr)> completion) {
+        request->command = getCommand(*request->message);
+        request->idempotent = isIdempotent(request->command);
+        request->started = boost::posix_time::microsec_clock::universal_time();
+        request->completion = boost::bind(&Connection::completeRequest<ResponseType>, this, _1, _2, completion);
+        socket->getStrand().post(boost::bind(&Connection::startRequest, this, request));
+    }
+
+    template<class ResponseType>
+    void completeRequest(std::vector<unsigned char> *reply, boost::exception_ptr error,
+            boost::function<void (ResponseType *, boost::exception_ptr)> completion) {
+        ResponseType *resp = NULL;
+        if (!error) {
+            try {
+                resp = parseReply<ResponseType>(*reply);
+            } catch (...) {
+                error = boost::current_exception();
+            }
+        }
+        completion(resp, error);
+    }
+
+    template<class ResponseType>
+    static void deliverToHandler(typename AsyncResponseHandler<ResponseType>::type handler,
+            ResponseType *resp, boost::exception_ptr error) {
+        handler(boost::shared_ptr<ResponseType>(resp), error);
+    }
+
+    template<class ResponseType, class ResultType>
+    static void deliverToPromise(boost::shared_ptr<boost::promise<ResultType> > promise,
+            ResponseType *resp, boost::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(ResultType(resp));
+        }
+    }
+
+    /**
+     * Returns command of request message
+     */
+    static std::string getCommand(const std::string &message) {
+        size_t start = message.find("<cps:command>");
+        if (start == std::string::npos)
+            return std::string();
+        start += 13;
+        size_t end = message.find('<', start);
+        if (end == std::string::npos)
+            return std::string();
+        return message.substr(start, end - start);
+    }
+
+    /**
+     * Checks whether command may be retried
+     */
+    bool isIdempotent(const std::string &command) const {
+        return this->retryPolicy.maxRetries > 0 && this->retryPolicy.isIdempotent(command);
+    }
+
+    /**
+     * Returns adapted receive timeout of command, not_a_date_time if socket timeout is used
+     */
+    boost::posix_time::time_duration getReadTimeout(const std::string &command) const {
+        if (!this->adaptiveTimeoutPolicy.isAdapted(command))
+            return boost::posix_time::not_a_date_time;
+        std::map<std::string, CommandLatency>::const_iterator it = this->commandLatencies.find(command);
+        if (it == this->commandLatencies.end() || it->second.timeout < 0)
+            return boost::posix_time::not_a_date_time;
+        return boost::posix_time::milliseconds(it->second.timeout);
+    }
+
+    /**
+     * Adds reply time of command and updates its timeout
+     * @param sent time request was sent
+     * @param failed did request fail, only replies that timed out are counted then
+     */
+    void recordLatency(const std::string &command, const boost::posix_time::ptime &sent, bool failed) {
+        if (!this->adaptiveTimeoutPolicy.isAdapted(command))
+            return;
+        boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - sent;
+        std::map<std::string, CommandLatency>::iterator it = this->commandLatencies.find(command);
+        if (it == this->commandLatencies.end()) {
+            it = this->commandLatencies.insert(std::make_pair(command, CommandLatency())).first;
+            it->second.window.reset(this->adaptiveTimeoutPolicy.window);
+        }
+        CommandLatency &latency = it->second;
+        if (failed && elapsed < socket->getReadTimeout())
+            return;
+        latency.window.add(elapsed.total_microseconds() / 1000000.0);
+        // Percentile is recalculated periodically, or at once when server got slower than timeout
+        if (latency.window.count() >= this->adaptiveTimeoutPolicy.minSamples
+                && (latency.timeout < 0 || failed || ++latency.samplesSinceUpdate >= 16)) {
+            latency.timeout = this->adaptiveTimeoutPolicy.getTimeout(latency.window);
+            latency.samplesSinceUpdate = 0;
+        }
+    }
+
+    /**
+     * Sets receive timeout of next read to the longest timeout of requests waiting for reply
+     */
+    void updateReadTimeout() {
+        boost::posix_time::time_duration timeout(boost::posix_time::not_a_date_time);
+        for (RequestQueue::iterator it = this->sentRequests.begin(); it != this->sentRequests.end(); ++it) {
+            boost::posix_time::time_duration requestTimeout = getReadTimeout((*it)->command);
+            if (requestTimeout.is_not_a_date_time()) {
+                timeout = requestTimeout;
+                break;
+            }
+            if (timeout.is_not_a_date_time() || requestTimeout > timeout)
+                timeout = requestTimeout;
+        }
+        socket->setReadTimeout(timeout);
+    }
+
+    /**
+     * Connection errors and HTTP gateway errors can go away on new connection
+     */
+    static bool isTransient(const ErrorCode &ec) {
+        if (ec.category() == httpStatusCategory())
+            return ec.value() == 502 || ec.value() == 503 || ec.value() == 504;
+        return ec != asio::error::invalid_argument && ec != asio::error::operation_aborted;
+    }
+
+    /**
+     * Decides whether failed request is sent again and updates retry counters
+     * @param backoff receives delay before retry in milliseconds
+     */
+    bool shouldRetry(bool transient, bool idempotent, unsigned int retry,
+            const boost::posix_time::ptime &started, int &backoff) {
+        if (!transient || this->retryPolicy.maxRetries == 0)
+            return false;
+        if (!idempotent) {
+            this->retryStatistics.notRetried++;
+            return false;
+        }
+        if (retry >= this->retryPolicy.maxRetries) {
+            this->retryStatistics.exhausted++;
+            return false;
+        }
+        backoff = this->retryPolicy.getBackoff(retry);
+        boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - started;
+        if (elapsed.total_milliseconds() + backoff > this->retryPolicy.budget) {
+            this->retryStatistics.exhausted++;
+            return false;
+        }
+        this->retryStatistics.retries++;
+        return true;
+    }
+
+    static boost::exception_ptr socketError(const std::string &message, const ErrorCode &ec) {
+        return boost::copy_exception(socketException(message, ec));
+    }
+
+    // Following methods are run in socket strand
+
+    void startConnect(boost::shared_ptr<boost::promise<ErrorCode> > promise) {
+        if (socket->isConnected()) {
+            promise->set_value(ErrorCode());
+        } else {
+            socket->asyncConnect(this->host, this->port, boost::bind(&Connection::handleConnect, this, _1, promise));
+        }
+    }
+
+    void startRequest(boost::shared_ptr<PendingRequest> request) {
+        if (!request->deadline.is_not_a_date_time()) {
+            request->timer.reset(new TimerWheel::Timer(this->io_service));
+            request->timer->expiresAt(request->deadline, socket->getStrand().wrap(
+                    boost::bind(&Connection::expireRequest, this, request)));
+        }
+        request->cancelSubscription = request->token.subscribe(
+                boost::bind(&Connection::cancelRequest, this, request));
+        if (this->maxPipelinedRequests > 1 && this->connectionType != HTTP) {
+            request->id = Utils::toString(++this->lastRequestId);
+        }
+        buildFrame(request->frame, *request->message, request->storage, request->id);
+        this->pendingRequests.push_back(request);
+        processRequests();
+    }
+
+    void processRequests() {
+        if (this->writing || this->connecting || this->pendingRequests.empty())
+            return;
+        unsigned int maxInFlight = (this->connectionType == HTTP) ? 1 : this->maxPipelinedRequests;
+        if (this->sentRequests.size() >= maxInFlight)
+            return;
+        if (!socket->isConnected()) {
+            // Wait for replies of requests sent on previous connection to fail
+            if (!this->sentRequests.empty() || this->reading)
+                return;
+            this->connecting = true;
+            socket->asyncConnect(this->host, this->port, boost::bind(&Connection::handleConnect, this, _1,
+                    boost::shared_ptr<boost::promise<ErrorCode> >()));
+            return;
+        }
+        boost::shared_ptr<PendingRequest> request = this->pendingRequests.front();
+        this->pendingRequests.pop_front();
+        this->sentRequests.push_back(request);
+        request->sent = boost::posix_time::microsec_clock::universal_time();
+        this->writing = true;
+        socket->asyncWrite(request->frame.buffers(*request->message), boost::bind(&Connection::handleWrite, this, _1));
+    }
+
+    void handleConnect(const ErrorCode &ec, boost::shared_ptr<boost::promise<ErrorCode> > promise) {
+        this->connecting = false;
+        if (promise)
+            promise->set_value(ec);
+        if (ec) {
+            // Fail all waiting requests
+            RequestQueue failed;
+            failed.swap(this->pendingRequests);
+            for (RequestQueue::iterator it = failed.begin(); it != failed.end(); ++it) {
+                failRequest(*it, "Connection error - Could not connect. ", ec);
+            }
+            return;
+        }
+        processRequests();
+    }
+
+    void handleWrite(const ErrorCode &ec) {
+        this->writing = false;
+        if (ec) {
+            // Socket is closed, replies of sent requests will not arrive
+            failSentRequests("Error while sending - Could not send message. ", ec);
+            processRequests();
+            return;
+        }
+        if (!this->reading) {
+            this->reading = true;
+            updateReadTimeout();
+            socket->asyncRead(boost::bind(&Connection::handleRead, this, _1, _2));
+        }
+        processRequests();
+    }
+
+    void handleRead(const ErrorCode &ec, std::vector<unsigned char> &reply) {
+        this->reading = false;
+        if (ec) {
+            if (!this->sentRequests.empty())
+                recordLatency(this->sentRequests.front()->command, this->sentRequests.front()->sent, true);
+            failSentRequests("Error while sending - Could not read message. ", ec);
+            processRequests();
+            return;
+        }
+        if (this->sentRequests.empty())
+            return;
+        // Find request this reply belongs to, replies without id are returned in order
+        RequestQueue::iterator it = this->sentRequests.begin();
+        if (!this->sentRequests.front()->id.empty()) {
+            ProtobufSlice message, id;
+            try {
+                ProtocolEngine::decodeReply(reply, message, id);
+            } catch (CPS::Exception &) {
+                socket->close();
+                failSentRequests(boost::current_exception());
+                processRequests();
+                return;
+            }
+            if (!id.empty()) {
+                for (; it != this->sentRequests.end() && !id.equals((*it)->id); ++it);
+                if (it == this->sentRequests.end()) {
+                    // Reply to unknown request, the stream can not be trusted anymore
+                    socket->close();
+                    failSentRequests(boost::copy_exception(CPS::Exception("Error while sending - Unexpected reply id " + id.toString())));
+                    processRequests();
+                    return;
+                }
+            }
+        }
+        boost::shared_ptr<PendingRequest> request = *it;
+        this->sentRequests.erase(it);
+        recordLatency(request->command, request->sent, false);
+        // Continue reading replies and sending requests before processing this reply
+        if (!this->sentRequests.empty()) {
+            this->reading = true;
+            updateReadTimeout();
+            socket->asyncRead(boost::bind(&Connection::handleRead, this, _1, _2));
+        }
+        processRequests();
+        if (request->retries > 0 && !request->finished)
+            this->retryStatistics.recovered++;
+        finishRequest(request, &reply, boost::exception_ptr());
+    }
+
+    void failSentRequests(boost::exception_ptr error) {
+        RequestQueue failed;
+        failed.swap(this->sentRequests);
+        for (RequestQueue::iterator it = failed.begin(); it != failed.end(); ++it) {
+            finishRequest(*it, NULL, error);
+        }
+    }
+
+    void failSentRequests(const std::string &message, const ErrorCode &ec) {
+        RequestQueue failed;
+        failed.swap(this->sentRequests);
+        for (RequestQueue::iterator it = failed.begin(); it != failed.end(); ++it) {
+            failRequest(*it, message, ec);
+        }
+    }
+
+    /**
+     * Completes request with error or schedules it to be sent again
+     */
+    void failRequest(boost::shared_ptr<PendingRequest> request, const std::string &message, const ErrorCode &ec) {
+        if (request->finished)
+            return;
+        int backoff = 0;
+        if (!shouldRetry(isTransient(ec), request->idempotent, request->retries, request->started, backoff)
+                || !beforeDeadline(request->deadline, backoff)) {
+            finishRequest(request, NULL, socketError(message, ec));
+            return;
+        }
+        request->retries++;
+        // Timer is owned by its handler until it fires
+        boost::shared_ptr<TimerWheel::Timer> timer(new TimerWheel::Timer(this->io_service));
+        timer->expiresFromNow(boost::posix_time::milliseconds(backoff),
+                socket->getStrand().wrap(boost::bind(&Connection::retryRequest, this, request, timer)));
+    }
+
+    void retryRequest(boost::shared_ptr<PendingRequest> request, boost::shared_ptr<TimerWheel::Timer>) {
+        // Request may have been aborted while waiting
+        if (request->finished)
+            return;
+        this->pendingRequests.push_front(request);
+        processRequests();
+    }
+
+    /**
+     * Calls completion of request unless it has been called already
+     */
+    void finishRequest(boost::shared_ptr<PendingRequest> request, std::vector<unsigned char> *reply,
+            boost::exception_ptr error) {
+        if (request->finished)
+            return;
+        request->finished = true;
+        if (request->timer)
+            request->timer->cancel();
+        request->token.unsubscribe(request->cancelSubscription);
+        request->completion(reply, error);
+    }
+
+    void expireRequest(boost::shared_ptr<PendingRequest> request) {
+        abortRequest(request, boost::copy_exception(CPS::Exception("Request deadline exceeded", 9008)));
+    }
+
+    /**
+     * Called by cancelled token from any thread
+     */
+    void cancelRequest(boost::shared_ptr<PendingRequest> request) {
+        socket->getStrand().post(boost::bind(&Connection::abortRequest, this, request,
+                boost::copy_exception(CPS::Exception("Request cancelled", 9009))));
+    }
+
+    /**
+     * Completes request with error before its reply arrives
+     */
+    void abortRequest(boost::shared_ptr<PendingRequest> request, boost::exception_ptr error) {
+        if (request->finished)
+            return;
+        RequestQueue::iterator it =
+                std::find(this->pendingRequests.begin(), this->pendingRequests.end(), request);
+        if (it != this->pendingRequests.end()) {
+            this->pendingRequests.erase(it);
+        } else if (this->sentRequests.size() == 1 && this->sentRequests.front() == request) {
+            // Nothing else waits for this connection, so reply is not awaited
+            finishRequest(request, NULL, error);
+            socket->close();
+            return;
+        }
+        // Reply of pipelined request is discarded when it arrives
+        finishRequest(request, NULL, error);
+    }
+
+    void cancelRequests() {
+        RequestQueue cancelled;
+        cancelled.swap(this->pendingRequests);
+        for (RequestQueue::iterator it = cancelled.begin(); it != cancelled.end(); ++it) {
+            finishRequest(*it, NULL, socketError("Request cancelled. ", asio::error::operation_aborted));
+        }
+        // Outstanding socket operations complete with operation_aborted and fail sent requests.
+        // Connect in progress is kept, connection may be used by following requests before it completes
+        if (!this->sentRequests.empty())
+            socket->close();
     }
 
 private:
@@ -389,16 +1319,48 @@ private:
     std::string documentRootXpath;
     std::string documentIdXpath;
     std::map<std::string, std::string> customEnvelopeParams;
+    std::string envelopePrefix; /// Serialized envelope params of connection, see updateEnvelopePrefix()
 
     std::string applicationId;
     bool debug;
     bool noCdata;
     bool createXML; /// Should actual XML tree be created when sending requests
     long long transactionId; /// TransactionId for current connection
+    mutable boost::mutex transactionMutex; /// Guards transactionId
+
+    RetryPolicy retryPolicy;
+    RetryStatistics retryStatistics;
+
+    /**
+     * Recent reply times of one command
+     */
+    struct CommandLatency {
+        CommandLatency() :
+            timeout(-1), samplesSinceUpdate(0) {
+        }
 
-    asio::io_service io_service;
+        LatencyWindow window;
+        long timeout; /// Receive timeout in milliseconds, -1 until enough replies are seen
+        unsigned int samplesSinceUpdate; /// Reply times added since timeout was calculated
+    };
+
+    AdaptiveTimeoutPolicy adaptiveTimeoutPolicy;
+    std::map<std::string, CommandLatency> commandLatencies; /// Reply times by command
+
+    boost::shared_ptr<asio::io_service> ownedIoService; /// io_service created by this connection, if any
+    asio::io_service &io_service;
     boost::shared_ptr<AbstractSocket> socket;
 
+    RequestQueue pendingRequests; /// Asynchronous requests waiting to be sent
+    RequestQueue sentRequests; /// Asynchronous requests waiting for reply
+    bool connecting; /// Is asynchronous connect in progress
+    bool writing; /// Is asynchronous request being written
+    bool reading; /// Is reply being read
+    unsigned int maxPipelinedRequests; /// Maximum number of requests in flight
+    unsigned long long lastRequestId; /// Id of last pipelined request
+
+    friend class ClusterConnection;
+    friend class Transaction;
 };
 }
 
@@ -0,0 +1,445 @@
+#ifndef CPS_CONNECTIONPOOL_HPP
+#define CPS_CONNECTIONPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Connection.hpp"
+#include "Request.hpp"
+#include "Response.hpp"
+#include "Exception.hpp"
+
+namespace CPS
+{
+
+/**
+ * @brief Snapshot of ConnectionPool usage counters
+ * @see ConnectionPool::getStatistics()
+ */
+class PoolStatistics
+{
+public:
+    PoolStatistics() :
+        size(0), inUse(0), peakInUse(0), acquisitions(0), waits(0), timeouts(0),
+        totalWaitSeconds(0.0), maxWaitSeconds(0.0), utilization(0.0) {
+    }
+
+    /**
+     * Returns average time spent waiting for a connection per acquisition
+     */
+    double getAverageWaitSeconds() const {
+        return (acquisitions > 0) ? totalWaitSeconds / acquisitions : 0.0;
+    }
+
+    /** Number of connections in the pool */
+    unsigned int size;
+    /** Number of connections currently checked out */
+    unsigned int inUse;
+    /** Highest number of connections checked out at the same time */
+    unsigned int peakInUse;
+    /** Number of successful acquisitions */
+    unsigned long long acquisitions;
+    /** Number of acquisitions that had to wait for a free connection */
+    unsigned long long waits;
+    /** Number of acquisitions that gave up waiting */
+    unsigned long long timeouts;
+    /** Total time spent waiting for a free connection */
+    double totalWaitSeconds;
+    /** Longest single wait for a free connection */
+    double maxWaitSeconds;
+    /** Fraction (0..1) of available connection time the connections were checked out */
+    double utilization;
+};
+
+/**
+ * @brief Thread-safe pool of connections to a single storage
+ *
+ * Holds a fixed number of identically configured Connection objects.
+ * Each thread checks a connection out with acquire(), uses it exclusively and
+ * it is returned to the pool once the last copy of the returned pointer is released.
+ * Connection objects themselves are not thread-safe, so they must not be shared
+ * between threads while checked out.
+ */
+class ConnectionPool: private boost::noncopyable
+{
+public:
+    /**
+     * Constructs a pool of connections. Connections are not opened until
+     * they are first used or connect() is called.
+     *
+     * @param size number of connections in the pool
+     * @param connectionString Specifies the connection string, such as tcp://127.0.0.1:5550
+     * @param storageName Default storage of requests. Requests to other storages share
+     * the same connections, see Request::setStorage()
+     * @param username Username for authenticating with the storage
+     * @param password Password for this user
+     * @param documentRootXpath Document root tag name. Default is "document"
+     * @param documentIdXpath Document ID xpath. Default is "document/id"
+     * @param customEnvelopeParams additional envelope parameters sent with every request
+     */
+    ConnectionPool(unsigned int size, std::string connectionString, std::string storageName,
+                   std::string username, std::string password,
+                   std::string documentRootXpath = "document",
+                   std::string documentIdXpath = "document/id",
+                   std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType()) {
+        init(NULL, size, connectionString, storageName, username, password,
+                documentRootXpath, documentIdXpath, customEnvelopeParams);
+    }
+
+    /**
+     * Constructs a pool of connections that run socket operations on external io_service
+     *
+     * @param io_service io_service to run socket operations on
+     * @see ConnectionPool(unsigned int size, std::string connectionString, std::string storageName, std::string username, std::string password, std::string documentRootXpath, std::string documentIdXpath, std::map<std::string, std::string> customEnvelopeParams)
+     * @see Connection(asio::io_service &io_service, std::string connectionString, std::string storageName, std::string username, std::string password, std::string documentRootXpath, std::string documentIdXpath, std::map<std::string, std::string> customEnvelopeParams)
+     */
+    ConnectionPool(asio::io_service &io_service, unsigned int size, std::string connectionString, std::string storageName,
+                   std::string username, std::string password,
+                   std::string documentRootXpath = "document",
+                   std::string documentIdXpath = "document/id",
+                   std::map<std::string, std::string> customEnvelopeParams = Request::MapStringStringType()) {
+        init(&io_service, size, connectionString, storageName, username, password,
+                documentRootXpath, documentIdXpath, customEnvelopeParams);
+    }
+
+    virtual ~ConnectionPool() {
+    }
+
+    /**
+     * Opens all connections in the pool that are not connected yet
+     */
+    void connect() {
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->connect();
+        }
+    }
+
+    /**
+     * @brief Checks out a connection
+     *
+     * Blocks until a connection becomes available. The connection is returned to the pool
+     * when the last copy of the returned pointer goes out of scope,
+     * so the pool must outlive all checked out connections.
+     *
+     * @param timeout maximum time to wait in milliseconds, negative value waits forever
+     */
+    boost::shared_ptr<Connection> acquire(int timeout) {
+        return acquire(timeout, boost::posix_time::ptime(), CancellationToken::none());
+    }
+
+    /**
+     * Checks out a connection using the pool's default acquire timeout
+     * @see acquire(int timeout)
+     * @see setAcquireTimeout(int timeout)
+     */
+    boost::shared_ptr<Connection> acquire() {
+        return acquire(this->acquireTimeout);
+    }
+
+    /**
+     * @brief Checks out a connection for sending the request
+     *
+     * Waits no longer than deadline of the request and stops waiting when
+     * its cancellation token is cancelled
+     *
+     * @param request request that will be sent over the connection
+     * @param timeout maximum time to wait in milliseconds, negative value uses the pool's default
+     * @throws CPS::Exception with code 9008 when deadline passes, 9009 when request is cancelled
+     * @see acquire(int timeout)
+     * @see Request::setDeadline()
+     * @see Request::setCancellationToken()
+     */
+    boost::shared_ptr<Connection> acquire(const Request &request, int timeout = -1) {
+        CancellationToken token = request.getCancellationToken();
+        unsigned long long subscription = token.subscribe(boost::bind(&ConnectionPool::wakeWaiting, this));
+        boost::shared_ptr<Connection> conn;
+        try {
+            conn = acquire((timeout < 0) ? this->acquireTimeout : timeout, request.getDeadline(), token);
+        } catch (...) {
+            token.unsubscribe(subscription);
+            throw;
+        }
+        token.unsubscribe(subscription);
+        return conn;
+    }
+
+    /**
+     * @brief Sends the request using any free connection of the pool
+     *
+     * The connection is checked out only for the duration of the call
+     * @see Connection::sendRequest(const Request &request)
+     * @see acquire(const Request &request, int timeout)
+     */
+    template<class ResponseType>
+    ResponseType* sendRequest(const Request &request) {
+        boost::shared_ptr<Connection> conn = acquire(request);
+        return conn->sendRequest<ResponseType>(request);
+    }
+
+    /**
+     * Sends the request and returns generic response
+     * @see sendRequest(const Request &request)
+     */
+    Response *sendRequest(const Request &request) {
+        return sendRequest<Response>(request);
+    }
+
+    /**
+     * Sets the default time to wait for a free connection
+     * @param timeout in milliseconds, negative value waits forever
+     */
+    void setAcquireTimeout(int timeout = -1) {
+        this->acquireTimeout = timeout;
+    }
+
+    /**
+     * Sets the application ID on all connections.
+     * Should be called before connections are checked out
+     * @see Connection::setApplicationId()
+     */
+    void setApplicationId(const std::string &applicationId = "CPS_CPP_API") {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setApplicationId(applicationId);
+        }
+    }
+
+    /**
+     * Sets the debugging mode on all connections.
+     * Should be called before connections are checked out
+     * @see Connection::setDebug()
+     */
+    void setDebug(bool debug) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setDebug(debug);
+        }
+    }
+
+    /**
+     * Sets the create XML flag on all connections.
+     * Should be called before connections are checked out
+     * @see Connection::setCreateXML()
+     */
+    void setCreateXML(bool createXML) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setCreateXML(createXML);
+        }
+    }
+
+    /**
+     * Sets socket timeouts in seconds on all connections.
+     * Should be called before connections are checked out
+     * @see Connection::setSocketTimeouts()
+     */
+    void setSocketTimeouts(int connectTimeout = 5, int sendTimeout = 30, int recieveTimeout = 60) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setSocketTimeouts(connectTimeout, sendTimeout, recieveTimeout);
+        }
+    }
+
+    /**
+     * Sets socket options on all connections.
+     * Should be called before connections are checked out
+     * @see Connection::setSocketOptions()
+     */
+    void setSocketOptions(const SocketOptions &options) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setSocketOptions(options);
+        }
+    }
+
+    /**
+     * Sets retry policy for all connections in the pool
+     * @see Connection::setRetryPolicy()
+     */
+    void setRetryPolicy(const RetryPolicy &retryPolicy) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setRetryPolicy(retryPolicy);
+        }
+    }
+
+    /**
+     * Sets adaptive timeout policy for all connections in the pool,
+     * each connection learns reply times of its own requests
+     * @see Connection::setAdaptiveTimeoutPolicy()
+     */
+    void setAdaptiveTimeoutPolicy(const AdaptiveTimeoutPolicy &adaptiveTimeoutPolicy) {
+        boost::mutex::scoped_lock lock(this->mutex);
+        for (unsigned int i = 0; i < this->connections.size(); i++) {
+            this->connections[i]->setAdaptiveTimeoutPolicy(adaptiveTimeoutPolicy);
+        }
+    }
+
+    /**
+     * Returns number of connections in the pool
+     */
+    unsigned int size() const {
+        return this->connections.size();
+    }
+
+    /**
+     * Returns pool usage counters accumulated since construction or last resetStatistics()
+     */
+    PoolStatistics getStatistics() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        PoolStatistics result = this->stats;
+        result.size = this->connections.size();
+        result.inUse = this->leasedAt.size();
+
+        // Connections that are checked out right now count as busy up to this moment
+        double busySeconds = this->busySeconds;
+        for (std::map<Connection*, boost::posix_time::ptime>::const_iterator it = this->leasedAt.begin();
+                it != this->leasedAt.end(); ++it) {
+            boost::posix_time::ptime from = (it->second > this->statsStart) ? it->second : this->statsStart;
+            busySeconds += (now - from).total_microseconds() / 1000000.0;
+        }
+        double totalSeconds = (now - this->statsStart).total_microseconds() / 1000000.0 * result.size;
+        result.utilization = (totalSeconds > 0) ? busySeconds / totalSeconds : 0.0;
+        return result;
+    }
+
+    /**
+     * Resets pool usage counters
+     */
+    void resetStatistics() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->stats = PoolStatistics();
+        this->stats.peakInUse = this->leasedAt.size();
+        this->busySeconds = 0.0;
+        this->statsStart = boost::posix_time::microsec_clock::universal_time();
+    }
+
+private:
+    void init(asio::io_service *io_service, unsigned int size, const std::string &connectionString,
+              const std::string &storageName, const std::string &username, const std::string &password,
+              const std::string &documentRootXpath, const std::string &documentIdXpath,
+              const std::map<std::string, std::string> &customEnvelopeParams) {
+        if (size == 0) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Connection pool size must be positive", 9006));
+        }
+        for (unsigned int i = 0; i < size; i++) {
+            boost::shared_ptr<Connection> conn(io_service ?
+                    new Connection(*io_service, connectionString, storageName, username, password,
+                            documentRootXpath, documentIdXpath, customEnvelopeParams) :
+                    new Connection(connectionString, storageName, username, password,
+                            documentRootXpath, documentIdXpath, customEnvelopeParams));
+            this->connections.push_back(conn);
+            this->idle.push_back(conn.get());
+        }
+        this->acquireTimeout = -1;
+        resetStatistics();
+    }
+
+    /**
+     * Waits for free connection until timeout or deadline, whichever is earlier
+     * @param deadline not_a_date_time if there is no deadline
+     */
+    boost::shared_ptr<Connection> acquire(int timeout, const boost::posix_time::ptime &deadline,
+            const CancellationToken &token) {
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        boost::posix_time::ptime until = deadline;
+        if (timeout >= 0 && (until.is_not_a_date_time() || start + boost::posix_time::milliseconds(timeout) < until))
+            until = start + boost::posix_time::milliseconds(timeout);
+        boost::mutex::scoped_lock lock(this->mutex);
+        bool waited = false;
+        while (this->idle.empty()) {
+            if (token.isCancelled()) {
+                BOOST_THROW_EXCEPTION(CPS::Exception("Request cancelled", 9009));
+            }
+            waited = true;
+            if (until.is_not_a_date_time()) {
+                this->available.wait(lock);
+            } else if (!this->available.timed_wait(lock, until) && this->idle.empty()) {
+                this->stats.timeouts++;
+                if (until == deadline) {
+                    BOOST_THROW_EXCEPTION(CPS::Exception("Request deadline exceeded", 9008));
+                }
+                BOOST_THROW_EXCEPTION(CPS::Exception("Connection pool exhausted", 9006));
+            }
+        }
+        Connection *conn = this->idle.back();
+        this->idle.pop_back();
+
+        boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        double waitSeconds = (now - start).total_microseconds() / 1000000.0;
+        this->leasedAt[conn] = now;
+        this->stats.acquisitions++;
+        if (waited)
+            this->stats.waits++;
+        this->stats.totalWaitSeconds += waitSeconds;
+        if (waitSeconds > this->stats.maxWaitSeconds)
+            this->stats.maxWaitSeconds = waitSeconds;
+        if (this->leasedAt.size() > this->stats.peakInUse)
+            this->stats.peakInUse = this->leasedAt.size();
+
+        return boost::shared_ptr<Connection>(conn, Releaser(this));
+    }
+
+    /**
+     * Deleter of checked out connections, puts connection back to the pool
+     */
+    class Releaser
+    {
+    public:
+        Releaser(ConnectionPool *pool) :
+            pool(pool) {
+        }
+        void operator()(Connection *conn) {
+            pool->release(conn);
+        }
+    private:
+        ConnectionPool *pool;
+    };
+
+    /**
+     * Called by cancelled token from any thread, waiting threads check their tokens
+     */
+    void wakeWaiting() {
+        boost::mutex::scoped_lock lock(this->mutex);
+        this->available.notify_all();
+    }
+
+    void release(Connection *conn) {
+        {
+            boost::mutex::scoped_lock lock(this->mutex);
+            std::map<Connection*, boost::posix_time::ptime>::iterator it = this->leasedAt.find(conn);
+            if (it != this->leasedAt.end()) {
+                boost::posix_time::ptime from = (it->second > this->statsStart) ? it->second : this->statsStart;
+                this->busySeconds += (boost::posix_time::microsec_clock::universal_time() - from).total_microseconds() / 1000000.0;
+                this->leasedAt.erase(it);
+            }
+            this->idle.push_back(conn);
+        }
+        this->available.notify_one();
+    }
+
+private:
+    std::vector<boost::shared_ptr<Connection> > connections; /// All connections owned by the pool
+    std::vector<Connection*> idle; /// Connections ready to be checked out
+    std::map<Connection*, boost::posix_time::ptime> leasedAt; /// Checked out connections and time of checkout
+    int acquireTimeout; /// Default acquire timeout in milliseconds
+
+    boost::mutex mutex;
+    boost::condition_variable available;
+
+    PoolStatistics stats;
+    double busySeconds; /// Busy time of connections already returned since statsStart
+    boost::posix_time::ptime statsStart;
+};
+}
+
+#endif //#ifndef CPS_CONNECTIONPOOL_HPP
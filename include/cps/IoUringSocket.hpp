@@ -0,0 +1,766 @@
+#ifndef CPS_IOURINGSOCKET_HPP_
+#define CPS_IOURINGSOCKET_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "Socket.hpp"
+
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/thread/mutex.hpp"
+
+namespace CPS
+{
+
+/**
+ * @brief io_uring instance shared by all IoUringSockets of one io_service
+ *
+ * Requests queued while io_service runs a batch of handlers are submitted together
+ * with a single system call, whichever connections they belong to. Completions are
+ * signalled through one eventfd watched by io_service, so sockets themselves are never
+ * polled. Receives use a ring of buffers registered with the kernel and stay armed
+ * across replies (multishot receive) when the kernel supports it.
+ * If io_uring can not be set up, e.g. on kernels older than 5.1, isEnabled() returns
+ * false and sockets fall back to asio.
+ * Created on first use with asio::use_service<IoUringService>(io_service)
+ */
+class IoUringService: public asio::io_service::service, public ServiceId<IoUringService>
+{
+public:
+	/**
+	 * @brief Request submitted to the ring
+	 *
+	 * Operation is deleted after its last completion
+	 */
+	class Operation: private boost::noncopyable
+	{
+	public:
+		Operation() :
+			prev(NULL), next(NULL) {
+		}
+		virtual ~Operation() {
+		}
+
+		/**
+		 * Called by a thread running io_service for each completion of the request
+		 * @param result result of the request, negative errno on failure
+		 * @param flags completion flags, IORING_CQE_F_MORE is set if more completions follow
+		 */
+		virtual void complete(int result, unsigned int flags) = 0;
+
+	private:
+		Operation *prev; /// Neighbours in list of submitted operations
+		Operation *next;
+
+		friend class IoUringService;
+	};
+
+	/** Number of receive buffers registered with the kernel */
+	static const unsigned int bufferCount = 128;
+	/** Size of each receive buffer */
+	static const unsigned int bufferSize = 16384;
+	/** Id of receive buffer group */
+	static const unsigned short bufferGroup = 0;
+
+	explicit IoUringService(asio::io_service &io_service) :
+		asio::io_service::service(io_service), owner(io_service), eventDescriptor(io_service), eventCount(0),
+		ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), sqRingSize(0), cqRingSize(0), sqesSize(0),
+		sqHead(NULL), sqTail(NULL), sqArray(NULL), sqMask(0), sqEntries(0), cqHead(NULL), cqTail(NULL), cqMask(0), cqes(NULL),
+		bufferRing(NULL), bufferRingSize(0), bufferTail(0), operations(NULL), pending(0), outstanding(0),
+		flushScheduled(false), waiting(false), multishotReceive(false) {
+		open();
+	}
+
+	~IoUringService() {
+		closeRing();
+	}
+
+	/**
+	 * Returns false if io_uring is not available
+	 */
+	bool isEnabled() const {
+		return ringFd >= 0;
+	}
+
+	/**
+	 * Returns true if receives select registered buffers and stay armed
+	 */
+	bool hasMultishotReceive() {
+		boost::mutex::scoped_lock lock(mutex);
+		return multishotReceive;
+	}
+
+	/**
+	 * Makes following receives single-shot, e.g. when kernel rejects multishot receive
+	 */
+	void disableMultishotReceive() {
+		boost::mutex::scoped_lock lock(mutex);
+		multishotReceive = false;
+	}
+
+	/**
+	 * Queues request. It is submitted after the handler that queued it returns,
+	 * together with requests queued by other handlers in the meantime
+	 * @param sqe request, its user_data is set to the operation
+	 * @param operation completion of the request, it is owned by service from now on
+	 */
+	void submit(io_uring_sqe &sqe, Operation *operation) {
+		boost::mutex::scoped_lock lock(mutex);
+		sqe.user_data = reinterpret_cast<unsigned long>(operation);
+		unsigned int tail = *sqTail;
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+			// Submission queue is full
+			enter();
+		}
+		unsigned int index = tail & sqMask;
+		static_cast<io_uring_sqe *>(sqes)[index] = sqe;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		link(operation);
+		pending++;
+		outstanding++;
+		if (!flushScheduled) {
+			flushScheduled = true;
+			owner.post(boost::bind(&IoUringService::flush, this));
+		}
+	}
+
+	/**
+	 * Returns contents of registered receive buffer
+	 */
+	const unsigned char *getBuffer(unsigned short id) const {
+		return &buffers[id * bufferSize];
+	}
+
+	/**
+	 * Gives registered receive buffer back to the kernel
+	 */
+	void recycleBuffer(unsigned short id) {
+		boost::mutex::scoped_lock lock(mutex);
+		provideBuffer(id);
+		__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+	}
+
+private:
+	struct Completion
+	{
+		Operation *operation;
+		int result;
+		unsigned int flags;
+	};
+
+	void shutdown_service() {
+		boost::mutex::scoped_lock lock(mutex);
+		ErrorCode ec;
+		eventDescriptor.close(ec);
+		waiting = false;
+		// Kernel cancels requests of closed ring, so operations are not completed anymore
+		closeRing();
+		while (operations) {
+			Operation *operation = operations;
+			unlink(operation);
+			delete operation;
+		}
+	}
+
+	void open() {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		// Room for completions of many armed receives
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = 4096;
+		ringFd = syscall(__NR_io_uring_setup, 256, &params);
+		if (ringFd < 0) {
+			ringFd = -1;
+			return;
+		}
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMmap)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		cqRing = singleMmap ? sqRing : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED || eventFd < 0
+				|| syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0) {
+			if (eventFd >= 0)
+				::close(eventFd);
+			closeRing();
+			return;
+		}
+		eventDescriptor.assign(eventFd);
+
+		unsigned char *sq = static_cast<unsigned char *>(sqRing);
+		sqHead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+		sqTail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+		sqArray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+		sqMask = *reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+		sqEntries = params.sq_entries;
+		unsigned char *cq = static_cast<unsigned char *>(cqRing);
+		cqHead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+		cqTail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+		cqMask = *reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+		registerBuffers();
+	}
+
+	/**
+	 * Registers ring of receive buffers (Linux 5.19), multishot receive needs it
+	 */
+	void registerBuffers() {
+		bufferRingSize = bufferCount * sizeof(io_uring_buf);
+		void *ring = mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED)
+			return;
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = reinterpret_cast<unsigned long>(ring);
+		reg.ring_entries = bufferCount;
+		reg.bgid = bufferGroup;
+		if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			munmap(ring, bufferRingSize);
+			return;
+		}
+		bufferRing = static_cast<io_uring_buf_ring *>(ring);
+		bufferTail = 0;
+		buffers.resize(bufferCount * bufferSize);
+		for (unsigned int i = 0; i < bufferCount; i++)
+			provideBuffer(i);
+		__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+		multishotReceive = true;
+	}
+
+	void provideBuffer(unsigned short id) {
+		// Only fields other than resv are written, resv of first entry holds the tail
+		io_uring_buf &buf = bufferRing->bufs[bufferTail & (bufferCount - 1)];
+		buf.addr = reinterpret_cast<unsigned long>(&buffers[id * bufferSize]);
+		buf.len = bufferSize;
+		buf.bid = id;
+		bufferTail++;
+	}
+
+	void closeRing() {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingSize);
+		sqes = cqRing = sqRing = MAP_FAILED;
+		if (ringFd >= 0)
+			::close(ringFd);
+		ringFd = -1;
+		if (bufferRing)
+			munmap(bufferRing, bufferRingSize);
+		bufferRing = NULL;
+		multishotReceive = false;
+	}
+
+	void flush() {
+		boost::mutex::scoped_lock lock(mutex);
+		flushScheduled = false;
+		enter();
+		startWaiting();
+	}
+
+	/**
+	 * Submits queued requests, mutex has to be locked
+	 */
+	void enter() {
+		while (pending > 0 && ringFd >= 0) {
+			int submitted = syscall(__NR_io_uring_enter, ringFd, pending, 0, 0, NULL, 0);
+			if (submitted < 0) {
+				if (errno == EINTR)
+					continue;
+				// Completion queue is overflowing, requests are submitted after reaping
+				break;
+			}
+			pending -= submitted;
+		}
+	}
+
+	/**
+	 * Waits for completions while requests are in flight, so idle io_service can run out of work
+	 */
+	void startWaiting() {
+		if (waiting || outstanding == 0 || ringFd < 0)
+			return;
+		waiting = true;
+		eventDescriptor.async_read_some(asio::buffer(&eventCount, sizeof(eventCount)),
+				boost::bind(&IoUringService::handleEvent, this, asio::placeholders::error));
+	}
+
+	void handleEvent(const ErrorCode &ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		// Completions are dispatched in ring order even when next wait completes in another thread
+		boost::mutex::scoped_lock dispatchLock(dispatchMutex);
+		std::vector<Completion> completions;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			waiting = false;
+			reap(completions);
+			if (pending > 0)
+				enter();
+			startWaiting();
+		}
+		// Operations may submit new requests, so they are completed outside mutex
+		for (unsigned int i = 0; i < completions.size(); i++) {
+			Completion &c = completions[i];
+			c.operation->complete(c.result, c.flags);
+			if (!(c.flags & IORING_CQE_F_MORE))
+				delete c.operation;
+		}
+	}
+
+	/**
+	 * Moves completions from ring, mutex has to be locked
+	 */
+	void reap(std::vector<Completion> &completions) {
+		unsigned int head = *cqHead;
+		unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			const io_uring_cqe &cqe = cqes[head & cqMask];
+			Completion c;
+			c.operation = reinterpret_cast<Operation *>(cqe.user_data);
+			c.result = cqe.res;
+			c.flags = cqe.flags;
+			if (!(c.flags & IORING_CQE_F_MORE)) {
+				unlink(c.operation);
+				outstanding--;
+			}
+			completions.push_back(c);
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	void link(Operation *operation) {
+		operation->prev = NULL;
+		operation->next = operations;
+		if (operations)
+			operations->prev = operation;
+		operations = operation;
+	}
+
+	void unlink(Operation *operation) {
+		if (operation->prev)
+			operation->prev->next = operation->next;
+		else
+			operations = operation->next;
+		if (operation->next)
+			operation->next->prev = operation->prev;
+		operation->prev = operation->next = NULL;
+	}
+
+	boost::mutex mutex;
+	boost::mutex dispatchMutex; /// Held while completions are dispatched
+	asio::io_service &owner;
+	asio::posix::stream_descriptor eventDescriptor; /// eventfd signalled on completions
+	unsigned long long eventCount;
+	int ringFd;
+	void *sqRing;
+	void *cqRing;
+	void *sqes;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqArray;
+	unsigned int sqMask;
+	unsigned int sqEntries;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int cqMask;
+	io_uring_cqe *cqes;
+	io_uring_buf_ring *bufferRing; /// Ring of receive buffers shared with kernel
+	size_t bufferRingSize;
+	unsigned short bufferTail;
+	std::vector<unsigned char> buffers; /// Storage of receive buffers
+	Operation *operations; /// Submitted operations, deleted if ring is closed before they complete
+	unsigned int pending; /// Number of queued requests not submitted yet
+	unsigned int outstanding; /// Number of submitted requests without last completion
+	bool flushScheduled;
+	bool waiting;
+	bool multishotReceive;
+};
+
+/**
+ * @brief Asio stream whose reads and writes are io_uring requests
+ *
+ * Provides async_read_some() and async_write_some(), so framing of AbstractSocket works on it unchanged.
+ * Must be used from within strand of its socket, completion handlers are called through the strand
+ */
+class IoUringStream: private boost::noncopyable
+{
+public:
+	typedef asio::io_service::executor_type executor_type;
+	typedef boost::function<void (const ErrorCode &, size_t)> Handler;
+
+	IoUringStream(asio::io_service &io_service, asio::io_service::strand &strand) :
+		io_service(io_service), state(new State(asio::use_service<IoUringService>(io_service), strand)) {
+	}
+
+	~IoUringStream() {
+		// Handler of pending read refers to the socket being destroyed, so it is not called
+		state->pendingHandler.clear();
+		reset();
+	}
+
+	executor_type get_executor() {
+		return io_service.get_executor();
+	}
+
+	/**
+	 * Sets socket descriptor used by following requests
+	 */
+	void setDescriptor(int fd) {
+		state->fd = fd;
+	}
+
+	// Handlers are taken by reference, as composed operations move themselves into the call
+	template<class MutableBufferSequence, class ReadHandler>
+	void async_read_some(const MutableBufferSequence &buffers, const ReadHandler &handler) {
+		asio::mutable_buffer buffer;
+		for (typename MutableBufferSequence::const_iterator it = buffers.begin(); it != buffers.end(); ++it) {
+			buffer = asio::mutable_buffer(*it);
+			if (buffer.size() > 0)
+				break;
+		}
+		read(state, buffer, Handler(handler));
+	}
+
+	template<class ConstBufferSequence, class WriteHandler>
+	void async_write_some(const ConstBufferSequence &buffers, const WriteHandler &handler) {
+		SendOperation *operation = new SendOperation(state, Handler(handler));
+		msghdr &message = operation->message;
+		for (typename ConstBufferSequence::const_iterator it = buffers.begin();
+				it != buffers.end() && message.msg_iovlen < SendOperation::maxBuffers; ++it) {
+			asio::const_buffer buffer(*it);
+			iovec &vec = operation->buffers[message.msg_iovlen++];
+			vec.iov_base = const_cast<void *>(buffer.data());
+			vec.iov_len = buffer.size();
+		}
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_SENDMSG;
+		sqe.fd = state->fd;
+		sqe.addr = reinterpret_cast<unsigned long>(&message);
+		sqe.len = 1;
+		sqe.msg_flags = MSG_NOSIGNAL;
+		state->service.submit(sqe, operation);
+	}
+
+	/**
+	 * Drops received data and aborts pending read, requests in flight complete with operation_aborted.
+	 * Called when socket is closed
+	 */
+	void reset() {
+		state->generation++;
+		state->fd = -1;
+		state->armed = false;
+		state->error = ErrorCode();
+		while (!state->chunks.empty()) {
+			state->service.recycleBuffer(state->chunks.front().id);
+			state->chunks.pop_front();
+		}
+		if (state->pendingHandler) {
+			state->strand.post(boost::bind(state->pendingHandler, ErrorCode(asio::error::operation_aborted), 0));
+			state->pendingHandler.clear();
+		}
+	}
+
+private:
+	/**
+	 * Received part of registered buffer
+	 */
+	struct Chunk
+	{
+		unsigned short id;
+		size_t begin;
+		size_t end;
+	};
+
+	/**
+	 * Receive state, shared with requests in flight
+	 */
+	struct State
+	{
+		State(IoUringService &service, asio::io_service::strand &strand) :
+			service(service), strand(strand), fd(-1), generation(0), armed(false) {
+		}
+
+		IoUringService &service;
+		asio::io_service::strand strand;
+		int fd;
+		unsigned int generation; /// Incremented when socket is closed, completions of older requests are dropped
+		bool armed; /// Is multishot receive armed
+		ErrorCode error; /// End of stream or receive error, reported once chunks are read
+		std::deque<Chunk> chunks; /// Data received before it was asked for
+		asio::mutable_buffer pendingBuffer;
+		Handler pendingHandler; /// Read waiting for data
+	};
+
+	class SendOperation: public IoUringService::Operation
+	{
+	public:
+		static const size_t maxBuffers = 8;
+
+		SendOperation(boost::shared_ptr<State> state, Handler handler) :
+			state(state), generation(state->generation), handler(handler) {
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = buffers;
+		}
+
+		virtual void complete(int result, unsigned int /*flags*/) {
+			state->strand.post(boost::bind(&IoUringStream::finish, state, generation, handler, result, false));
+		}
+
+		boost::shared_ptr<State> state;
+		unsigned int generation;
+		Handler handler;
+		msghdr message;
+		iovec buffers[maxBuffers];
+	};
+
+	class ReceiveOperation: public IoUringService::Operation
+	{
+	public:
+		ReceiveOperation(boost::shared_ptr<State> state, Handler handler) :
+			state(state), generation(state->generation), handler(handler) {
+		}
+
+		virtual void complete(int result, unsigned int /*flags*/) {
+			state->strand.post(boost::bind(&IoUringStream::finish, state, generation, handler, result, true));
+		}
+
+		boost::shared_ptr<State> state;
+		unsigned int generation;
+		Handler handler;
+	};
+
+	/**
+	 * Receive that selects registered buffers and stays armed
+	 */
+	class MultishotReceiveOperation: public IoUringService::Operation
+	{
+	public:
+		MultishotReceiveOperation(boost::shared_ptr<State> state) :
+			state(state), generation(state->generation) {
+		}
+
+		virtual void complete(int result, unsigned int flags) {
+			state->strand.post(boost::bind(&IoUringStream::handleReceive, state, generation, result, flags));
+		}
+
+		boost::shared_ptr<State> state;
+		unsigned int generation;
+	};
+
+	static void read(boost::shared_ptr<State> state, const asio::mutable_buffer &buffer, Handler handler) {
+		if (buffer.size() == 0) {
+			state->strand.post(boost::bind(handler, ErrorCode(), 0));
+		} else if (!state->chunks.empty()) {
+			size_t length = copyChunks(*state, buffer);
+			state->strand.post(boost::bind(handler, ErrorCode(), length));
+		} else if (state->error) {
+			state->strand.post(boost::bind(handler, state->error, 0));
+		} else if (state->service.hasMultishotReceive()) {
+			state->pendingBuffer = buffer;
+			state->pendingHandler = handler;
+			if (!state->armed)
+				armReceive(state);
+		} else {
+			receive(state, buffer, handler);
+		}
+	}
+
+	static void armReceive(boost::shared_ptr<State> state) {
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_RECV;
+		sqe.fd = state->fd;
+		sqe.flags = IOSQE_BUFFER_SELECT;
+		sqe.buf_group = IoUringService::bufferGroup;
+		sqe.ioprio = IORING_RECV_MULTISHOT;
+		state->armed = true;
+		state->service.submit(sqe, new MultishotReceiveOperation(state));
+	}
+
+	/**
+	 * Single-shot receive directly into buffer
+	 */
+	static void receive(boost::shared_ptr<State> state, const asio::mutable_buffer &buffer, Handler handler) {
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_RECV;
+		sqe.fd = state->fd;
+		sqe.addr = reinterpret_cast<unsigned long>(buffer.data());
+		sqe.len = buffer.size();
+		state->service.submit(sqe, new ReceiveOperation(state, handler));
+	}
+
+	static void handleReceive(boost::shared_ptr<State> state, unsigned int generation, int result, unsigned int flags) {
+		bool hasBuffer = (flags & IORING_CQE_F_BUFFER) != 0;
+		unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (generation != state->generation) {
+			// Data of closed connection
+			if (hasBuffer)
+				state->service.recycleBuffer(id);
+			return;
+		}
+		if (!(flags & IORING_CQE_F_MORE))
+			state->armed = false;
+		if (result > 0 && hasBuffer) {
+			Chunk chunk = { id, 0, static_cast<size_t>(result) };
+			state->chunks.push_back(chunk);
+		} else if (result == 0) {
+			state->error = asio::error::eof;
+		} else if (result == -EINVAL) {
+			// Kernel has buffer ring but no multishot receive (Linux < 6.0)
+			state->service.disableMultishotReceive();
+		} else if (result < 0 && result != -ENOBUFS) {
+			state->error = ErrorCode(-result, asio::error::get_system_category());
+		}
+		if (!state->pendingHandler)
+			return;
+		Handler handler;
+		handler.swap(state->pendingHandler);
+		if (result == -ENOBUFS && state->chunks.empty()) {
+			// All registered buffers hold unread data, so receive without them
+			receive(state, state->pendingBuffer, handler);
+		} else {
+			read(state, state->pendingBuffer, handler);
+		}
+	}
+
+	static size_t copyChunks(State &state, const asio::mutable_buffer &buffer) {
+		unsigned char *data = static_cast<unsigned char *>(buffer.data());
+		size_t copied = 0;
+		while (copied < buffer.size() && !state.chunks.empty()) {
+			Chunk &chunk = state.chunks.front();
+			size_t length = std::min(chunk.end - chunk.begin, buffer.size() - copied);
+			memcpy(data + copied, state.service.getBuffer(chunk.id) + chunk.begin, length);
+			copied += length;
+			chunk.begin += length;
+			if (chunk.begin == chunk.end) {
+				state.service.recycleBuffer(chunk.id);
+				state.chunks.pop_front();
+			}
+		}
+		return copied;
+	}
+
+	static void finish(boost::shared_ptr<State> state, unsigned int generation, Handler handler, int result, bool receive) {
+		if (generation != state->generation) {
+			handler(asio::error::operation_aborted, 0);
+		} else if (result < 0) {
+			handler(ErrorCode(-result, asio::error::get_system_category()), 0);
+		} else if (result == 0 && receive) {
+			handler(asio::error::eof, 0);
+		} else {
+			handler(ErrorCode(), result);
+		}
+	}
+
+	asio::io_service &io_service;
+	boost::shared_ptr<State> state;
+};
+
+/**
+ * @brief TCP socket whose reads and writes go through io_uring (Linux 5.1 and newer)
+ *
+ * Connects like TcpSocket, then sends and receives with requests batched on the io_uring
+ * instance of its io_service, see IoUringService. Falls back to TcpSocket when io_uring is not available.
+ * Registered for connection strings uring://host:port when CPS_USE_IO_URING is defined
+ */
+class IoUringSocket: public TcpSocket
+{
+public:
+	IoUringSocket(asio::io_service &io_service, const std::string &host = "", int port = 5550) :
+		TcpSocket(io_service), ring(asio::use_service<IoUringService>(io_service)), stream(io_service, strand),
+		defaultHost(host), defaultPort(port) {
+	}
+	virtual ~IoUringSocket() {
+		shutdown();
+	}
+
+	/**
+	 * Creates socket for address host[:port] of uring:// connection string
+	 */
+	static boost::shared_ptr<AbstractSocket> create(asio::io_service &io_service, const std::string &address) {
+		size_t portDelim = address.find(':');
+		if (portDelim == std::string::npos)
+			return boost::shared_ptr<AbstractSocket>(new IoUringSocket(io_service, address));
+		return boost::shared_ptr<AbstractSocket>(new IoUringSocket(io_service, address.substr(0, portDelim),
+				atoi(address.substr(portDelim + 1).c_str())));
+	}
+
+	/**
+	 * Connects to given host, or to address of connection string when port is 0
+	 */
+	virtual void asyncConnect(const std::string &host, int port, Handler handler) {
+		if (port == 0) {
+			TcpSocket::asyncConnect(defaultHost, defaultPort, handler);
+		} else {
+			TcpSocket::asyncConnect(host, port, handler);
+		}
+	}
+
+	using TcpSocket::asyncWrite;
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) {
+		if (!ring.isEnabled())
+			return TcpSocket::asyncWrite(buffers, handler);
+		stream.setDescriptor(socket.native_handle());
+		writeData(stream, buffers, handler);
+	}
+
+	virtual void asyncRead(ReadHandler handler) {
+		if (!ring.isEnabled())
+			return TcpSocket::asyncRead(handler);
+		stream.setDescriptor(socket.native_handle());
+		readFrame(stream, handler);
+	}
+
+	virtual void close() {
+		shutdown();
+		stream.reset();
+		TcpSocket::close();
+	}
+
+protected:
+	/**
+	 * Completes requests in flight on the socket, they keep it open otherwise
+	 */
+	void shutdown() {
+		if (socket.is_open())
+			::shutdown(socket.native_handle(), SHUT_RDWR);
+	}
+
+	IoUringService &ring;
+	IoUringStream stream;
+	std::string defaultHost; /// Address of connection string
+	int defaultPort;
+};
+}
+
+#endif //#ifndef CPS_IOURINGSOCKET_HPP_
@@ -2,8 +2,12 @@
 #define CPS_PROTOBUF_HPP
 
 #include <string>
+#include <vector>
+#include <cstring>
 #include <boost/lexical_cast.hpp>
 
+#include "Exception.hpp"
+
 namespace CPS
 {
 enum {
@@ -15,41 +19,205 @@ enum {
     ProtobufWireType_32bit
 };
 
-static std::string varintToBytes(unsigned int value)
+/**
+ * Returns number of bytes value takes when encoded as varint
+ */
+static inline size_t varintSize(unsigned long long value)
+{
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+/**
+ * Encodes value as varint, buffer must have room for varintSize(value) bytes
+ * @return number of bytes written
+ */
+static inline size_t writeVarint(unsigned char *buffer, unsigned long long value)
+{
+    size_t size = 0;
+    while (value >= 0x80) {
+        // Lowest 7 bits, first bit indicates more bytes are to follow
+        buffer[size++] = static_cast<unsigned char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = static_cast<unsigned char>(value);
+    return size;
+}
+
+/**
+ * Encodes field tag, buffer must have room for fieldTagSize(fieldNumber) bytes
+ * @return number of bytes written
+ */
+static inline size_t writeFieldTag(unsigned char *buffer, unsigned int fieldNumber, unsigned int wireType)
+{
+    return writeVarint(buffer, (static_cast<unsigned long long>(fieldNumber) << 3) | wireType);
+}
+
+static inline size_t fieldTagSize(unsigned int fieldNumber)
+{
+    return varintSize(static_cast<unsigned long long>(fieldNumber) << 3);
+}
+
+/**
+ * Returns encoded size of length delimited field with data of given length
+ */
+static inline size_t lengthDelimitedFieldSize(unsigned int fieldNumber, size_t length)
+{
+    return fieldTagSize(fieldNumber) + varintSize(length) + length;
+}
+
+/**
+ * Encodes length delimited field, buffer must have room for lengthDelimitedFieldSize() bytes
+ * @return end of written field
+ */
+static inline unsigned char *writeStringField(unsigned char *buffer, unsigned int fieldNumber, const std::string &data)
+{
+    buffer += writeFieldTag(buffer, fieldNumber, ProtobufWireType_LengthDelimited);
+    buffer += writeVarint(buffer, data.size());
+    if (!data.empty())
+        memcpy(buffer, data.data(), data.size());
+    return buffer + data.size();
+}
+
+static std::string varintToBytes(unsigned long long value)
 {
-    std::string result = "";
-    char byte = 0x00;
-    while (value > 0) {
-        // Copy first 7 bits
-        byte = value & 0x7F;
-        // Shift to process next bits
-        value = value >> 7;
-        // Set first bit to indicate more numbers are to follow
-        if (value > 0)
-            byte |= 0x80;
-        // Add byte to result
-        result.push_back(byte);
-    }
-    return result;
+    unsigned char bytes[10];
+    return std::string(reinterpret_cast<char *>(bytes), writeVarint(bytes, value));
 }
 
-static unsigned int bytesToVarint(std::vector<unsigned char> &bytes,
-                                  unsigned int offset, unsigned int &result)
+/**
+ * Decodes varint, reading at most size bytes
+ * @return number of bytes read, 0 if data ends before varint does
+ * @throw CPS::Exception if varint does not fit in 64 bits
+ */
+static inline size_t readVarint(const unsigned char *data, size_t size, unsigned long long &result)
 {
-    unsigned int shift = 0;
-    unsigned int parsed = 0;
-    for (; offset + parsed < bytes.size(); parsed++) {
-        if (shift > 31) { // Should actually check if shift is < 32, to avoid overflow
+    result = 0;
+    for (size_t parsed = 0; parsed < size; parsed++) {
+        if (parsed == 9 && data[parsed] > 0x01) {
             BOOST_THROW_EXCEPTION(CPS::Exception("Integer overflow", 9005));
         }
-        result += (bytes[offset + parsed] & 0x7F) << shift;
-        shift += 7;
-        if ((bytes[offset + parsed] & 0x80) == 0)
+        result |= static_cast<unsigned long long>(data[parsed] & 0x7F) << (7 * parsed);
+        if ((data[parsed] & 0x80) == 0)
             return parsed + 1;
     }
-    return parsed;
+    return 0;
 }
 
+/**
+ * @brief Bytes of a protobuf field, data is not owned
+ */
+struct ProtobufSlice
+{
+    ProtobufSlice() :
+        data(NULL), size(0) {
+    }
+
+    bool empty() const {
+        return size == 0;
+    }
+
+    bool equals(const std::string &value) const {
+        return value.size() == size && (size == 0 || memcmp(value.data(), data, size) == 0);
+    }
+
+    std::string toString() const {
+        return size ? std::string(reinterpret_cast<const char *>(data), size) : std::string();
+    }
+
+    const unsigned char *data;
+    size_t size;
+};
+
+/**
+ * @brief Walks encoded protobuf message in place
+ *
+ * Unlike Protobuf::fromBytes() fields are neither allocated nor copied, data of a field
+ * refers into the message, so message has to outlive it
+ */
+class ProtobufReader
+{
+public:
+    ProtobufReader(const unsigned char *message, size_t size) :
+        fieldNumber(0), wireType(0), value(0), message(message), messageSize(size), position(0) {
+    }
+
+    /**
+     * Reads next field
+     * @return false at end of message
+     * @throw CPS::Exception if field is truncated or has unsupported wire type
+     */
+    bool next() {
+        if (position >= messageSize)
+            return false;
+        unsigned long long tag = 0;
+        position += checked(readVarint(message + position, messageSize - position, tag));
+        fieldNumber = static_cast<unsigned int>(tag >> 3);
+        wireType = static_cast<unsigned int>(tag & 0x07);
+        value = 0;
+        data = ProtobufSlice();
+        size_t length = 0;
+        if (wireType == ProtobufWireType_Varint) {
+            position += checked(readVarint(message + position, messageSize - position, value));
+            return true;
+        } else if (wireType == ProtobufWireType_LengthDelimited) {
+            position += checked(readVarint(message + position, messageSize - position, value));
+            if (value > messageSize - position)
+                truncated();
+            length = static_cast<size_t>(value);
+        } else if (wireType == ProtobufWireType_32bit) {
+            length = 4;
+        } else if (wireType == ProtobufWireType_64bit) {
+            length = 8;
+        } else {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Not supported protocol buffer wire type", 9005));
+        }
+        if (length > messageSize - position)
+            truncated();
+        data.data = message + position;
+        data.size = length;
+        position += length;
+        return true;
+    }
+
+    /**
+     * Returns offset of next field from the beginning of message
+     */
+    size_t getPosition() const {
+        return position;
+    }
+
+    void setPosition(size_t position) {
+        this->position = position;
+    }
+
+    unsigned int fieldNumber;
+    unsigned int wireType;
+    /** Value of varint field, length of length delimited field */
+    unsigned long long value;
+    /** Data of length delimited and fixed length fields */
+    ProtobufSlice data;
+
+private:
+    size_t checked(size_t parsed) {
+        if (parsed == 0)
+            truncated();
+        return parsed;
+    }
+
+    void truncated() {
+        BOOST_THROW_EXCEPTION(CPS::Exception("Truncated protocol buffer message", 9005));
+    }
+
+    const unsigned char *message;
+    size_t messageSize;
+    size_t position;
+};
+
 class ProtobufField
 {
 public:
@@ -60,34 +228,20 @@ public:
     }
 
     int fromBytes(std::vector<unsigned char> &stream, unsigned int &offset) {
-        unsigned int value = 0;
-        unsigned int parsed = bytesToVarint(stream, offset, value);
-        if (parsed == 0)
-            return parsed;
-        unsigned int originalOffset = offset;
-        offset += parsed;
-
-        this->wireType = (value & 0x07);
-        this->fieldNumber = (value >> 3);
-        value = 0;
-
+        if (offset >= stream.size())
+            return 0;
+        ProtobufReader reader(&stream[0], stream.size());
+        reader.setPosition(offset);
+        reader.next();
+        this->wireType = reader.wireType;
+        this->fieldNumber = reader.fieldNumber;
         if (this->wireType == ProtobufWireType_Varint) {
-            parsed = bytesToVarint(stream, offset, value);
-            offset += parsed + value;
-            this->data = boost::lexical_cast<std::string>(value);
-        } else if (this->wireType == ProtobufWireType_LengthDelimited) {
-            parsed = bytesToVarint(stream, offset, value);
-            if (parsed == 0)
-                return parsed;
-            this->data = std::string(stream.begin() + offset + parsed,
-                                     stream.begin() + offset + parsed + value);
-            offset += parsed + value;
-        } else if (this->wireType == ProtobufWireType_32bit) {
-            this->data = std::string(stream.begin() + offset, stream.begin() + offset + 4);
-            offset += 4;
+            this->data = boost::lexical_cast<std::string>(reader.value);
         } else {
-            BOOST_THROW_EXCEPTION(CPS::Exception("Not supported protocol buffer wire type", 9005));
+            this->data = reader.data.toString();
         }
+        unsigned int originalOffset = offset;
+        offset = static_cast<unsigned int>(reader.getPosition());
         return offset - originalOffset;
     }
 
@@ -174,4 +328,4 @@ public:
 };
 }
 
-#endif //#ifndef CPS_RESPONSE_HPP 
+#endif //#ifndef CPS_PROTOBUF_HPP
@@ -0,0 +1,472 @@
+#ifndef CPS_PROTOCOL_HPP
+#define CPS_PROTOCOL_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstring>
+
+#include "Exception.hpp"
+#include "Protobuf.hpp"
+#include "Response.hpp"
+#include "Utils.hpp"
+
+#include <boost/lexical_cast.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+
+namespace CPS
+{
+
+/**
+ * @brief Tells whether response type can parse reply in place
+ *
+ * Value is true if ResponseType has constructor (std::vector<unsigned char> &reply, size_t offset, size_t length)
+ * like responses of this library. Response types written for earlier versions, which only have
+ * constructor from std::string, are constructed from copy of reply instead.
+ * Compilers without expression SFINAE assume the in-place constructor
+ */
+template<class ResponseType>
+struct ParsesInPlace
+{
+#ifdef BOOST_NO_SFINAE_EXPR
+    static const bool value = true;
+#else
+private:
+    typedef char Yes;
+    typedef char (&No)[2];
+    template<size_t> struct Check {};
+    template<class T> static Yes test(Check<sizeof(T(*static_cast<std::vector<unsigned char> *>(0), size_t(), size_t()))> *);
+    template<class T> static No test(...);
+public:
+    static const bool value = sizeof(test<ResponseType>(0)) == sizeof(Yes);
+#endif
+};
+
+/**
+ * @brief Framing of Clusterpoint binary protocol without any I/O
+ *
+ * Requests are framed into bytes and received bytes are decoded into responses,
+ * so the protocol can be driven by any event loop. Connection uses the same framing
+ * over its sockets. Not thread-safe, owner has to guard it.
+ *
+ * @code
+ * CPS::ProtocolEngine engine;
+ * engine.send(message, "storage");
+ * // write engine.getOutput() to socket, then
+ * engine.consumeOutput(written);
+ * // for each chunk read from socket
+ * engine.receive(data, length);
+ * while (engine.hasReply()) {
+ *     unsigned long long id;
+ *     CPS::Response *resp = engine.nextResponse<CPS::Response>(id);
+ * }
+ * @endcode
+ */
+class ProtocolEngine
+{
+public:
+    /** Length of frame header */
+    static const size_t headerSize = 8;
+
+    /**
+     * @param pipelined send requests with ids, so they do not wait for previous replies
+     * @param documentRootXpath document root of responses
+     * @param documentIdXpath document id xpath of responses
+     */
+    ProtocolEngine(bool pipelined = true, const std::string &documentRootXpath = "document",
+            const std::string &documentIdXpath = "document/id") :
+        pipelined(pipelined), documentRootXpath(documentRootXpath), documentIdXpath(documentIdXpath),
+        lastRequestId(0), inputBegin(0) {
+    }
+
+    /**
+     * Frames request message and appends it to output
+     * @param message request message (cps:request envelope)
+     * @param storage storage message is addressed to
+     * @return id of request, nextResponse() returns it with the reply
+     */
+    unsigned long long send(const std::string &message, const std::string &storage = "") {
+        unsigned long long id = ++this->lastRequestId;
+        std::string requestId = this->pipelined ? Utils::toString(id) : "";
+        Frame frame;
+        frame.encode(message.size(), storage, requestId);
+        // Frame is written straight into output, message is copied only once
+        size_t offset = this->output.size();
+        this->output.resize(offset + frame.size());
+        frame.write(&this->output[offset], message.data());
+        this->sent.push_back(id);
+        return id;
+    }
+
+    /**
+     * Returns bytes waiting to be written
+     */
+    const std::string &getOutput() const {
+        return this->output;
+    }
+
+    /**
+     * Removes bytes that have been written from output
+     */
+    void consumeOutput(size_t length) {
+        this->output.erase(0, length);
+    }
+
+    /**
+     * Passes bytes read from connection. Completed replies become available with nextResponse()
+     * @throw CPS::Exception if bytes are not a valid reply stream, connection has to be closed then
+     */
+    void receive(const void *data, size_t length) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        this->input.insert(this->input.end(), bytes, bytes + length);
+        for (;;) {
+            size_t available = this->input.size() - this->inputBegin;
+            if (available < headerSize)
+                break;
+            size_t contentLength = 0;
+            if (!parseHeader(&this->input[this->inputBegin], contentLength)) {
+                BOOST_THROW_EXCEPTION(CPS::Exception("Invalid header received", 9005));
+            }
+            if (available < headerSize + contentLength)
+                break;
+            const unsigned char *content = &this->input[this->inputBegin + headerSize];
+            this->inputBegin += headerSize + contentLength;
+            addReply(content, contentLength);
+        }
+        // Drop consumed bytes once they are the larger part of buffer
+        if (this->inputBegin > 0 && this->inputBegin * 2 >= this->input.size()) {
+            this->input.erase(this->input.begin(), this->input.begin() + this->inputBegin);
+            this->inputBegin = 0;
+        }
+    }
+
+    /**
+     * Returns true if a reply has been received and not returned yet
+     */
+    bool hasReply() const {
+        return !this->replies.empty();
+    }
+
+    /**
+     * Returns next received reply. Reply is removed even if it carries an error
+     * @param id receives id of request reply belongs to
+     * @throw CPS::Exception if server returned error, response is attached to exception
+     */
+    template<class ResponseType>
+    ResponseType *nextResponse(unsigned long long &id) {
+        if (this->replies.empty()) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("No reply received", 9005));
+        }
+        Reply reply;
+        reply.id = this->replies.front().id;
+        reply.content.swap(this->replies.front().content);
+        reply.messageOffset = this->replies.front().messageOffset;
+        reply.messageSize = this->replies.front().messageSize;
+        this->replies.pop_front();
+        id = reply.id;
+        return createResponse<ResponseType>(reply.content, reply.messageOffset, reply.messageSize,
+                this->documentRootXpath, this->documentIdXpath);
+    }
+
+    /**
+     * Returns number of sent requests without reply
+     */
+    size_t getOutstanding() const {
+        return this->sent.size();
+    }
+
+    /**
+     * Drops unsent output, partial input and outstanding requests, e.g. after connection is lost
+     * @return ids of requests whose replies will not arrive
+     */
+    std::vector<unsigned long long> reset() {
+        std::vector<unsigned long long> lost(this->sent.begin(), this->sent.end());
+        this->sent.clear();
+        this->output.clear();
+        this->input.clear();
+        this->inputBegin = 0;
+        return lost;
+    }
+
+    /**
+     * Writes frame header for content of given length
+     * @param header buffer of headerSize bytes
+     */
+    static void writeHeader(unsigned char *header, size_t length) {
+        header[0] = 0x09;
+        header[1] = 0x09;
+        header[2] = 0x00;
+        header[3] = 0x00;
+        header[4] = static_cast<unsigned char>(length & 0xFF);
+        header[5] = static_cast<unsigned char>((length >> 8) & 0xFF);
+        header[6] = static_cast<unsigned char>((length >> 16) & 0xFF);
+        header[7] = static_cast<unsigned char>((length >> 24) & 0xFF);
+    }
+
+    /**
+     * Checks frame header and reads length of its content
+     * @return false if header is not valid
+     */
+    static bool parseHeader(const unsigned char *header, size_t &contentLength) {
+        if (!(header[0] == 0x09 && header[1] == 0x09 && header[2] == 0x00 && header[3] == 0x00))
+            return false;
+        contentLength = static_cast<size_t>(header[4]) | (static_cast<size_t>(header[5]) << 8)
+                | (static_cast<size_t>(header[6]) << 16) | (static_cast<size_t>(header[7]) << 24);
+        return true;
+    }
+
+    /**
+     * @brief Framing sent around one request message
+     *
+     * Frame header, field tags and length prefixes are encoded into the frame itself, sized up front.
+     * Message, storage and request id are only referenced, so encoding neither allocates nor copies
+     * the payload. Referenced strings must outlive the frame
+     */
+    class Frame
+    {
+    public:
+        /** Part of frame, data is not owned */
+        struct Buffer
+        {
+            const void *data;
+            size_t size;
+        };
+
+        /** Maximum number of buffers of a frame */
+        static const size_t maxBuffers = 6;
+
+        Frame() :
+            headSize(0), storagePrefixSize(0), idPrefixSize(0), messageSize(0), storage(NULL), requestId(NULL) {
+        }
+
+        /**
+         * Encodes framing of message
+         * @param messageSize length of message
+         * @param storage storage message is addressed to
+         * @param requestId id of pipelined request, empty if request waits for previous replies
+         */
+        void encode(size_t messageSize, const std::string &storage, const std::string &requestId) {
+            // Data is formated using ProtoBuffers
+            // (http://code.google.com/apis/protocolbuffers/docs/encoding.html)
+            // Message is the first field, it is followed by storage, pipelining flag and request id
+            this->messageSize = messageSize;
+            this->storage = storage.empty() ? NULL : &storage;
+            this->requestId = requestId.empty() ? NULL : &requestId;
+            size_t prefixSize = writeFieldTag(head + headerSize, 1, ProtobufWireType_LengthDelimited);
+            prefixSize += writeVarint(head + headerSize + prefixSize, messageSize);
+            this->headSize = headerSize + prefixSize;
+            this->storagePrefixSize = 0;
+            if (this->storage) {
+                this->storagePrefixSize = writeFieldTag(storagePrefix, 2, ProtobufWireType_LengthDelimited);
+                this->storagePrefixSize += writeVarint(storagePrefix + this->storagePrefixSize, storage.size());
+            }
+            this->idPrefixSize = 0;
+            if (this->requestId) {
+                this->idPrefixSize = writeFieldTag(idPrefix, 12, ProtobufWireType_Varint);
+                this->idPrefixSize += writeVarint(idPrefix + this->idPrefixSize, 1);
+                this->idPrefixSize += writeFieldTag(idPrefix + this->idPrefixSize, 13, ProtobufWireType_LengthDelimited);
+                this->idPrefixSize += writeVarint(idPrefix + this->idPrefixSize, requestId.size());
+            }
+            writeHeader(head, size() - headerSize);
+        }
+
+        /**
+         * Drops framing, message of given length is sent as is
+         */
+        void clear(size_t messageSize) {
+            this->messageSize = messageSize;
+            this->headSize = 0;
+            this->storagePrefixSize = 0;
+            this->idPrefixSize = 0;
+            this->storage = NULL;
+            this->requestId = NULL;
+        }
+
+        /**
+         * Returns length of whole frame including message
+         */
+        size_t size() const {
+            return this->headSize + this->messageSize + this->storagePrefixSize + (this->storage ? this->storage->size() : 0)
+                    + this->idPrefixSize + (this->requestId ? this->requestId->size() : 0);
+        }
+
+        /**
+         * Fills buffer list of the whole frame, message is referenced from its own buffer
+         * @param buffers array of maxBuffers entries
+         * @param message message of messageSize bytes the frame was encoded for
+         * @return number of buffers used
+         */
+        size_t getBuffers(Buffer *buffers, const void *message) const {
+            size_t count = 0;
+            add(buffers, count, this->head, this->headSize);
+            add(buffers, count, message, this->messageSize);
+            add(buffers, count, this->storagePrefix, this->storagePrefixSize);
+            if (this->storage)
+                add(buffers, count, this->storage->data(), this->storage->size());
+            add(buffers, count, this->idPrefix, this->idPrefixSize);
+            if (this->requestId)
+                add(buffers, count, this->requestId->data(), this->requestId->size());
+            return count;
+        }
+
+        /**
+         * Writes the whole frame into contiguous buffer of size() bytes
+         */
+        void write(void *output, const void *message) const {
+            Buffer buffers[maxBuffers];
+            size_t count = getBuffers(buffers, message);
+            unsigned char *out = static_cast<unsigned char *>(output);
+            for (size_t i = 0; i < count; i++) {
+                memcpy(out, buffers[i].data, buffers[i].size);
+                out += buffers[i].size;
+            }
+        }
+
+    private:
+        static void add(Buffer *buffers, size_t &count, const void *data, size_t size) {
+            if (size == 0)
+                return;
+            buffers[count].data = data;
+            buffers[count].size = size;
+            count++;
+        }
+
+        /** Frame header and tag and length of message field */
+        unsigned char head[headerSize + 11];
+        size_t headSize;
+        /** Tag and length of storage field */
+        unsigned char storagePrefix[11];
+        size_t storagePrefixSize;
+        /** Pipelining flag, tag and length of request id field */
+        unsigned char idPrefix[15];
+        size_t idPrefixSize;
+        size_t messageSize;
+        const std::string *storage;
+        const std::string *requestId;
+    };
+
+    /**
+     * Decodes content of reply frame in place
+     * @param message receives reply message, it refers into content
+     * @param id receives id of pipelined request, empty if reply has none
+     * @throw CPS::Exception if content is not a valid reply
+     */
+    static void decodeReply(const unsigned char *content, size_t size, ProtobufSlice &message, ProtobufSlice &id) {
+        ProtobufReader reader(content, size);
+        bool hasMessage = false;
+        id = ProtobufSlice();
+        while (reader.next()) {
+            if (reader.wireType != ProtobufWireType_LengthDelimited)
+                continue;
+            if (reader.fieldNumber == 1) {
+                message = reader.data;
+                hasMessage = true;
+            } else if (reader.fieldNumber == 13) {
+                id = reader.data;
+            }
+        }
+        if (!hasMessage) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Invalid response", 9001));
+        }
+    }
+
+    static void decodeReply(const std::vector<unsigned char> &content, ProtobufSlice &message, ProtobufSlice &id) {
+        decodeReply(content.empty() ? NULL : &content[0], content.size(), message, id);
+    }
+
+    /**
+     * Creates response object from reply message, message is parsed in place
+     * if response type supports it, see ParsesInPlace
+     * @param content buffer holding reply message, it is taken over by response parsed in place
+     * @param offset start of message in content
+     * @param length length of message
+     * @throw CPS::Exception if server returned error, response is attached to exception
+     */
+    template<class ResponseType>
+    static ResponseType *createResponse(std::vector<unsigned char> &content, size_t offset, size_t length,
+            const std::string &documentRootXpath, const std::string &documentIdXpath) {
+        ResponseType *resp = newResponse<ResponseType>(content, offset, length);
+        resp->documentRootXpath = documentRootXpath;
+        resp->documentIdXpath = documentIdXpath;
+        checkErrors(resp);
+        return resp;
+    }
+
+    /**
+     * Constructs response object from reply message without checking it for errors,
+     * message is parsed in place if response type supports it
+     * @see createResponse()
+     */
+    template<class ResponseType>
+    static ResponseType *newResponse(std::vector<unsigned char> &content, size_t offset, size_t length) {
+        return newResponse<ResponseType>(content, offset, length,
+                boost::integral_constant<bool, ParsesInPlace<ResponseType>::value>());
+    }
+
+    /**
+     * Throws first error of failed response, response is attached to exception and owned by it
+     */
+    static void checkErrors(Response *resp) {
+        if (resp->getErrors().size() > 0 && resp->hasFailed()) {
+            std::vector <Error> errors = resp->getErrors();
+            BOOST_THROW_EXCEPTION(CPS::Exception(errors[0].message, boost::lexical_cast<int>(errors[0].code), resp));
+        }
+    }
+
+private:
+    template<class ResponseType>
+    static ResponseType *newResponse(std::vector<unsigned char> &content, size_t offset, size_t length, boost::true_type) {
+        return new ResponseType(content, offset, length);
+    }
+
+    template<class ResponseType>
+    static ResponseType *newResponse(std::vector<unsigned char> &content, size_t offset, size_t length, boost::false_type) {
+        return new ResponseType(length ? std::string(reinterpret_cast<const char *>(&content[offset]), length) : std::string());
+    }
+
+    struct Reply
+    {
+        unsigned long long id;
+        std::vector<unsigned char> content; /// Frame content holding reply message
+        size_t messageOffset;
+        size_t messageSize;
+    };
+
+    /**
+     * Matches reply to its request, replies without id belong to the oldest request
+     */
+    void addReply(const unsigned char *content, size_t size) {
+        ProtobufSlice message, idSlice;
+        decodeReply(content, size, message, idSlice);
+        std::string id = idSlice.toString();
+        std::deque<unsigned long long>::iterator it = this->sent.begin();
+        if (!id.empty()) {
+            for (; it != this->sent.end() && Utils::toString(*it) != id; ++it);
+        }
+        if (it == this->sent.end()) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Unexpected reply id " + id, 9005));
+        }
+        this->replies.push_back(Reply());
+        Reply &reply = this->replies.back();
+        reply.id = *it;
+        // Only frame content leaves input, room for terminator of in-place parsing is reserved
+        reply.content.reserve(size + 1);
+        reply.content.assign(content, content + size);
+        reply.messageOffset = message.data - content;
+        reply.messageSize = message.size;
+        this->sent.erase(it);
+    }
+
+    bool pipelined;
+    std::string documentRootXpath;
+    std::string documentIdXpath;
+    unsigned long long lastRequestId;
+    std::string output; /// Framed requests not written yet
+    std::vector<unsigned char> input; /// Received bytes of incomplete replies
+    size_t inputBegin; /// Start of unprocessed input
+    std::deque<unsigned long long> sent; /// Ids of requests without reply, in order sent
+    std::deque<Reply> replies; /// Received replies not returned yet
+};
+}
+
+#endif //#ifndef CPS_PROTOCOL_HPP
@@ -5,10 +5,15 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <cstring>
+
+#include <boost/assert.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "Exception.hpp"
 #include "Utils.hpp"
 #include "Xmldocument.hpp"
+#include "CancellationToken.hpp"
 
 namespace CPS
 {
@@ -22,28 +27,13 @@ public:
      * @param command Specifies the command field for the request
      * @param requestId The request ID. Can be useful for identifying a particular request in a log file when debugging
      */
-    Request(std::string command, std::string requestId = "")
+    Request(std::string command, std::string requestId = "") :
+        cancellationToken(CancellationToken::none())
     {
         this->command = command;
         this->requestId = requestId;
         this->label = "";
         this->requestType = "auto";
-
-        std::string _textParamNames[] = { "added_external_id", "added_id", "aggregate",
-                "case_sensitive", "cr", "deleted_external_id", "deleted_id",
-                "description", "docs", "exact-match", "facet", "facet_size",
-                "fail_if_exists", "file", "finalize", "for", "force", "from",
-                "full", "group", "group_size", "h", "id", "idif", "iterator_id",
-                "len", "message", "offset", "path", "persistent", "position",
-                "quota", "rate2_ordering", "rate_from", "rate_to", "relevance",
-                "return_doc", "return_internal", "sequence_check", "stem-lang",
-                "step_size", "text", "transaction_id", "type" };
-        textParamNames = std::vector <std::string> (_textParamNames, _textParamNames + 44);
-        sort(textParamNames.begin(), textParamNames.end());
-
-        std::string _rawParamNames[] = { "list", "query", "ordering", "shapes" };
-        rawParamNames = std::vector <std::string> (_rawParamNames, _rawParamNames + 4);
-        sort(rawParamNames.begin(), rawParamNames.end());
     }
 
     virtual ~Request()
@@ -72,65 +62,47 @@ public:
             const std::map<std::string, std::vector<std::string> > &envelopeParams,
             bool createXML = false, long long transactionId = -1) const {
 
-        XMLDocument *doc = NULL;
-        Node *root = NULL, *content = NULL;
-        std::string xml_as_string;
-
-        if (createXML == true) {
-            doc = XMLDocument::create(new rapidxml::xml_document<>());
-            root = doc->createRootNode("request", "www.clusterpoint.com", "cps");
-        } else {
-            xml_as_string = "<cps:request xmlns:cps=\"www.clusterpoint.com\">";
+        std::string transactionIdString;
+        if (transactionId != -1)
+            transactionIdString = boost::lexical_cast<std::string>(transactionId);
+
+        if (createXML == false) {
+            // Exact size is computed first, so request is written into a single buffer without reallocations
+            XmlSizer sizer;
+            writeRequestXml(sizer, docRootXpath, docIdXpath, envelopeParams, transactionIdString);
+            std::string xml_as_string(sizer.size, '\0');
+            if (sizer.size > 0) {
+                XmlWriter writer(&xml_as_string[0]);
+                writeRequestXml(writer, docRootXpath, docIdXpath, envelopeParams, transactionIdString);
+            }
+            return xml_as_string;
         }
+
+        XMLDocument *doc = XMLDocument::create(new rapidxml::xml_document<>());
+        Node *root = doc->createRootNode("request", "www.clusterpoint.com", "cps");
         for (std::map<std::string, std::vector<std::string> >::const_iterator it = envelopeParams.begin(); it != envelopeParams.end(); ++it) {
             for (unsigned int i = 0; i < it->second.size(); i++) {
-                if (createXML == true) {
-                    root->addChild(it->first, "cps")->addChildText(getValidXmlValue(it->second[i]));
-                } else {
-                    xml_as_string += "<cps:" + it->first + ">";
-                    xml_as_string += getValidXmlValue(it->second[i]);
-                    xml_as_string += "</cps:" + it->first + ">";
-                }
+                root->addChild(it->first, "cps")->addChildText(getValidXmlValue(it->second[i]));
             }
         }
         // Add text fields
-        if (root) {
-            content = root->addChild("content", "cps");
-        } else {
-            xml_as_string += "<cps:content>";
-        }
+        Node *content = root->addChild("content", "cps");
         // Add transaction id if needed
         if (transactionId != -1) {
-            if (createXML == true) {
-                content->addChild("transaction_id")->addChildText(boost::lexical_cast<std::string>(transactionId));
-            } else {
-                xml_as_string += "<transaction_id>";
-                xml_as_string += boost::lexical_cast<std::string>(transactionId);
-                xml_as_string += "</transaction_id>";
-            }
+            content->addChild("transaction_id")->addChildText(transactionIdString);
         }
 
         for (std::map<std::string, std::vector<std::string> >::const_iterator it = textParams.begin(); it != textParams.end(); ++it) {
             for (unsigned int i = 0; i < it->second.size(); i++) {
-                if (createXML == true) {
-                    content->addChild(it->first)->addChildText(Utils::toString(it->second[i]));
-                } else {
-                    xml_as_string += "<" + it->first + ">";
-                    xml_as_string += Utils::toString(it->second[i]);
-                    xml_as_string += "</" + it->first + ">";
-                }
+                content->addChild(it->first)->addChildText(Utils::toString(it->second[i]));
             }
         }
         // Add special fields: query, list, ordering
         for (std::map<std::string, std::vector<std::string> >::const_iterator it = rawParams.begin(); it != rawParams.end(); ++it) {
             for (unsigned int i = 0; i < it->second.size(); i++) {
-                if (createXML == true) {
-                    XMLDocument* fragment = XMLDocument::parseFromMemory("<" + it->first + ">" + it->second[i] + "</" + it->first + ">");
-                    content->importNode(fragment->getRootNode());
-                    delete fragment;
-                } else {
-                    xml_as_string += "<" + it->first + ">" + it->second[i] + "</" + it->first + ">";
-                }
+                XMLDocument* fragment = XMLDocument::parseFromMemory("<" + it->first + ">" + it->second[i] + "</" + it->first + ">");
+                content->importNode(fragment->getRootNode());
+                delete fragment;
             }
         }
 
@@ -139,40 +111,63 @@ public:
             // ID tag_name is what is left after removing docRootXpath prefix
         	std::string id_tag_name = docIdXpath.substr(docRootXpath.size());
         	std::string document = xmlUtilCreatePath(id_tag_name.c_str(), it->first.c_str()) + it->second;
-            if (createXML == true) {
-                XMLDocument* fragment = XMLDocument::parseFromMemory(xmlUtilCreatePath(docRootXpath.c_str(), document.c_str()));
-                content->importNode(fragment->getRootNode());
-                delete fragment;
-            } else {
-                xml_as_string += xmlUtilCreatePath(docRootXpath.c_str(), document.c_str());
-            }
+            XMLDocument* fragment = XMLDocument::parseFromMemory(xmlUtilCreatePath(docRootXpath.c_str(), document.c_str()));
+            content->importNode(fragment->getRootNode());
+            delete fragment;
         }
         for (std::vector<std::string>::const_iterator it = documentsWithAutoId.begin(); it != documentsWithAutoId.end(); ++it) {
         	std::string document;
-            if (it->find("<" + docRootXpath + " ") != std::string::npos || it->find("<" + docRootXpath + ">") != std::string::npos) {
+            if (hasDocumentRoot(*it, docRootXpath)) {
                 document = *it;
             } else {
                 document = xmlUtilCreatePath(docRootXpath.c_str(), it->c_str());
             }
-            if (content) {
-                XMLDocument* fragment = XMLDocument::parseFromMemory(document);
-                content->importNode(fragment->getRootNode());
-                delete fragment;
-            } else {
-                xml_as_string += document;
-            }
+            XMLDocument* fragment = XMLDocument::parseFromMemory(document);
+            content->importNode(fragment->getRootNode());
+            delete fragment;
         }
 
-        if (doc) {
-            xml_as_string = doc->toString(true);
-            delete doc;
-        } else {
-            xml_as_string += "</cps:content></cps:request>";
-        }
+        std::string xml_as_string = doc->toString(true);
+        delete doc;
+        return xml_as_string;
+    }
 
+    /**
+     * Returns the contents of the request as an XML string with already serialized envelope
+     * @param docRootXpath document root xpath
+     * @param docIdXpath document ID xpath
+     * @param envelope CPS envelope parameters serialized with appendEnvelopeParam()
+     * @param transactionId id of transaction request belongs to, -1 if none
+     *
+     * @return string Full request XML as string
+     */
+    std::string getRequestXml(const std::string &docRootXpath, const std::string &docIdXpath,
+            const std::string &envelope, long long transactionId = -1) const {
+        std::string transactionIdString;
+        if (transactionId != -1)
+            transactionIdString = boost::lexical_cast<std::string>(transactionId);
+        XmlSizer sizer;
+        writeRequestXml(sizer, docRootXpath, docIdXpath, envelope, transactionIdString);
+        std::string xml_as_string(sizer.size, '\0');
+        XmlWriter writer(&xml_as_string[0]);
+        writeRequestXml(writer, docRootXpath, docIdXpath, envelope, transactionIdString);
         return xml_as_string;
     }
 
+    /**
+     * Serializes CPS envelope parameter and appends it to envelope
+     * @see getRequestXml(const std::string &, const std::string &, const std::string &, long long)
+     */
+    static void appendEnvelopeParam(std::string &envelope, const std::string &name, const std::string &value)
+    {
+        XmlSizer sizer;
+        writeEnvelopeParam(sizer, name, value);
+        size_t offset = envelope.size();
+        envelope.resize(offset + sizer.size);
+        XmlWriter writer(&envelope[offset]);
+        writeEnvelopeParam(writer, name, value);
+    }
+
     /**
      * Returns request id
      */
@@ -222,6 +217,102 @@ public:
         this->label = clusterLabel;
     }
 
+    /**
+     * Returns storage request is sent to, empty if storage of connection is used
+     */
+    std::string getStorage() const
+    {
+        return storage;
+    }
+    /**
+     * Sends request to given storage instead of storage of connection,
+     * so one connection or pool can serve many storages
+     * @param storage storage name, empty string to use storage of connection
+     */
+    void setStorage(const std::string &storage)
+    {
+        this->storage = storage;
+    }
+    /**
+     * Returns user name request is sent with, empty if credentials of connection are used
+     */
+    std::string getUsername() const
+    {
+        return username;
+    }
+    std::string getPassword() const
+    {
+        return password;
+    }
+    /**
+     * Sends request with given credentials instead of credentials of connection
+     * @param username user name, empty string to use credentials of connection
+     * @param password password for this user
+     */
+    void setCredentials(const std::string &username, const std::string &password)
+    {
+        this->username = username;
+        this->password = password;
+    }
+    /**
+     * Returns envelope parameters of this request
+     */
+    const MapStringStringType &getEnvelopeParams() const
+    {
+        return envelopeParams;
+    }
+    /**
+     * Sets envelope parameter sent with this request,
+     * replaces custom envelope parameter of connection with the same name
+     * @param name parameter name
+     * @param value parameter value
+     */
+    void setEnvelopeParam(const std::string &name, const std::string &value)
+    {
+        envelopeParams[name] = value;
+    }
+
+    /**
+     * Returns time by which request has to complete, not_a_date_time if there is no limit
+     */
+    boost::posix_time::ptime getDeadline() const
+    {
+        return deadline;
+    }
+    /**
+     * Sets time by which request has to complete, including connecting, sending and receiving reply.
+     * Request that does not complete in time fails with error 9008.
+     * Socket timeouts still limit each operation
+     * @param deadline UTC time as returned by boost::posix_time::microsec_clock::universal_time()
+     */
+    void setDeadline(const boost::posix_time::ptime &deadline)
+    {
+        this->deadline = deadline;
+    }
+    /**
+     * Sets deadline relative to current time
+     * @param milliseconds time request may take
+     * @see setDeadline()
+     */
+    void setTimeout(long milliseconds)
+    {
+        this->deadline = boost::posix_time::microsec_clock::universal_time()
+                + boost::posix_time::milliseconds(milliseconds);
+    }
+
+    const CancellationToken &getCancellationToken() const
+    {
+        return cancellationToken;
+    }
+    /**
+     * Sets token that aborts request when cancelled
+     * @param cancellationToken token shared with thread that may cancel the request
+     */
+    void setCancellationToken(const CancellationToken &cancellationToken)
+    {
+        this->cancellationToken = cancellationToken;
+    }
+
     /**
      * Returns the string with control characters stripped
      * @param src original string
@@ -229,12 +320,7 @@ public:
      */
     static std::string getValidXmlValue(std::string src)
     {
-        for (unsigned int i = 0; i < src.size(); i++) {
-            if ((src[i] <= 0x1f)
-                    && (src[i] != 0x09 || src[i] != 0x0a || src[i] != 0x0d)) {
-                src[i] = ' ';
-            }
-        }
+        std::replace_if(src.begin(), src.end(), &isInvalidXmlChar, ' ');
         return src;
     }
 
@@ -250,15 +336,9 @@ public:
      */
     void setParam(const std::string &name, const std::vector<std::string> &values, bool replace = false)
     {
-        if (binary_search(textParamNames.begin(), textParamNames.end(), name)) {
-        	if (replace) textParams[name] = values;
-        	else textParams[name].insert(textParams[name].end(), values.begin(), values.end());
-        } else if (binary_search(rawParamNames.begin(), rawParamNames.end(), name)) {
-        	if (replace) rawParams[name] = values;
-			else rawParams[name].insert(rawParams[name].end(), values.begin(), values.end());
-        } else {
-            BOOST_THROW_EXCEPTION(Exception("Invalid param name", 9002));
-        }
+        std::vector<std::string> &params = getParamValues(name);
+        if (replace) params = values;
+        else params.insert(params.end(), values.begin(), values.end());
     }
 
     /**
@@ -270,7 +350,9 @@ public:
      */
     void setParam(const std::string &name, const std::string &value, bool replace = false)
     {
-        setParam(name, std::vector<std::string> (1, value), replace);
+        std::vector<std::string> &params = getParamValues(name);
+        if (replace) params.assign(1, value);
+        else params.push_back(value);
     }
 
     /**
@@ -368,6 +450,17 @@ protected:
     std::string label;
     /** Request type: auto(default) / single / cluster - type of request processing. */
     std::string requestType;
+    /** Storage request is sent to, storage of connection if empty */
+    std::string storage;
+    /** Credentials request is sent with, credentials of connection if username is empty */
+    std::string username;
+    std::string password;
+    /** Envelope params overriding custom envelope params of connection */
+    MapStringStringType envelopeParams;
+    /** Time by which request has to complete */
+    boost::posix_time::ptime deadline;
+    /** Token that aborts request */
+    CancellationToken cancellationToken;
     /** List of text params */
     std::map<std::string, std::vector<std::string> > textParams;
     /** List of raw params */
@@ -378,11 +471,293 @@ protected:
     std::vector<std::string> documentsWithAutoId;
 
 private:
-    /** Params that are of text type */
-    std::vector<std::string> textParamNames;
-    /** Params that are of raw type */
-    std::vector<std::string> rawParamNames;
+    /**
+     * Counts length of serialized request
+     */
+    class XmlSizer
+    {
+    public:
+        XmlSizer() :
+            size(0) {
+        }
 
+        void append(const char * /*data*/, size_t length) {
+            size += length;
+        }
+
+        void append(const std::string &data) {
+            size += data.size();
+        }
+
+        void appendValidXmlValue(const std::string &data) {
+            size += data.size();
+        }
+
+        size_t size;
+    };
+
+    /**
+     * Writes serialized request into buffer sized by XmlSizer
+     */
+    class XmlWriter
+    {
+    public:
+        XmlWriter(char *buffer) :
+            position(buffer) {
+        }
+
+        void append(const char *data, size_t length) {
+            memcpy(position, data, length);
+            position += length;
+        }
+
+        void append(const std::string &data) {
+            append(data.data(), data.size());
+        }
+
+        /**
+         * Appends value replaced characters like getValidXmlValue()
+         */
+        void appendValidXmlValue(const std::string &data) {
+            char *begin = position;
+            append(data);
+            std::replace_if(begin, position, &isInvalidXmlChar, ' ');
+        }
+
+    private:
+        char *position;
+    };
+
+    /**
+     * Writes whole request XML, used with XmlSizer and XmlWriter alike
+     */
+    template<class Output, class Envelope>
+    void writeRequestXml(Output &out, const std::string &docRootXpath, const std::string &docIdXpath,
+            const Envelope &envelope, const std::string &transactionId) const {
+        static const char requestOpen[] = "<cps:request xmlns:cps=\"www.clusterpoint.com\">";
+        static const char contentOpen[] = "<cps:content>";
+        static const char contentClose[] = "</cps:content></cps:request>";
+        static const char transactionOpen[] = "<transaction_id>";
+        static const char transactionClose[] = "</transaction_id>";
+
+        out.append(requestOpen, sizeof(requestOpen) - 1);
+        writeEnvelope(out, envelope);
+        out.append(contentOpen, sizeof(contentOpen) - 1);
+        if (!transactionId.empty()) {
+            out.append(transactionOpen, sizeof(transactionOpen) - 1);
+            out.append(transactionId);
+            out.append(transactionClose, sizeof(transactionClose) - 1);
+        }
+        // Text and raw params are written alike, only building XML tree treats them differently
+        const std::map<std::string, std::vector<std::string> > *params[] = { &textParams, &rawParams };
+        for (unsigned int p = 0; p < 2; p++) {
+            for (std::map<std::string, std::vector<std::string> >::const_iterator it = params[p]->begin(); it != params[p]->end(); ++it) {
+                for (unsigned int i = 0; i < it->second.size(); i++) {
+                    writeTag(out, "<", 1, it->first);
+                    out.append(it->second[i]);
+                    writeTag(out, "</", 2, it->first);
+                }
+            }
+        }
+        // ID tag_name is what is left after removing docRootXpath prefix
+        size_t idTagBegin = std::min(docRootXpath.size(), docIdXpath.size());
+        for (std::map<std::string, std::string>::const_iterator it = documentsWithUserId.begin(); it != documentsWithUserId.end(); ++it) {
+            if (!hasPathTags(docRootXpath, 0))
+                continue;
+            writePathOpen(out, docRootXpath, 0);
+            if (hasPathTags(docIdXpath, idTagBegin)) {
+                writePathOpen(out, docIdXpath, idTagBegin);
+                out.append(it->first);
+                writePathClose(out, docIdXpath, idTagBegin);
+            }
+            out.append(it->second);
+            writePathClose(out, docRootXpath, 0);
+        }
+        for (std::vector<std::string>::const_iterator it = documentsWithAutoId.begin(); it != documentsWithAutoId.end(); ++it) {
+            if (hasDocumentRoot(*it, docRootXpath)) {
+                out.append(*it);
+            } else if (hasPathTags(docRootXpath, 0)) {
+                writePathOpen(out, docRootXpath, 0);
+                out.append(*it);
+                writePathClose(out, docRootXpath, 0);
+            }
+        }
+        out.append(contentClose, sizeof(contentClose) - 1);
+    }
+
+    template<class Output>
+    static void writeEnvelope(Output &out, const std::map<std::string, std::vector<std::string> > &envelopeParams) {
+        for (std::map<std::string, std::vector<std::string> >::const_iterator it = envelopeParams.begin(); it != envelopeParams.end(); ++it) {
+            for (unsigned int i = 0; i < it->second.size(); i++) {
+                writeEnvelopeParam(out, it->first, it->second[i]);
+            }
+        }
+    }
+
+    template<class Output>
+    static void writeEnvelopeParam(Output &out, const std::string &name, const std::string &value) {
+        writeTag(out, "<cps:", 5, name);
+        out.appendValidXmlValue(value);
+        writeTag(out, "</cps:", 6, name);
+    }
+
+    /**
+     * Writes envelope serialized with appendEnvelopeParam()
+     */
+    template<class Output>
+    static void writeEnvelope(Output &out, const std::string &envelope) {
+        out.append(envelope);
+    }
+
+    template<class Output>
+    static void writeTag(Output &out, const char *open, size_t openLength, const std::string &name) {
+        out.append(open, openLength);
+        out.append(name);
+        out.append(">", 1);
+    }
+
+    /**
+     * Checks whether xpath from begin has any tags, xmlUtilCreatePath() returns empty string otherwise
+     */
+    static bool hasPathTags(const std::string &xpath, size_t begin) {
+        return xpath.find_first_not_of('/', begin) != std::string::npos;
+    }
+
+    /**
+     * Writes opening tags of xpath like xmlUtilCreatePath(), starting at begin
+     */
+    template<class Output>
+    static void writePathOpen(Output &out, const std::string &xpath, size_t begin) {
+        size_t start = begin;
+        while (start < xpath.size()) {
+            size_t end = xpath.find('/', start);
+            if (end == std::string::npos)
+                end = xpath.size();
+            if (end > start) {
+                out.append("<", 1);
+                out.append(xpath.data() + start, end - start);
+                out.append(">", 1);
+            }
+            start = end + 1;
+        }
+    }
+
+    /**
+     * Writes closing tags of xpath in reverse order, starting at begin
+     */
+    template<class Output>
+    static void writePathClose(Output &out, const std::string &xpath, size_t begin) {
+        size_t end = xpath.size();
+        while (end > begin) {
+            size_t slash = xpath.rfind('/', end - 1);
+            size_t start = (slash == std::string::npos || slash < begin) ? begin : slash + 1;
+            if (end > start) {
+                out.append("</", 2);
+                out.append(xpath.data() + start, end - start);
+                out.append(">", 1);
+            }
+            if (start == begin)
+                break;
+            end = start - 1;
+        }
+    }
+
+    /**
+     * Checks whether document already contains its root element
+     */
+    static bool hasDocumentRoot(const std::string &document, const std::string &docRootXpath) {
+        for (size_t pos = document.find('<'); pos != std::string::npos; pos = document.find('<', pos + 1)) {
+            if (document.compare(pos + 1, docRootXpath.size(), docRootXpath) == 0
+                    && pos + 1 + docRootXpath.size() < document.size()) {
+                char next = document[pos + 1 + docRootXpath.size()];
+                if (next == ' ' || next == '>')
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    static bool isInvalidXmlChar(char c) {
+        return (c <= 0x1f) && (c != 0x09 || c != 0x0a || c != 0x0d);
+    }
+
+    /**
+     * Kind of request parameter, decides how its value is written into request
+     */
+    enum ParamType
+    {
+        ParamType_Invalid,
+        ParamType_Text,
+        ParamType_Raw
+    };
+
+    /**
+     * Returns kind of parameter. Parameter names are fixed tables searched in place,
+     * so constructing requests and setting params does not build them.
+     * Tables have to be kept sorted, debug builds check it on first use
+     */
+    static ParamType getParamType(const std::string &name) {
+        static const char *const textParamNames[] = { "added_external_id", "added_id", "aggregate",
+                "case_sensitive", "cr", "deleted_external_id", "deleted_id",
+                "description", "docs", "exact-match", "facet", "facet_size",
+                "fail_if_exists", "file", "finalize", "for", "force", "from",
+                "full", "group", "group_size", "h", "id", "idif", "iterator_id",
+                "len", "message", "offset", "path", "persistent", "position",
+                "quota", "rate2_ordering", "rate_from", "rate_to", "relevance",
+                "return_doc", "return_internal", "sequence_check", "stem-lang",
+                "step_size", "text", "transaction_id", "type" };
+        static const char *const rawParamNames[] = { "list", "ordering", "query", "shapes" };
+#ifndef NDEBUG
+        static const bool sorted = isSorted(textParamNames, sizeof(textParamNames) / sizeof(textParamNames[0]))
+                && isSorted(rawParamNames, sizeof(rawParamNames) / sizeof(rawParamNames[0]));
+        BOOST_ASSERT_MSG(sorted, "Param name tables must be sorted");
+#endif
+        if (findParamName(textParamNames, sizeof(textParamNames) / sizeof(textParamNames[0]), name))
+            return ParamType_Text;
+        if (findParamName(rawParamNames, sizeof(rawParamNames) / sizeof(rawParamNames[0]), name))
+            return ParamType_Raw;
+        return ParamType_Invalid;
+    }
+
+    static bool isSorted(const char *const *names, size_t count) {
+        for (size_t i = 1; i < count; i++) {
+            if (strcmp(names[i - 1], names[i]) >= 0)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Binary search in sorted table of names
+     */
+    static bool findParamName(const char *const *names, size_t count, const std::string &name) {
+        size_t low = 0, high = count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            int cmp = name.compare(names[middle]);
+            if (cmp == 0)
+                return true;
+            if (cmp > 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return false;
+    }
+
+    /**
+     * Returns values of parameter, throws if parameter name is not valid
+     */
+    std::vector<std::string> &getParamValues(const std::string &name) {
+        switch (getParamType(name)) {
+        case ParamType_Text:
+            return textParams[name];
+        case ParamType_Raw:
+            return rawParams[name];
+        default:
+            BOOST_THROW_EXCEPTION(Exception("Invalid param name", 9002));
+        }
+    }
 };
 
 class Ordering
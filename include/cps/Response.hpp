@@ -29,6 +29,24 @@ public:
             BOOST_THROW_EXCEPTION(CPS::Exception("Invalid response", 9001));
         }
     }
+    /**
+     * Constructs Response object parsing reply where it is received, so it is not copied.
+     * Derived response types should have the same constructor, types that only have
+     * constructor from string get a copy of reply, see ParsesInPlace
+     * @param reply buffer holding raw response, it is taken over by response and left empty
+     * @param offset start of raw response in reply
+     * @param length length of raw response
+     */
+    Response(std::vector<unsigned char> &reply, size_t offset, size_t length, std::string documentRootXpath = "document",
+            std::string documentIdXpath = "document/id"): failed(false) {
+        this->documentRootXpath = documentRootXpath;
+        this->documentIdXpath = documentIdXpath;
+        try {
+            doc = XMLDocument::parseInPlace(reply, offset, length);
+        } catch (std::exception &e) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Invalid response", 9001));
+        }
+    }
     virtual ~Response() {
         delete doc;
     }
@@ -0,0 +1,151 @@
+#ifndef CPS_RETRYPOLICY_HPP
+#define CPS_RETRYPOLICY_HPP
+
+#include <string>
+#include <set>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/random/linear_congruential.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace CPS
+{
+
+/**
+ * @brief Counters of request retries
+ * @see Connection::getRetryStatistics()
+ */
+class RetryStatistics
+{
+public:
+    RetryStatistics() :
+        retries(0), recovered(0), exhausted(0), notRetried(0) {
+    }
+
+    /** Number of times requests were sent again */
+    unsigned long long retries;
+    /** Number of requests that succeeded after being retried */
+    unsigned long long recovered;
+    /** Number of requests that failed after using up all retries or budget */
+    unsigned long long exhausted;
+    /** Number of failed requests that were not retried because they are not idempotent */
+    unsigned long long notRetried;
+};
+
+/**
+ * @brief Decides whether request that failed because of connection problem is sent again
+ *
+ * Only idempotent commands, which give the same result when executed twice, are retried,
+ * as it is not known whether server has processed the failed request.
+ * By default these are commands that only read data and update, which sets whole documents
+ * with given ids, so repeating it leaves them the same.
+ * Requests are retried on a new connection after exponential backoff with full jitter,
+ * within time budget counted from the first attempt.
+ * Errors reported by server in reply are never retried
+ */
+class RetryPolicy
+{
+public:
+    RetryPolicy() :
+        maxRetries(2), initialBackoff(50), maxBackoff(2000), multiplier(2.0), budget(10000),
+        idempotentCommands(getDefaultIdempotentCommands()), jitter(new Jitter()) {
+    }
+
+    /**
+     * Returns policy that never retries
+     */
+    static RetryPolicy none() {
+        RetryPolicy policy;
+        policy.maxRetries = 0;
+        return policy;
+    }
+
+    bool isIdempotent(const std::string &command) const {
+        return idempotentCommands->count(command) > 0;
+    }
+
+    /**
+     * Marks command as safe to send again, e.g. "replace"
+     */
+    void addIdempotentCommand(const std::string &command) {
+        boost::shared_ptr<std::set<std::string> > commands(new std::set<std::string>(*idempotentCommands));
+        commands->insert(command);
+        idempotentCommands = commands;
+    }
+
+    void removeIdempotentCommand(const std::string &command) {
+        boost::shared_ptr<std::set<std::string> > commands(new std::set<std::string>(*idempotentCommands));
+        commands->erase(command);
+        idempotentCommands = commands;
+    }
+
+    /**
+     * Returns random delay in milliseconds before retry
+     * @param retry number of retry starting from 0
+     */
+    int getBackoff(unsigned int retry) const {
+        double cap = initialBackoff;
+        for (unsigned int i = 0; i < retry && cap < maxBackoff; i++) {
+            cap *= multiplier;
+        }
+        int limit = static_cast<int>(std::min(cap, static_cast<double>(maxBackoff)));
+        if (limit <= 0)
+            return 0;
+        // Full jitter spreads reconnects of many clients over the whole interval
+        boost::random::uniform_int_distribution<int> distribution(0, limit);
+        boost::mutex::scoped_lock lock(jitter->mutex);
+        return distribution(jitter->engine);
+    }
+
+    /** Maximum number of times one request is sent again, 0 disables retries */
+    unsigned int maxRetries;
+    /** Upper bound of backoff before first retry in milliseconds */
+    int initialBackoff;
+    /** Upper bound of any backoff in milliseconds */
+    int maxBackoff;
+    /** Growth of backoff bound with each retry */
+    double multiplier;
+    /** Time in milliseconds from first attempt after which request is not retried anymore */
+    int budget;
+
+private:
+    /**
+     * Random numbers of backoff jitter, policy may be used by many threads
+     */
+    struct Jitter {
+        Jitter() :
+            engine(static_cast<unsigned int>(
+                    boost::posix_time::microsec_clock::universal_time().time_of_day().total_microseconds())
+                    ^ static_cast<unsigned int>(reinterpret_cast<size_t>(this))) {
+        }
+
+        boost::mutex mutex;
+        boost::random::minstd_rand engine;
+    };
+
+    /**
+     * Returns default idempotent commands, shared by all policies until they are changed
+     */
+    static boost::shared_ptr<const std::set<std::string> > getDefaultIdempotentCommands() {
+        static const boost::shared_ptr<const std::set<std::string> > defaults(createDefaultIdempotentCommands());
+        return defaults;
+    }
+
+    static std::set<std::string> *createDefaultIdempotentCommands() {
+        const char *commands[] = {"search", "lookup", "retrieve", "retrieve-first", "retrieve-last",
+                "list-first", "list-last", "list-words", "list-paths", "list-facets",
+                "alternatives", "similar", "status", "show-history", "update"};
+        return new std::set<std::string>(commands, commands + sizeof(commands) / sizeof(commands[0]));
+    }
+
+    /** Copied on change, so connections using the same policy share one set */
+    boost::shared_ptr<const std::set<std::string> > idempotentCommands;
+    /** Shared by copies of policy */
+    boost::shared_ptr<Jitter> jitter;
+};
+}
+
+#endif //#ifndef CPS_RETRYPOLICY_HPP
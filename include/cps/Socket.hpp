@@ -3,74 +3,523 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 #include "Exception.hpp"
 #include "Utils.hpp"
+#include "Protocol.hpp"
 
 #include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/noncopyable.hpp"
 #include "boost/lambda/lambda.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/date_time/posix_time/posix_time.hpp"
 
 namespace CPS
 {
 #ifndef USE_HEADER_ONLY_ASIO
 #include "boost/asio.hpp"
 using namespace boost;
+typedef boost::system::error_code ErrorCode;
+typedef boost::system::error_category ErrorCategory;
 #else
 #define ASIO_DISABLE_THREADS // To disable linking errors
 #include "asio.hpp"
+typedef asio::error_code ErrorCode;
+typedef asio::error_category ErrorCategory;
 #endif
 
+/**
+ * Error category of HTTP replies with status other than 2xx, error value is the status code
+ */
+class HttpStatusCategory: public ErrorCategory
+{
+public:
+	const char *name() const BOOST_NOEXCEPT {
+		return "cps.http";
+	}
+	std::string message(int status) const {
+		return "HTTP status " + Utils::toString(status);
+	}
+};
+
+inline const ErrorCategory &httpStatusCategory() {
+	static HttpStatusCategory instance;
+	return instance;
+}
+
+/** HTTP status code attached to CPS::Exception of failed HTTP request */
+typedef boost::error_info<struct tag_http_status, int> HttpStatus;
+
+/** Error of failed socket operation attached to CPS::Exception */
+typedef boost::error_info<struct tag_socket_error, ErrorCode> SocketError;
+
+/**
+ * Creates exception for failed socket operation with the error attached as SocketError.
+ * HTTP status errors get code 9007 and the status code attached as HttpStatus
+ */
+inline CPS::Exception socketException(const std::string &message, const ErrorCode &ec) {
+	if (ec.category() == httpStatusCategory()) {
+		CPS::Exception e(message + ec.message(), 9007);
+		e << HttpStatus(ec.value()) << SocketError(ec);
+		return e;
+	}
+	CPS::Exception e(message + ec.message());
+	e << SocketError(ec);
+	return e;
+}
+
+/**
+ * @brief Options applied to socket after each connect
+ *
+ * Options that do not apply to the socket type (e.g. TCP options on unix socket)
+ * or are not supported by the platform are ignored
+ */
+class SocketOptions
+{
+public:
+	SocketOptions() :
+		noDelay(true), keepAlive(false), keepAliveIdle(0), keepAliveInterval(0), keepAliveCount(0),
+		sendBufferSize(0), receiveBufferSize(0), busyPoll(0) {
+	}
+
+	/** Disable Nagle's algorithm (TCP_NODELAY), enabled by default */
+	bool noDelay;
+	/** Send TCP keepalive probes on idle connection (SO_KEEPALIVE) */
+	bool keepAlive;
+	/** Idle time in seconds before first keepalive probe, 0 keeps system default */
+	int keepAliveIdle;
+	/** Time in seconds between keepalive probes, 0 keeps system default */
+	int keepAliveInterval;
+	/** Number of unanswered probes before connection is dropped, 0 keeps system default */
+	int keepAliveCount;
+	/** Socket send buffer size in bytes (SO_SNDBUF), 0 keeps system default */
+	int sendBufferSize;
+	/** Socket receive buffer size in bytes (SO_RCVBUF), 0 keeps system default */
+	int receiveBufferSize;
+	/** Busy poll time in microseconds for blocking receive (SO_BUSY_POLL, Linux only), 0 disables */
+	int busyPoll;
+};
+
+/**
+ * @brief Provides id of io_service services defined in headers
+ */
+template<class Service>
+class ServiceId
+{
+public:
+	static asio::io_service::id id;
+};
+
+template<class Service>
+asio::io_service::id ServiceId<Service>::id;
+
+/**
+ * @brief Hashed timer wheel shared by all timeouts of one io_service
+ *
+ * Timeouts are linked into slots of a wheel that is advanced by a single asio timer,
+ * so arming and cancelling a timeout takes constant time however many connections
+ * share the io_service. Asio timer only waits while timeouts are armed and sleeps
+ * until the next non-empty slot. Timeouts fire up to one tick (1 ms) late.
+ * Wheel is created on first use with asio::use_service<TimerWheel>(io_service)
+ */
+class TimerWheel: public asio::io_service::service, public ServiceId<TimerWheel>
+{
+public:
+	typedef boost::function<void ()> Handler;
+
+	/**
+	 * @brief Timeout on wheel of an io_service
+	 *
+	 * Timer can be armed and cancelled from any thread. Handler is called once by a thread
+	 * running io_service and is released after that or when timer is cancelled.
+	 * Handler of timeout that fired just before cancel() may still run,
+	 * so it should check getExpiry()
+	 */
+	class Timer: private boost::noncopyable
+	{
+	public:
+		explicit Timer(asio::io_service &io_service) :
+			wheel(asio::use_service<TimerWheel>(io_service)), expiry(boost::posix_time::pos_infin),
+			tick(0), prev(NULL), next(NULL), linked(false) {
+		}
+
+		~Timer() {
+			cancel();
+		}
+
+		/**
+		 * Calls handler once expiry has passed, replacing previous timeout of this timer
+		 */
+		void expiresAt(const boost::posix_time::ptime &expiry, Handler handler) {
+			wheel.schedule(*this, expiry, handler);
+		}
+
+		void expiresFromNow(const boost::posix_time::time_duration &timeout, Handler handler) {
+			expiresAt(TimerWheel::now() + timeout, handler);
+		}
+
+		/**
+		 * Removes timeout, expiry becomes pos_infin
+		 */
+		void cancel() {
+			wheel.cancel(*this);
+		}
+
+		boost::posix_time::ptime getExpiry() const {
+			boost::mutex::scoped_lock lock(wheel.mutex);
+			return expiry;
+		}
+
+	private:
+		TimerWheel &wheel;
+		boost::posix_time::ptime expiry;
+		Handler handler;
+		unsigned long long tick; /// Tick of wheel after which timeout fires
+		Timer *prev; /// Neighbours in slot
+		Timer *next;
+		bool linked; /// Is timer in a slot
+
+		friend class TimerWheel;
+	};
+
+	explicit TimerWheel(asio::io_service &io_service) :
+		asio::io_service::service(io_service), ticker(io_service),
+		resolution(1000), epoch(now()), currentTick(0), wakeupTick(0), armed(0), waiting(false) {
+	}
+
+	static boost::posix_time::ptime now() {
+		return asio::deadline_timer::traits_type::now();
+	}
+
+	/**
+	 * Returns number of armed timeouts
+	 */
+	size_t size() const {
+		boost::mutex::scoped_lock lock(mutex);
+		return armed;
+	}
+
+private:
+	friend class Timer;
+
+	void shutdown_service() {
+		std::vector<Handler> handlers;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			for (unsigned int i = 0; i < slots.size(); i++) {
+				while (slots[i]) {
+					Timer &timer = *slots[i];
+					unlink(timer);
+					handlers.push_back(Handler());
+					handlers.back().swap(timer.handler);
+				}
+			}
+			stopTicking();
+		}
+	}
+
+	void schedule(Timer &timer, const boost::posix_time::ptime &expiry, Handler handler) {
+		// Replaced handler may own timers, so it is released after mutex
+		Handler replaced;
+		boost::mutex::scoped_lock lock(mutex);
+		if (timer.linked)
+			unlink(timer);
+		replaced.swap(timer.handler);
+		timer.handler.swap(handler);
+		timer.expiry = expiry;
+		if (expiry.is_special())
+			return;
+		// io_services that never arm a timeout do not pay for slots
+		if (slots.empty())
+			slots.resize(512, NULL);
+		// Ticks are rounded up, so timeout never fires before expiry
+		boost::posix_time::time_duration offset = expiry - epoch;
+		unsigned long long tick = offset.is_negative() ? 0 : (offset.total_microseconds() + resolution - 1) / resolution;
+		timer.tick = std::max(tick, currentTick + 1);
+		link(timer);
+		if (!waiting || timer.tick < wakeupTick)
+			startTicking(timer.tick);
+	}
+
+	void cancel(Timer &timer) {
+		Handler cancelled;
+		boost::mutex::scoped_lock lock(mutex);
+		if (timer.linked)
+			unlink(timer);
+		cancelled.swap(timer.handler);
+		timer.expiry = boost::posix_time::pos_infin;
+		// Lets io_service run out of work when nothing is armed
+		if (armed == 0)
+			stopTicking();
+	}
+
+	void link(Timer &timer) {
+		Timer *&head = slots[timer.tick % slots.size()];
+		timer.prev = NULL;
+		timer.next = head;
+		if (head)
+			head->prev = &timer;
+		head = &timer;
+		timer.linked = true;
+		armed++;
+	}
+
+	void unlink(Timer &timer) {
+		if (timer.prev)
+			timer.prev->next = timer.next;
+		else
+			slots[timer.tick % slots.size()] = timer.next;
+		if (timer.next)
+			timer.next->prev = timer.prev;
+		timer.prev = timer.next = NULL;
+		timer.linked = false;
+		armed--;
+	}
+
+	void startTicking(unsigned long long tick) {
+		waiting = true;
+		wakeupTick = tick;
+		ticker.expires_at(epoch + boost::posix_time::microseconds(tick * resolution));
+		ticker.async_wait(boost::bind(&TimerWheel::handleTick, this, asio::placeholders::error));
+	}
+
+	void stopTicking() {
+		if (waiting) {
+			waiting = false;
+			ticker.cancel();
+		}
+	}
+
+	void handleTick(const ErrorCode &ec) {
+		// Ticker was moved to earlier slot or stopped
+		if (ec == asio::error::operation_aborted)
+			return;
+		std::vector<Handler> expired;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			waiting = false;
+			unsigned long long tick = (now() - epoch).total_microseconds() / resolution;
+			if (tick > currentTick) {
+				// Wheel is turned at most once when ticks were missed
+				unsigned long long first = std::max(currentTick + 1, tick >= slots.size() ? tick - slots.size() + 1 : 0);
+				for (unsigned long long t = first; t <= tick; t++) {
+					Timer *timer = slots[t % slots.size()];
+					while (timer) {
+						Timer *next = timer->next;
+						// Timers of later turns share the slot
+						if (timer->tick <= tick) {
+							unlink(*timer);
+							expired.push_back(Handler());
+							expired.back().swap(timer->handler);
+						}
+						timer = next;
+					}
+				}
+				currentTick = tick;
+			}
+			if (armed > 0) {
+				unsigned long long next = currentTick + 1;
+				while (!slots[next % slots.size()])
+					next++;
+				startTicking(next);
+			}
+		}
+		for (unsigned int i = 0; i < expired.size(); i++) {
+			expired[i]();
+		}
+	}
+
+	asio::deadline_timer ticker; /// Wakes wheel at next non-empty slot
+	std::vector<Timer *> slots; /// Lists of timers hashed by tick
+	mutable boost::mutex mutex;
+	long long resolution; /// Length of tick in microseconds
+	boost::posix_time::ptime epoch; /// Time of tick 0
+	unsigned long long currentTick; /// Last tick whose timers have fired
+	unsigned long long wakeupTick; /// Tick ticker waits for
+	size_t armed; /// Number of linked timers
+	bool waiting; /// Is ticker waiting
+};
+
 class AbstractSocket
 {
 public:
+	/** Completion handler of connect and write operations */
+	typedef boost::function<void (const ErrorCode &)> Handler;
+	/** Completion handler of read operation, receives the reply message */
+	typedef boost::function<void (const ErrorCode &, std::vector<unsigned char> &)> ReadHandler;
+	/** Request message as sequence of buffers, sent with a single gather write */
+	typedef std::vector<asio::const_buffer> ConstBuffers;
+
 	AbstractSocket(asio::io_service &io_service) :
-		io_service(io_service), deadline(io_service), connected(false) {
+		io_service(io_service), strand(io_service), deadline(io_service), readDeadline(io_service),
+		readTimeout(boost::posix_time::not_a_date_time),
+		connected(false), expired(false), receiveBegin(0), receiveEnd(0), receiveBufferSize(16384) {
 		connectTimeout = 5;
 		sendTimeout = 30;
 		recieveTimeout = 60;
-		// No deadline is required until the first socket operation is started. We
-		// set the deadline to positive infinity so that the actor takes no action
-		// until a specific deadline is set.
-		deadline.expires_at(boost::posix_time::pos_infin);
-
-		// Start the persistent actor that checks for deadline expiry.
-		check_deadline();
 	}
 	virtual ~AbstractSocket() {
 	}
 
-	virtual void connect(const std::string &host, int port) = 0;
+	/**
+	 * Starts connecting to server. Handler is called once connection is established or has failed.
+	 * All asynchronous operations must be started from within getStrand()
+	 */
+	virtual void asyncConnect(const std::string &host, int port, Handler handler) = 0;
+	/**
+	 * Starts sending one request message made of several buffers.
+	 * Buffers must stay valid until the reply to this request has been read,
+	 * as the request may have to be sent again
+	 */
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) = 0;
+	/**
+	 * Starts sending one request message
+	 * @see asyncWrite(const ConstBuffers &buffers, Handler handler)
+	 */
+	void asyncWrite(const std::string &data, Handler handler) {
+		asyncWrite(ConstBuffers(1, asio::buffer(data)), handler);
+	}
+	/**
+	 * Starts reading one reply message
+	 */
+	virtual void asyncRead(ReadHandler handler) = 0;
+	/**
+	 * Closes the socket. Outstanding asynchronous operations are cancelled
+	 */
+	virtual void close() = 0;
+
+	virtual void connect(const std::string &host, int port) {
+		// Set up the variable that receives the result of the asynchronous
+		// operation. The error code is set to would_block to signal that the
+		// operation is incomplete. Asio guarantees that its asynchronous
+		// operations will never fail with would_block, so any other value in
+		// ec indicates completion.
+		ErrorCode ec = asio::error::would_block;
+		asyncConnect(host, port, boost::lambda::var(ec) = boost::lambda::_1);
+		waitFor(ec);
+		if (ec) {
+			throw socketException("Could not connect. ", ec);
+		}
+	}
+
+	std::vector<unsigned char> send(const std::string &data) {
+		return send(ConstBuffers(1, asio::buffer(data)));
+	}
+
+	virtual std::vector<unsigned char> send(const ConstBuffers &buffers) {
+		std::vector<unsigned char> reply;
+		send(buffers, reply);
+		return reply;
+	}
+
+	/**
+	 * Sends request and reads reply into given buffer.
+	 * Buffer is swapped with socket's reply buffer, so its previous storage is used by following read
+	 */
+	virtual void send(const ConstBuffers &buffers, std::vector<unsigned char> &reply) {
+		ErrorCode ec = asio::error::would_block;
+		asyncWrite(buffers, boost::lambda::var(ec) = boost::lambda::_1);
+		waitFor(ec);
+		if (ec) {
+			throw socketException("Could not send message. ", ec);
+		}
+		read(reply);
+	}
+
+	virtual std::vector<unsigned char> read() {
+		std::vector<unsigned char> reply;
+		read(reply);
+		return reply;
+	}
 
-	virtual std::vector<unsigned char> send(const std::string &data) = 0;
-	virtual std::vector<unsigned char> read() = 0;
+	/**
+	 * Reads reply into given buffer
+	 * @see send(const ConstBuffers &buffers, std::vector<unsigned char> &reply)
+	 */
+	virtual void read(std::vector<unsigned char> &reply) {
+		ErrorCode ec = asio::error::would_block;
+		asyncRead(BlockingReadHandler(ec, reply));
+		waitFor(ec);
+		if (ec == asio::error::invalid_argument) {
+			throw CPS::Exception("Invalid header received. " + ec.message());
+		} else if (ec) {
+			throw socketException("Could not read message. ", ec);
+		}
+	}
 
 	bool isConnected() {
 		return connected;
 	}
 
-	void check_deadline() {
+	/**
+	 * Returns strand that serializes all operations on this socket
+	 */
+	asio::io_service::strand &getStrand() {
+		return strand;
+	}
+
+	void check_deadline(TimerWheel::Timer *timer) {
 		// Check whether the deadline has passed. We compare the deadline against
-		// the current time since a new asynchronous operation may have moved the
-		// deadline before this actor had a chance to run.
-		if (deadline.expires_at() <= asio::deadline_timer::traits_type::now())
+		// the current time since a new asynchronous operation may have moved or
+		// cancelled the deadline before this handler had a chance to run.
+		if (timer->getExpiry() <= TimerWheel::now())
 		{
 			// The deadline has passed. The socket is closed so that any outstanding
-			// asynchronous operations are cancelled. This allows the blocked
-			// connect(), read_line() or write_line() functions to return.
+			// asynchronous operations are cancelled.
+			expired = true;
 			error = asio::error::timed_out;
 			handle_timer_expiration();
-
-			// There is no longer an active deadline. The expire is set to positive
-			// infinity so that the actor takes no action until a new deadline is set.
-			deadline.expires_at(boost::posix_time::pos_infin);
 		}
-
-		// Put the actor back::asio to sleep.
-		deadline.async_wait(boost::bind(&AbstractSocket::check_deadline, this));
 	}
 
 	virtual void handle_timer_expiration() {
-		// Nothing to do here.. Should be overloaded in child classes
+		close();
+	}
+
+	/**
+	 * Sets options applied on next connect
+	 */
+	void setOptions(const SocketOptions &options) {
+		this->options = options;
+	}
+
+	const SocketOptions &getOptions() const {
+		return options;
+	}
+
+	/**
+	 * Limits deadlines of following operations to given time, until it is reset with not_a_date_time
+	 */
+	void setRequestDeadline(const boost::posix_time::ptime &requestDeadline) {
+		this->requestDeadline = requestDeadline;
+	}
+
+	/**
+	 * Replaces recieveTimeout of following reads with timeout of millisecond precision,
+	 * until it is reset with not_a_date_time
+	 */
+	void setReadTimeout(const boost::posix_time::time_duration &readTimeout) {
+		this->readTimeout = readTimeout;
+	}
+
+	/**
+	 * Returns timeout of reads
+	 */
+	boost::posix_time::time_duration getReadTimeout() const {
+		return readTimeout.is_not_a_date_time() ? boost::posix_time::seconds(recieveTimeout) : readTimeout;
 	}
 
 	int connectTimeout;
@@ -78,135 +527,467 @@ public:
 	int recieveTimeout;
 
 protected:
-	asio::io_service &io_service;
-	asio::deadline_timer deadline;
-#ifndef USE_HEADER_ONLY_ASIO
-	boost::system::error_code error;
-#else
-	asio::error_code error;
+	/**
+	 * Stores result of asynchronous read for blocking calls
+	 */
+	class BlockingReadHandler
+	{
+	public:
+		BlockingReadHandler(ErrorCode &ec, std::vector<unsigned char> &reply) :
+			ec(ec), reply(reply) {
+		}
+		void operator()(const ErrorCode &result, std::vector<unsigned char> &data) {
+			reply.swap(data);
+			ec = result;
+		}
+	private:
+		ErrorCode &ec;
+		std::vector<unsigned char> &reply;
+	};
+
+	/**
+	 * Runs io_service until asynchronous operation sets ec
+	 */
+	void waitFor(const ErrorCode &ec) {
+		// io_service stops when it runs out of work, e.g. after run() of asynchronous requests
+		if (io_service.stopped())
+			io_service.reset();
+		// Block until the asynchronous operation has completed.
+		do io_service.run_one(); while (ec == asio::error::would_block);
+	}
+
+	/**
+	 * Sets deadline for connect or write operation
+	 */
+	void startDeadline(int seconds) {
+		startDeadline(deadline, boost::posix_time::seconds(seconds));
+	}
+
+	/**
+	 * Sets deadline for an operation. Reads have separate deadline,
+	 * as they can be in progress at the same time with writes of pipelined requests
+	 */
+	void startDeadline(TimerWheel::Timer &timer, const boost::posix_time::time_duration &timeout) {
+		boost::posix_time::ptime expiry = TimerWheel::now() + timeout;
+		if (!requestDeadline.is_not_a_date_time() && requestDeadline < expiry)
+			expiry = requestDeadline;
+		timer.expiresAt(expiry, strand.wrap(boost::bind(&AbstractSocket::check_deadline, this, &timer)));
+	}
+
+	/**
+	 * Stops deadline of completed connect or write operation
+	 * @see finishOperation(TimerWheel::Timer &timer, const ErrorCode &ec)
+	 */
+	ErrorCode finishOperation(const ErrorCode &ec) {
+		return finishOperation(deadline, ec);
+	}
+
+	/**
+	 * Stops deadline of completed operation and translates
+	 * errors caused by expired deadline to timed_out
+	 */
+	ErrorCode finishOperation(TimerWheel::Timer &timer, const ErrorCode &ec) {
+		timer.cancel();
+		if (ec && expired)
+			return asio::error::timed_out;
+		return ec;
+	}
+
+	/**
+	 * Writes buffer sequence to stream
+	 */
+	template<class Stream, class ConstBufferSequence>
+	void writeData(Stream &stream, const ConstBufferSequence &buffers, Handler handler) {
+		startDeadline(sendTimeout);
+		asio::async_write(stream, buffers,
+				strand.wrap(boost::bind(&AbstractSocket::handleWrite, this, asio::placeholders::error, handler)));
+	}
+
+	void handleWrite(const ErrorCode &ec, Handler handler) {
+		ErrorCode result = finishOperation(ec);
+		if (result)
+			close();
+		handler(result);
+	}
+
+	/**
+	 * Reads one reply framed with 8 byte header from stream.
+	 *
+	 * Stream is read ahead into receive buffer, so small replies take a single read
+	 * and pipelined replies that arrive together are split without further reads.
+	 * Replies that do not fit in receive buffer are read directly into reply buffer.
+	 * Handler must not keep reference to reply buffer, but may take it over by swapping it
+	 * with its own buffer. Responses parsed in place take it over, so each reply is read
+	 * into new storage sized to the reply, while receive buffer is reused
+	 */
+	template<class Stream>
+	void readFrame(Stream &stream, ReadHandler handler) {
+		startDeadline(readDeadline, getReadTimeout());
+		if (receiveEnd > receiveBegin) {
+			// Reply buffer may still be in use by caller, so buffered data is processed later
+			strand.post(boost::bind(&AbstractSocket::handleReceive<Stream>, this, boost::ref(stream),
+					ErrorCode(), 0, handler));
+		} else {
+			receiveMore(stream, handler);
+		}
+	}
+
+	template<class Stream>
+	void receiveMore(Stream &stream, ReadHandler handler) {
+		if (receiveBegin > 0) {
+			// Move unprocessed data to the beginning of buffer
+			if (receiveEnd > receiveBegin)
+				memmove(&receiveBuffer[0], &receiveBuffer[receiveBegin], receiveEnd - receiveBegin);
+			receiveEnd -= receiveBegin;
+			receiveBegin = 0;
+		}
+		if (receiveBuffer.size() < receiveBufferSize) {
+			receiveBuffer.resize(receiveBufferSize);
+		}
+		stream.async_read_some(asio::buffer(&receiveBuffer[receiveEnd], receiveBuffer.size() - receiveEnd),
+				strand.wrap(boost::bind(&AbstractSocket::handleReceive<Stream>, this, boost::ref(stream),
+						asio::placeholders::error, asio::placeholders::bytes_transferred, handler)));
+	}
+
+	template<class Stream>
+	void handleReceive(Stream &stream, const ErrorCode &ec, size_t length, ReadHandler handler) {
+		if (ec) {
+			return finishFrame(ec, handler);
+		}
+		receiveEnd += length;
+		size_t available = receiveEnd - receiveBegin;
+		if (available < 8) {
+			return receiveMore(stream, handler);
+		}
+		const unsigned char *header = &receiveBuffer[receiveBegin];
+		size_t content_len = 0;
+		if (!ProtocolEngine::parseHeader(header, content_len)) {
+			return finishFrame(asio::error::invalid_argument, handler);
+		}
+
+		// Room for terminator, so reply can be parsed in place without growing
+		replyBuffer.reserve(content_len + 1);
+		if (available >= 8 + content_len) {
+			// Whole reply has been received
+			replyBuffer.assign(header + 8, header + 8 + content_len);
+			receiveBegin += 8 + content_len;
+			if (receiveBegin == receiveEnd) {
+				receiveBegin = receiveEnd = 0;
+			}
+			return finishFrame(ErrorCode(), handler);
+		}
+		if (8 + content_len <= receiveBufferSize) {
+			return receiveMore(stream, handler);
+		}
+
+		// Read rest of large message directly into reply buffer
+		size_t received = available - 8;
+		replyBuffer.resize(content_len);
+		if (received > 0)
+			memcpy(&replyBuffer[0], header + 8, received);
+		receiveBegin = receiveEnd = 0;
+		asio::async_read(stream, asio::buffer(&replyBuffer[received], content_len - received),
+				strand.wrap(boost::bind(&AbstractSocket::handleFrameBody, this, asio::placeholders::error, handler)));
+	}
+
+	void handleFrameBody(const ErrorCode &ec, ReadHandler handler) {
+		finishFrame(ec, handler);
+	}
+
+	void finishFrame(const ErrorCode &ec, ReadHandler handler) {
+		ErrorCode result = finishOperation(readDeadline, ec);
+		if (result) {
+			close();
+			replyBuffer.clear();
+		}
+		handler(result, replyBuffer);
+	}
+
+	/**
+	 * Applies options common to all stream sockets, errors are ignored
+	 */
+	template<class Socket>
+	void applyOptions(Socket &socket) {
+		ErrorCode ec;
+		if (options.sendBufferSize > 0)
+			socket.set_option(asio::socket_base::send_buffer_size(options.sendBufferSize), ec);
+		if (options.receiveBufferSize > 0)
+			socket.set_option(asio::socket_base::receive_buffer_size(options.receiveBufferSize), ec);
+#ifdef SO_BUSY_POLL
+		if (options.busyPoll > 0)
+			setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &options.busyPoll, sizeof(options.busyPoll));
 #endif
+	}
+
+	/**
+	 * Drops data read ahead from previous connection
+	 */
+	void resetReceiveBuffer() {
+		receiveBegin = receiveEnd = 0;
+	}
+
+protected:
+	asio::io_service &io_service;
+	asio::io_service::strand strand;
+	TimerWheel::Timer deadline; /// Deadline of connect and write operations, on wheel shared by io_service
+	TimerWheel::Timer readDeadline; /// Deadline of read operation
+	boost::posix_time::ptime requestDeadline; /// Time by which blocking request has to complete
+	boost::posix_time::time_duration readTimeout; /// Timeout of reads replacing recieveTimeout, if set
+	ErrorCode error;
 	bool connected;
+	bool expired; /// Has deadline of an operation on current connection passed
+
+	SocketOptions options;
+
+	std::vector<unsigned char> receiveBuffer; /// Data read ahead from stream
+	size_t receiveBegin; /// Start of data in receive buffer not processed yet
+	size_t receiveEnd; /// End of data in receive buffer
+	size_t receiveBufferSize; /// Size of receive buffer, larger replies are read directly into reply buffer
+	std::vector<unsigned char> replyBuffer; /// Reply being read, handler may take it over
 };
 
-class TcpSocket: public AbstractSocket
+/**
+ * @brief Process wide cache of resolved TCP endpoints
+ *
+ * Saves resolver round trip when many connections are opened to the same host,
+ * e.g. by connection pools reconnecting after node restart
+ */
+class ResolverCache
 {
 public:
-	TcpSocket(asio::io_service &io_service) :
-		AbstractSocket(io_service), socket(io_service) {
+	typedef std::vector<asio::ip::tcp::endpoint> Endpoints;
+
+	static ResolverCache &instance() {
+		static ResolverCache cache;
+		return cache;
 	}
-	virtual ~TcpSocket() {
-		socket.close();
-		connected = false;
+
+	/**
+	 * Sets how long resolved endpoints are used
+	 * @param ttl time in seconds, 0 disables caching
+	 */
+	void setTtl(int ttl) {
+		boost::mutex::scoped_lock lock(mutex);
+		this->ttl = ttl;
+		if (ttl <= 0)
+			entries.clear();
 	}
 
-	virtual void connect(const std::string &host, int port) {
-		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(connectTimeout));
+	int getTtl() {
+		boost::mutex::scoped_lock lock(mutex);
+		return ttl;
+	}
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+	bool lookup(const std::string &host, int port, Endpoints &endpoints) {
+		boost::mutex::scoped_lock lock(mutex);
+		std::map<std::string, Entry>::iterator it = entries.find(key(host, port));
+		if (it == entries.end())
+			return false;
+		if (it->second.expires <= boost::posix_time::microsec_clock::universal_time()) {
+			entries.erase(it);
+			return false;
+		}
+		endpoints = it->second.endpoints;
+		return true;
+	}
 
-		asio::ip::tcp::resolver resolver(io_service);
-		asio::ip::tcp::resolver::query query(host, Utils::toString(port));
-		endpoint_iterator = resolver.resolve(query);
+	void store(const std::string &host, int port, const Endpoints &endpoints) {
+		boost::mutex::scoped_lock lock(mutex);
+		if (ttl <= 0 || endpoints.empty())
+			return;
+		Entry &entry = entries[key(host, port)];
+		entry.endpoints = endpoints;
+		entry.expires = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(ttl);
+	}
 
-		// Start the asynchronous operation itself. The boost::lambda function
-		// object is used as a callback and will update the ec variable when the
-		// operation completes.
-		socket.async_connect(*endpoint_iterator, boost::lambda::var(error) = boost::lambda::_1);
+	/**
+	 * Drops endpoints of host, e.g. when none of them accepted connection
+	 */
+	void invalidate(const std::string &host, int port) {
+		boost::mutex::scoped_lock lock(mutex);
+		entries.erase(key(host, port));
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	void clear() {
+		boost::mutex::scoped_lock lock(mutex);
+		entries.clear();
+	}
 
-		// Determine whether a connection was successfully established. The
-		// deadline actor may have had a chance to run and close our socket, even
-		// though the connect operation notionally succeeded. Therefore we must
-		// check whether the socket is still open before deciding if we succeeded
-		// or failed.
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not connect. " + error.message());
-		}
-		connected = true;
+private:
+	ResolverCache() :
+		ttl(60) {
 	}
 
-	virtual std::vector<unsigned char> send(const std::string &data) {
-		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(sendTimeout));
+	static std::string key(const std::string &host, int port) {
+		return host + ":" + Utils::toString(port);
+	}
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+	struct Entry
+	{
+		Endpoints endpoints;
+		boost::posix_time::ptime expires;
+	};
 
-		// Start the asynchronous operation itself. The boost::lambda function
-		// object is used as a callback and will update the ec variable when the
-		// operation completes.
-		asio::async_write(socket, asio::buffer(data, data.size()), boost::lambda::var(error) = boost::lambda::_1);
+	boost::mutex mutex;
+	std::map<std::string, Entry> entries;
+	int ttl;
+};
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+class TcpSocket: public AbstractSocket
+{
+public:
+	TcpSocket(asio::io_service &io_service) :
+		AbstractSocket(io_service), socket(io_service), resolver(io_service), connectPort(0),
+		attemptDeadline(io_service), nextEndpoint(0), attemptExpired(false) {
+	}
+	virtual ~TcpSocket() {
+		socket.close(error);
+		connected = false;
+	}
 
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not send message. " + error.message());
+	virtual void asyncConnect(const std::string &host, int port, Handler handler) {
+		// Drop previous connection if server has closed it
+		close();
+		expired = false;
+		connectHost = host;
+		connectPort = port;
+
+		// Set a deadline for the asynchronous operation, it includes name resolution
+		startDeadline(connectTimeout);
+		if (ResolverCache::instance().lookup(host, port, endpoints)) {
+			connectEndpoints(handler);
+			return;
 		}
-		return read();
+		asio::ip::tcp::resolver::query query(host, Utils::toString(port));
+		resolver.async_resolve(query,
+				strand.wrap(boost::bind(&TcpSocket::handleResolve, this, asio::placeholders::error,
+						asio::placeholders::iterator, handler)));
 	}
 
-	virtual std::vector<unsigned char> read() {
-		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(recieveTimeout));
+	using AbstractSocket::asyncWrite;
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) {
+		writeData(socket, buffers, handler);
+	}
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+	virtual void asyncRead(ReadHandler handler) {
+		readFrame(socket, handler);
+	}
 
-		std::vector<unsigned char> reply(8);
-		size_t len = 0, content_len = 0;
-		socket.async_read_some(asio::buffer(reply),
-				(boost::lambda::var(error) = boost::lambda::_1, boost::lambda::var(len) = boost::lambda::_2));
+	virtual void close() {
+		resolver.cancel();
+		socket.close(error);
+		connected = false;
+		resetReceiveBuffer();
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+protected:
+	void handleResolve(const ErrorCode &ec, asio::ip::tcp::resolver::iterator it, Handler handler) {
+		if (ec) {
+			return handleConnect(ec, handler);
+		}
+		endpoints.assign(it, asio::ip::tcp::resolver::iterator());
+		ResolverCache::instance().store(connectHost, connectPort, endpoints);
+		connectEndpoints(handler);
+	}
+
+	/**
+	 * Tries resolved addresses one after another until connection succeeds.
+	 * Each address gets an equal share of connect time left, so an address that
+	 * does not answer leaves time for the following ones
+	 */
+	void connectEndpoints(Handler handler) {
+		nextEndpoint = 0;
+		connectNextEndpoint(asio::error::host_not_found, handler);
+	}
 
-		if (error || !socket.is_open() || len != 8
-				|| !(reply[0] == 0x09 && reply[1] == 0x09 && reply[2] == 0x00
-						&& reply[3] == 0x00)) {
-			throw CPS::Exception("Invalid header received. " + error.message());
+	/**
+	 * @param ec error of previous address, returned if there are no more addresses
+	 */
+	void connectNextEndpoint(const ErrorCode &ec, Handler handler) {
+		if (nextEndpoint >= endpoints.size()) {
+			return handleConnect(ec, handler);
 		}
-		content_len = (reply[4]) | (reply[5] << 8) | (reply[6] << 16) | (reply[7] << 24);
+		int left = static_cast<int>(endpoints.size() - nextEndpoint);
+		const asio::ip::tcp::endpoint &endpoint = endpoints[nextEndpoint++];
+		ErrorCode ignored;
+		socket.close(ignored);
+		boost::posix_time::ptime expiry = deadline.getExpiry();
+		if (left > 1 && !expiry.is_special()) {
+			attemptDeadline.expiresFromNow((expiry - TimerWheel::now()) / left,
+					strand.wrap(boost::bind(&TcpSocket::checkAttemptDeadline, this)));
+		}
+		socket.async_connect(endpoint,
+				strand.wrap(boost::bind(&TcpSocket::handleEndpointConnect, this, asio::placeholders::error, handler)));
+	}
 
-		// Read rest of message
-		error = asio::error::would_block;
-		reply.clear();
-		reply.resize(content_len);
-		asio::async_read(socket, asio::buffer(reply),
-				(boost::lambda::var(error) = boost::lambda::_1, boost::lambda::var(len) = boost::lambda::_2));
+	void checkAttemptDeadline() {
+		// Attempt may have completed before this handler had a chance to run
+		if (attemptDeadline.getExpiry() <= TimerWheel::now()) {
+			attemptExpired = true;
+			ErrorCode ignored;
+			socket.close(ignored);
+		}
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	void handleEndpointConnect(const ErrorCode &ec, Handler handler) {
+		attemptDeadline.cancel();
+		bool attemptTimedOut = attemptExpired;
+		attemptExpired = false;
+		// Connect timeout has passed or socket was closed by caller
+		if (expired || (ec == asio::error::operation_aborted && !attemptTimedOut)) {
+			return handleConnect(ec, handler);
+		}
+		if (!ec && !attemptTimedOut) {
+			return handleConnect(ec, handler);
+		}
+		connectNextEndpoint(attemptTimedOut ? ErrorCode(asio::error::timed_out) : ec, handler);
+	}
 
-		if (error || !socket.is_open() || len != content_len) {
-			throw CPS::Exception("Could not read message. " + error.message());
+	void handleConnect(const ErrorCode &ec, Handler handler) {
+		ErrorCode result = finishOperation(ec);
+		// Determine whether a connection was successfully established. The
+		// deadline may have had a chance to close our socket, even
+		// though the connect operation notionally succeeded.
+		if (!result && !socket.is_open()) {
+			result = asio::error::timed_out;
 		}
-		return reply;
+		if (result) {
+			// Addresses may have changed, resolve them again on next connect
+			ResolverCache::instance().invalidate(connectHost, connectPort);
+			close();
+		} else {
+			connected = true;
+			applyTcpOptions();
+		}
+		handler(result);
 	}
 
-	void handle_timer_expiration() {
-		socket.close();
-		connected = false;
+	void applyTcpOptions() {
+		applyOptions(socket);
+		ErrorCode ec;
+		socket.set_option(asio::ip::tcp::no_delay(options.noDelay), ec);
+		if (options.keepAlive) {
+			socket.set_option(asio::socket_base::keep_alive(true), ec);
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+			if (options.keepAliveIdle > 0)
+				setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &options.keepAliveIdle, sizeof(options.keepAliveIdle));
+			if (options.keepAliveInterval > 0)
+				setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_KEEPINTVL, &options.keepAliveInterval, sizeof(options.keepAliveInterval));
+			if (options.keepAliveCount > 0)
+				setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_KEEPCNT, &options.keepAliveCount, sizeof(options.keepAliveCount));
+#endif
+		}
 	}
+
 protected:
 	asio::ip::tcp::socket socket;
-	asio::ip::tcp::resolver::iterator endpoint_iterator;
+	asio::ip::tcp::resolver resolver;
+	ResolverCache::Endpoints endpoints; /// Addresses of host being connected to
+	std::string connectHost; /// Host being connected to
+	int connectPort;
+	TimerWheel::Timer attemptDeadline; /// Deadline of connect to one of the addresses
+	size_t nextEndpoint; /// Address tried after current one
+	bool attemptExpired; /// Has deadline of current address passed
 };
 
 #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
@@ -217,204 +998,413 @@ public:
 		AbstractSocket(io_service), socket(io_service) {
 	}
 	virtual ~UnixSocket() {
-		socket.close();
+		socket.close(error);
 	}
 
-	virtual void connect(const std::string &host, int port) {
+	virtual void asyncConnect(const std::string &host, int /*port*/, Handler handler) {
+		// Drop previous connection if server has closed it
+		close();
+		expired = false;
+
 		asio::local::stream_protocol::endpoint ep(host);
 
 		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(connectTimeout));
+		startDeadline(connectTimeout);
+		socket.async_connect(ep,
+				strand.wrap(boost::bind(&UnixSocket::handleConnect, this, asio::placeholders::error, handler)));
+	}
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+	using AbstractSocket::asyncWrite;
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) {
+		writeData(socket, buffers, handler);
+	}
 
-		// Start the asynchronous operation itself. The boost::lambda function
-		// object is used as a callback and will update the ec variable when the
-		// operation completes.
-		socket.async_connect(ep, boost::lambda::var(error) = boost::lambda::_1);
+	virtual void asyncRead(ReadHandler handler) {
+		readFrame(socket, handler);
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	virtual void close() {
+		socket.close(error);
+		connected = false;
+		resetReceiveBuffer();
+	}
 
-		// Determine whether a connection was successfully established. The
-		// deadline actor may have had a chance to run and close our socket, even
-		// though the connect operation notionally succeeded. Therefore we must
-		// check whether the socket is still open before deciding if we succeeded
-		// or failed.
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not connect. " + error.message());
+protected:
+	void handleConnect(const ErrorCode &ec, Handler handler) {
+		ErrorCode result = finishOperation(ec);
+		if (!result && !socket.is_open()) {
+			result = asio::error::timed_out;
+		}
+		if (result) {
+			close();
+		} else {
+			connected = true;
+			applyOptions(socket);
 		}
-		connected = true;
+		handler(result);
 	}
 
-	virtual std::vector<unsigned char> send(const std::string &data) {
-		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(sendTimeout));
+protected:
+	asio::local::stream_protocol::socket socket;
+};
+#endif
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+class HttpSocket: public TcpSocket {
+public:
+	HttpSocket(asio::io_service &io_service, const std::string &host, int port, const std::string &path) :
+		TcpSocket(io_service), connectionUsed(false), reused(false), resent(false),
+		keepAlive(false), status(0), bodyLength(0), chunkEnd(false) {
+		this->host = host;
+		this->port = port;
+		this->path = path;
+	}
+	virtual ~HttpSocket() {
+	}
 
-		// Start the asynchronous operation itself. The boost::lambda function
-		// object is used as a callback and will update the ec variable when the
-		// operation completes.
-		asio::async_write(socket, asio::buffer(data, data.size()), boost::lambda::var(error) = boost::lambda::_1);
+	using TcpSocket::asyncWrite;
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) {
+		// Create post headers
+		requestHeader = "";
+		requestHeader += "POST " + path + " HTTP/1.1\r\n";
+		requestHeader += "Host: " + host + ":" + Utils::toString(port) + "\r\n";
+		requestHeader += "Content-Length: " + Utils::toString(asio::buffer_size(buffers)) + "\r\n";
+		requestHeader += "Connection: keep-alive\r\n";
+		requestHeader += "\r\n";
+		// Headers and body are sent together, body is sent from caller's buffers
+		requestBuffers.clear();
+		requestBuffers.push_back(asio::buffer(requestHeader));
+		requestBuffers.insert(requestBuffers.end(), buffers.begin(), buffers.end());
+		reused = connectionUsed;
+		connectionUsed = true;
+		resent = false;
+		if (reused && closedByServer()) {
+			// Nothing has been sent over connection closed while idle, so request is sent over new one
+			return resendRequest(handler);
+		}
+		writeRequest(handler);
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	virtual void asyncRead(ReadHandler handler) {
+		startDeadline(readDeadline, getReadTimeout());
+		body.clear();
+		bodyLength = 0;
+		chunkEnd = false;
+		asio::async_read_until(socket, response, "\r\n\r\n",
+				strand.wrap(boost::bind(&HttpSocket::handleHeaders, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
+	}
 
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not send message. " + error.message());
-		}
-		return read();
+	virtual void close() {
+		TcpSocket::close();
+		// Data of previous connection is not valid anymore
+		response.consume(response.size());
+		connectionUsed = false;
 	}
 
-	virtual std::vector<unsigned char> read() {
-		// Set a deadline for the asynchronous operation.
-		deadline.expires_from_now(boost::posix_time::seconds(recieveTimeout));
+	/**
+	 * Returns status code of last HTTP reply
+	 */
+	int getStatus() const {
+		return status;
+	}
 
-		// Set up the variable that receives the result of the asynchronous
-		// operation. The error code is set to would_block to signal that the
-		// operation is incomplete. Asio guarantees that its asynchronous
-		// operations will never fail with would_block, so any other value in
-		// ec indicates completion.
-		error = asio::error::would_block;
+public:
+	std::string host;
+	int port;
+	std::string path;
 
-		std::vector<unsigned char> reply(8);
-		size_t len = 0, content_len = 0;
-		socket.async_read_some(asio::buffer(reply),
-				(boost::lambda::var(error) = boost::lambda::_1, boost::lambda::var(len) = boost::lambda::_2));
+protected:
+	void writeRequest(Handler handler) {
+		startDeadline(sendTimeout);
+		asio::async_write(socket, requestBuffers,
+				strand.wrap(boost::bind(&HttpSocket::handleRequestWritten, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	/**
+	 * Server may close idle keep-alive connection at any time, so request whose write failed
+	 * this way over reused connection before any of it was sent is sent once again over new connection.
+	 * Request that was sent may have been processed by server, so failures after that are
+	 * reported to caller, which resends only idempotent requests
+	 * @see RetryPolicy
+	 */
+	bool canResend(const ErrorCode &ec, size_t bytesSent) {
+		return reused && !resent && !expired && bytesSent == 0
+				&& (ec == asio::error::eof || ec == asio::error::connection_reset
+						|| ec == asio::error::connection_aborted || ec == asio::error::broken_pipe);
+	}
 
-		if (error || !socket.is_open() || len != 8
-				|| !(reply[0] == 0x09 && reply[1] == 0x09 && reply[2] == 0x00
-						&& reply[3] == 0x00)) {
-			throw CPS::Exception("Invalid header received. " + error.message());
+	void handleRequestWritten(const ErrorCode &ec, size_t bytesSent, Handler handler) {
+		ErrorCode result = finishOperation(ec);
+		if (result) {
+			close();
+			if (canResend(result, bytesSent))
+				return resendRequest(handler);
 		}
-		content_len = (reply[4]) | (reply[5] << 8) | (reply[6] << 16) | (reply[7] << 24);
+		handler(result);
+	}
 
-		// Read rest of message
-		error = asio::error::would_block;
-		reply.clear();
-		reply.resize(content_len);
-		asio::async_read(socket, asio::buffer(reply),
-				(boost::lambda::var(error) = boost::lambda::_1, boost::lambda::var(len) = boost::lambda::_2));
+	/**
+	 * Checks without blocking whether server has closed idle connection.
+	 * Data received while no request was sent also means connection can not be used
+	 */
+	bool closedByServer() {
+		if (response.size() > 0)
+			return true;
+		char data;
+		ErrorCode ec;
+		socket.non_blocking(true, ec);
+		socket.receive(asio::buffer(&data, 1), asio::socket_base::message_peek, ec);
+		ErrorCode ignored;
+		socket.non_blocking(false, ignored);
+		return ec != asio::error::would_block;
+	}
 
-		// Block until the asynchronous operation has completed.
-		do io_service.run_one(); while (error == asio::error::would_block);
+	void resendRequest(Handler handler) {
+		resent = true;
+		asyncConnect(host, port, boost::bind(&HttpSocket::handleReconnect, this, asio::placeholders::error, handler));
+	}
 
-		if (error || !socket.is_open() || len != content_len) {
-			throw CPS::Exception("Could not read message. " + error.message());
+	void handleReconnect(const ErrorCode &ec, Handler handler) {
+		if (ec) {
+			return handler(ec);
 		}
-		return reply;
+		connectionUsed = true;
+		writeRequest(handler);
 	}
 
-	void handle_timer_expiration() {
-		socket.close(error);
-		connected = false;
+	/**
+	 * Returns beginning of data received and not processed yet
+	 */
+	const char *received() {
+		return asio::buffer_cast<const char *>(response.data());
 	}
-protected:
-	asio::local::stream_protocol::socket socket;
-};
-#endif
 
-class HttpSocket: public TcpSocket {
-public:
-	HttpSocket(asio::io_service &io_service, const std::string &host, int port, const std::string &path) :
-		TcpSocket(io_service) {
-		this->host = host;
-		this->port = port;
-		this->path = path;
+	/**
+	 * Compares header name case insensitively
+	 */
+	static bool isHeader(const char *begin, const char *end, const char *name) {
+		for (; begin != end && *name; ++begin, ++name) {
+			if (tolower(static_cast<unsigned char>(*begin)) != *name)
+				return false;
+		}
+		return begin == end && !*name;
 	}
-	virtual ~HttpSocket() {
+
+	/**
+	 * Compares header value case insensitively, value must be lower case
+	 */
+	static bool hasToken(const char *begin, const char *end, const char *token) {
+		std::string value(begin, end);
+		for (size_t i = 0; i < value.size(); i++) {
+			value[i] = tolower(static_cast<unsigned char>(value[i]));
+		}
+		return value.find(token) != std::string::npos;
 	}
 
-	virtual void connect(const std::string &host, int port) {
-		deadline.expires_from_now(boost::posix_time::seconds(connectTimeout));
-		error = asio::error::would_block;
-		asio::ip::tcp::resolver resolver(io_service);
-		asio::ip::tcp::resolver::query query(host, Utils::toString(port));
-		endpoint_iterator = resolver.resolve(query);
+	void handleHeaders(const ErrorCode &ec, size_t length, ReadHandler handler) {
+		if (ec) {
+			return finishRead(ec, handler);
+		}
 
-		socket.async_connect(*endpoint_iterator, boost::lambda::var(error) = boost::lambda::_1);
+		// Headers are parsed in place from receive buffer
+		const char *begin = received();
+		const char *end = begin + length;
 
-		do io_service.run_one(); while (error == asio::error::would_block);
+		// Status line, e.g. HTTP/1.1 200 OK
+		const char *lineEnd = std::search(begin, end, "\r\n", "\r\n" + 2);
+		if (lineEnd - begin < 12 || strncmp(begin, "HTTP/1.", 7) != 0 || begin[8] != ' ') {
+			return finishRead(asio::error::invalid_argument, handler);
+		}
+		bool http11 = begin[7] != '0';
+		status = atoi(begin + 9);
+
+		bool connectionClose = false;
+		bool connectionKeepAlive = false;
+		bool chunked = false;
+		bool hasContentLength = false;
+		size_t contentLength = 0;
+		for (const char *line = lineEnd + 2; line < end - 2; line = lineEnd + 2) {
+			lineEnd = std::search(line, end, "\r\n", "\r\n" + 2);
+			const char *colon = std::find(line, lineEnd, ':');
+			if (colon == lineEnd)
+				continue;
+			const char *value = colon + 1;
+			while (value < lineEnd && (*value == ' ' || *value == '\t'))
+				++value;
+			if (isHeader(line, colon, "content-length")) {
+				char *numberEnd = NULL;
+				contentLength = strtoul(value, &numberEnd, 10);
+				if (numberEnd == value) {
+					return finishRead(asio::error::invalid_argument, handler);
+				}
+				hasContentLength = true;
+			} else if (isHeader(line, colon, "transfer-encoding")) {
+				chunked = hasToken(value, lineEnd, "chunked");
+				if (!chunked && !hasToken(value, lineEnd, "identity")) {
+					return finishRead(asio::error::invalid_argument, handler);
+				}
+			} else if (isHeader(line, colon, "connection")) {
+				connectionClose = hasToken(value, lineEnd, "close");
+				connectionKeepAlive = hasToken(value, lineEnd, "keep-alive");
+			}
+		}
+		response.consume(length);
+		keepAlive = http11 ? !connectionClose : connectionKeepAlive;
 
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not connect. " + error.message());
+		if (chunked) {
+			return readChunkSize(handler);
+		}
+		if (hasContentLength) {
+			// Body is read straight into reply buffer of known size
+			body.resize(contentLength);
+			return readBody(contentLength, handler);
 		}
-		connected = true;
+		// Without length body ends when server closes connection
+		keepAlive = false;
+		readUntilEof(handler);
 	}
 
-	virtual std::vector<unsigned char> send(const std::string &data) {
-		deadline.expires_from_now(boost::posix_time::seconds(sendTimeout));
-		error = asio::error::would_block;
-		// Create post headers
-		std::string header = "";
-		header += "POST " + path + " HTTP/1.0\r\n";
-		header += "Host: " + host + ":" + Utils::toString(port) + "\r\n";
-		header += "Content-Length: " + Utils::toString(data.size()) + "\r\n";
-		header += "Connection: close\r\n";
-		header += "\r\n";
+	/**
+	 * Reads length bytes to the end of reply body.
+	 * Data already received is copied, the rest is read directly into the body
+	 */
+	void readBody(size_t length, ReadHandler handler) {
+		size_t buffered = std::min(length, response.size());
+		if (buffered > 0) {
+			memcpy(&body[bodyLength], received(), buffered);
+			response.consume(buffered);
+			bodyLength += buffered;
+		}
+		if (buffered == length) {
+			return handleBody(ErrorCode(), 0, handler);
+		}
+		asio::async_read(socket, asio::buffer(&body[bodyLength], length - buffered),
+				strand.wrap(boost::bind(&HttpSocket::handleBody, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
+	}
 
-		// Send headers
-		asio::async_write(socket, asio::buffer(header, header.size()), boost::lambda::var(error) = boost::lambda::_1);
-		// Send data
-		asio::async_write(socket, asio::buffer(data, data.size()), boost::lambda::var(error) = boost::lambda::_1);
+	void handleBody(const ErrorCode &ec, size_t length, ReadHandler handler) {
+		bodyLength += length;
+		if (ec) {
+			return finishRead(ec, handler);
+		}
+		if (chunkEnd) {
+			// Chunk data is followed by CRLF
+			return readChunkSize(handler);
+		}
+		finishRead(ErrorCode(), handler);
+	}
 
-		do io_service.run_one(); while (error == asio::error::would_block);
+	void readUntilEof(ReadHandler handler) {
+		body.resize(std::max<size_t>(response.size(), 4096));
+		memcpy(&body[0], received(), response.size());
+		bodyLength = response.size();
+		response.consume(response.size());
+		readMore(handler);
+	}
 
-		if (error || !socket.is_open()) {
-			throw CPS::Exception("Could not send message. " + error.message());
+	void readMore(ReadHandler handler) {
+		if (body.size() - bodyLength < 1024) {
+			body.resize(body.size() * 2);
 		}
-		return this->read();
+		socket.async_read_some(asio::buffer(&body[bodyLength], body.size() - bodyLength),
+				strand.wrap(boost::bind(&HttpSocket::handleBodyUntilEof, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
 	}
 
-	virtual std::vector<unsigned char> read() {
-		asio::streambuf response;
-#ifndef USE_HEADER_ONLY_ASIO
-		boost::system::error_code err;
-#else
-		asio::error_code err;
-#endif
-		std::vector <unsigned char> reply;
-		int read = 0;
-		bool past_header = false;
-		while ((read = asio::read(socket, response, asio::transfer_at_least(1), err)) != 0) {
-			char cbuf[response.size() + 1];
-			int rc = response.sgetn(cbuf, sizeof(cbuf));
-			if (past_header == false) {
-				char *data;
-				if ((data = strstr(cbuf, "\r\n\r\n")) != NULL) {
-					reply.insert(reply.end(), data + 4, cbuf + rc);
-					past_header = true;
-				}
-			} else {
-				reply.insert(reply.end(), cbuf, cbuf + rc);
+	void handleBodyUntilEof(const ErrorCode &ec, size_t length, ReadHandler handler) {
+		bodyLength += length;
+		if (ec == asio::error::eof) {
+			return finishRead(ErrorCode(), handler);
+		} else if (ec) {
+			return finishRead(ec, handler);
+		}
+		readMore(handler);
+	}
+
+	void readChunkSize(ReadHandler handler) {
+		asio::async_read_until(socket, response, "\r\n",
+				strand.wrap(boost::bind(&HttpSocket::handleChunkSize, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
+	}
+
+	void handleChunkSize(const ErrorCode &ec, size_t length, ReadHandler handler) {
+		if (ec) {
+			return finishRead(ec, handler);
+		}
+		const char *line = received();
+		if (chunkEnd) {
+			// Empty line after chunk data
+			response.consume(length);
+			if (length != 2) {
+				return finishRead(asio::error::invalid_argument, handler);
 			}
+			chunkEnd = false;
+			return readChunkSize(handler);
 		}
-		if (err != asio::error::eof)
-			BOOST_THROW_EXCEPTION(Exception("Problem reading from socket"));
-		return reply;
+		// Chunk size is hexadecimal, optionally followed by extensions
+		char *numberEnd = NULL;
+		size_t size = strtoul(line, &numberEnd, 16);
+		bool valid = numberEnd != line;
+		response.consume(length);
+		if (!valid) {
+			return finishRead(asio::error::invalid_argument, handler);
+		}
+		if (size == 0) {
+			return readTrailer(handler);
+		}
+		chunkEnd = true;
+		body.resize(bodyLength + size);
+		readBody(size, handler);
 	}
 
-public:
-	std::string host;
-	int port;
-	std::string path;
+	void readTrailer(ReadHandler handler) {
+		asio::async_read_until(socket, response, "\r\n",
+				strand.wrap(boost::bind(&HttpSocket::handleTrailer, this, asio::placeholders::error,
+						asio::placeholders::bytes_transferred, handler)));
+	}
 
-protected:
-	asio::ip::tcp::resolver::iterator endpoint_iterator;
+	void handleTrailer(const ErrorCode &ec, size_t length, ReadHandler handler) {
+		if (ec) {
+			return finishRead(ec, handler);
+		}
+		response.consume(length);
+		// Trailer headers are ignored, empty line ends the message
+		if (length > 2) {
+			return readTrailer(handler);
+		}
+		finishRead(ErrorCode(), handler);
+	}
+
+	void finishRead(const ErrorCode &ec, ReadHandler handler) {
+		ErrorCode result = finishOperation(readDeadline, ec);
+		if (!result && (status < 200 || status > 299)) {
+			// Whole reply has been read, so connection can still be reused
+			result = ErrorCode(status, httpStatusCategory());
+		}
+		if (result) {
+			body.clear();
+		} else {
+			body.resize(bodyLength);
+		}
+		if ((result && result.category() != httpStatusCategory()) || !keepAlive) {
+			close();
+		}
+		handler(result, body);
+	}
+
+	std::string requestHeader; /// Headers of request being sent
+	ConstBuffers requestBuffers; /// Headers and body of request being sent, kept until reply arrives
+	bool connectionUsed; /// Has any request been sent over current connection
+	bool reused; /// Was current request sent over connection used before
+	bool resent; /// Has current request been sent again after server closed connection
+	bool keepAlive; /// Can connection be reused after current reply
+	int status; /// Status code of current reply
+	asio::streambuf response; /// Data received from server and not processed yet
+	std::vector<unsigned char> body; /// Body of reply being read
+	size_t bodyLength; /// Number of body bytes received
+	bool chunkEnd; /// Is CRLF after chunk data expected
 };
 }
 
@@ -0,0 +1,275 @@
+#ifndef CPS_TRANSACTION_HPP
+#define CPS_TRANSACTION_HPP
+
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/future.hpp>
+
+#include "Connection.hpp"
+#include "RetryPolicy.hpp"
+#include "Request.hpp"
+#include "Response.hpp"
+#include "Exception.hpp"
+
+namespace CPS
+{
+
+/**
+ * @brief Transaction pinned to one connection
+ *
+ * Transaction holds its connection until it ends, so when the connection is acquired from
+ * ConnectionPool other threads keep using the rest of the pool. Requests sent through
+ * the transaction carry its id, transaction state of the connection itself is not used.
+ * Asynchronous requests are written without waiting for each other's replies when
+ * the connection allows pipelining, see Connection::setMaxPipelinedRequests().
+ * Requests are not retried while transaction is open, as a retry would run on a new socket.
+ * Transaction that has not ended is rolled back when destroyed
+ */
+class Transaction: private boost::noncopyable
+{
+public:
+    /**
+     * Begins transaction
+     * @param connection connection used only by this transaction until it ends
+     * @param storage storage of transaction, empty for storage of connection
+     */
+    Transaction(boost::shared_ptr<Connection> connection, const std::string &storage = "") :
+        connection(connection), state(new State()), id(-1), ended(false) {
+        this->storage = storage.empty() ? connection->storageName : storage;
+        this->retryPolicy = connection->getRetryPolicy();
+        connection->setRetryPolicy(RetryPolicy::none());
+        try {
+            boost::scoped_ptr<Response> resp(send<Response>(Request("begin-transaction"), -1));
+            this->id = resp->getParam("transaction_id", -1LL);
+        } catch (...) {
+            connection->setRetryPolicy(this->retryPolicy);
+            throw;
+        }
+        // Reply also set transaction of the connection, id is passed with each request instead
+        connection->clearTransactionId();
+        if (this->id == -1) {
+            connection->setRetryPolicy(this->retryPolicy);
+            BOOST_THROW_EXCEPTION(CPS::Exception("Server did not return transaction id", 9010));
+        }
+    }
+
+    /**
+     * Rolls back transaction that has not ended, errors are ignored
+     */
+    ~Transaction() {
+        if (isActive()) {
+            try {
+                rollback();
+            } catch (...) {
+            }
+        }
+    }
+
+    long long getId() const {
+        return this->id;
+    }
+
+    /**
+     * Returns false once transaction has been committed or rolled back
+     */
+    bool isActive() const {
+        return !this->ended;
+    }
+
+    const boost::shared_ptr<Connection> &getConnection() const {
+        return this->connection;
+    }
+
+    /**
+     * Sends request within transaction and waits for the reply.
+     * Request is sent after asynchronous requests made before it
+     * @see Connection::sendRequest(const Request &request)
+     */
+    template<class ResponseType>
+    ResponseType *sendRequest(const Request &request) {
+        checkActive();
+        return send<ResponseType>(request, this->id);
+    }
+
+    Response *sendRequest(const Request &request) {
+        return sendRequest<Response>(request);
+    }
+
+    /**
+     * Sends request within transaction without waiting for the reply
+     * @see Connection::sendRequestAsync(const Request &request, typename AsyncResponseHandler<ResponseType>::type handler)
+     */
+    template<class ResponseType>
+    void sendRequestAsync(const Request &request, typename AsyncResponseHandler<ResponseType>::type handler) {
+        checkActive();
+        boost::shared_ptr<Connection::PendingRequest> pending =
+                this->connection->createPendingRequest(request, getStorage(request), this->id);
+        {
+            boost::mutex::scoped_lock lock(this->state->mutex);
+            this->state->outstanding++;
+        }
+        this->connection->sendPendingAsync<ResponseType>(pending,
+                boost::bind(&Transaction::completeRequest<ResponseType>, this->state, handler, _1, _2));
+    }
+
+    /**
+     * Sends request within transaction without waiting for the reply
+     * @see Connection::sendRequestAsync(const Request &request)
+     */
+    template<class ResponseType>
+    boost::unique_future<boost::shared_ptr<ResponseType> > sendRequestAsync(const Request &request) {
+        boost::shared_ptr<boost::promise<boost::shared_ptr<ResponseType> > > promise(
+                new boost::promise<boost::shared_ptr<ResponseType> >());
+        sendRequestAsync<ResponseType>(request,
+                boost::bind(&Transaction::deliverToPromise<ResponseType>, promise, _1, _2));
+        return promise->get_future();
+    }
+
+    /**
+     * Waits for asynchronous requests and commits transaction.
+     * If any of them has failed, transaction is rolled back and its error is thrown
+     */
+    void commit() {
+        checkActive();
+        boost::exception_ptr error = waitForRequests();
+        if (error) {
+            try {
+                end("rollback-transaction");
+            } catch (CPS::Exception &) {
+            }
+            boost::rethrow_exception(error);
+        }
+        end("commit-transaction");
+    }
+
+    /**
+     * Waits for asynchronous requests and rolls back transaction
+     */
+    void rollback() {
+        checkActive();
+        waitForRequests();
+        end("rollback-transaction");
+    }
+
+private:
+    /**
+     * Completion state of asynchronous requests, shared with their handlers
+     */
+    struct State {
+        State() :
+            outstanding(0) {
+        }
+
+        boost::mutex mutex;
+        boost::condition_variable finished;
+        unsigned int outstanding; /// Number of asynchronous requests without reply
+        boost::exception_ptr error; /// First error of asynchronous requests
+    };
+
+    std::string getStorage(const Request &request) const {
+        return request.getStorage().empty() ? this->storage : request.getStorage();
+    }
+
+    template<class ResponseType>
+    ResponseType *send(const Request &request, long long transactionId) {
+        std::string storage = getStorage(request);
+        return this->connection->sendMessage<ResponseType>(
+                this->connection->getRequestMessage(request, storage, transactionId), storage,
+                request.getDeadline(), request.getCancellationToken());
+    }
+
+    void checkActive() const {
+        if (this->ended) {
+            BOOST_THROW_EXCEPTION(CPS::Exception("Transaction has already ended", 9010));
+        }
+    }
+
+    /**
+     * Runs io_service owned by connection until asynchronous requests complete
+     */
+    void runRequests() {
+        asio::io_service &io_service = this->connection->getIoService();
+        for (;;) {
+            {
+                boost::mutex::scoped_lock lock(this->state->mutex);
+                if (this->state->outstanding == 0)
+                    return;
+            }
+            if (io_service.stopped())
+                io_service.reset();
+            io_service.run_one();
+        }
+    }
+
+    /**
+     * Waits until asynchronous requests complete
+     * @return first error of them
+     */
+    boost::exception_ptr waitForRequests() {
+        if (this->connection->ownedIoService)
+            runRequests();
+        boost::mutex::scoped_lock lock(this->state->mutex);
+        while (this->state->outstanding > 0)
+            this->state->finished.wait(lock);
+        boost::exception_ptr error = this->state->error;
+        this->state->error = boost::exception_ptr();
+        return error;
+    }
+
+    /**
+     * Sends commit or rollback, transaction ends even if it fails
+     */
+    void end(const std::string &command) {
+        this->ended = true;
+        try {
+            boost::scoped_ptr<Response> resp(send<Response>(Request(command), this->id));
+        } catch (...) {
+            this->connection->setRetryPolicy(this->retryPolicy);
+            throw;
+        }
+        this->connection->setRetryPolicy(this->retryPolicy);
+    }
+
+    template<class ResponseType>
+    static void completeRequest(boost::shared_ptr<State> state, typename AsyncResponseHandler<ResponseType>::type handler,
+            boost::shared_ptr<ResponseType> resp, boost::exception_ptr error) {
+        if (error) {
+            boost::mutex::scoped_lock lock(state->mutex);
+            if (!state->error)
+                state->error = error;
+        }
+        // Handler runs before commit() returns
+        handler(resp, error);
+        {
+            boost::mutex::scoped_lock lock(state->mutex);
+            state->outstanding--;
+        }
+        state->finished.notify_all();
+    }
+
+    template<class ResponseType>
+    static void deliverToPromise(boost::shared_ptr<boost::promise<boost::shared_ptr<ResponseType> > > promise,
+            boost::shared_ptr<ResponseType> resp, boost::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(resp);
+        }
+    }
+
+    boost::shared_ptr<Connection> connection;
+    boost::shared_ptr<State> state;
+    std::string storage; /// Storage of transaction
+    long long id; /// Transaction id returned by server
+    bool ended; /// Has transaction been committed or rolled back
+    RetryPolicy retryPolicy; /// Retry policy of connection restored when transaction ends
+};
+}
+
+#endif //#ifndef CPS_TRANSACTION_HPP
@@ -0,0 +1,281 @@
+#ifndef CPS_TRANSPORT_HPP_
+#define CPS_TRANSPORT_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+
+#include "Exception.hpp"
+#include "Protobuf.hpp"
+#include "Protocol.hpp"
+#include "Socket.hpp"
+#ifdef CPS_USE_IO_URING
+#include "IoUringSocket.hpp"
+#endif
+
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+
+namespace CPS
+{
+
+/**
+ * Creates socket of a registered connection string scheme
+ * @param io_service io_service of connection
+ * @param address part of connection string after scheme://, it is passed to AbstractSocket::asyncConnect() as host
+ */
+typedef boost::function<boost::shared_ptr<AbstractSocket> (asio::io_service &io_service, const std::string &address)> TransportFactory;
+
+/**
+ * @brief Process wide registry of transports for connection string schemes
+ *
+ * Connection handles tcp://, unix:// and http:// itself and looks up other schemes here.
+ * Sockets of registered transports carry the same frames as TCP sockets.
+ * Scheme inproc:// is registered by default, see LoopbackSocket.
+ * Scheme uring:// is registered on Linux when CPS_USE_IO_URING is defined, see IoUringSocket
+ */
+class TransportRegistry
+{
+public:
+	static TransportRegistry &instance() {
+		static TransportRegistry registry;
+		return registry;
+	}
+
+	/**
+	 * Registers transport, replacing previous transport of the scheme
+	 * @param scheme scheme without ://, e.g. "inproc"
+	 */
+	void registerTransport(const std::string &scheme, TransportFactory factory) {
+		boost::mutex::scoped_lock lock(mutex);
+		factories[scheme] = factory;
+	}
+
+	void unregisterTransport(const std::string &scheme) {
+		boost::mutex::scoped_lock lock(mutex);
+		factories.erase(scheme);
+	}
+
+	/**
+	 * Creates socket for connection string
+	 * @param address receives part of connection string after scheme://
+	 * @return NULL pointer if scheme of connection string is not registered
+	 */
+	boost::shared_ptr<AbstractSocket> create(asio::io_service &io_service, const std::string &connectionString, std::string &address) {
+		size_t pos = connectionString.find("://");
+		if (pos == std::string::npos)
+			return boost::shared_ptr<AbstractSocket>();
+		TransportFactory factory;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			std::map<std::string, TransportFactory>::iterator it = factories.find(connectionString.substr(0, pos));
+			if (it == factories.end())
+				return boost::shared_ptr<AbstractSocket>();
+			factory = it->second;
+		}
+		address = connectionString.substr(pos + 3);
+		return factory(io_service, address);
+	}
+
+private:
+	TransportRegistry();
+
+	boost::mutex mutex;
+	std::map<std::string, TransportFactory> factories;
+};
+
+/**
+ * Handles request message sent over loopback transport
+ * @param request request message (cps:request envelope)
+ * @return reply message (cps:reply envelope)
+ */
+typedef boost::function<std::string (const std::string &request)> LoopbackHandler;
+
+/**
+ * @brief Process wide registry of in-process servers reachable with inproc://name
+ */
+class LoopbackRegistry
+{
+public:
+	static LoopbackRegistry &instance() {
+		static LoopbackRegistry registry;
+		return registry;
+	}
+
+	/**
+	 * Makes handler reachable with connection string inproc://name.
+	 * Handler is called by threads running io_service of connections, concurrently
+	 * when several connections are used
+	 */
+	void bind(const std::string &name, LoopbackHandler handler) {
+		boost::mutex::scoped_lock lock(mutex);
+		handlers[name] = handler;
+	}
+
+	/**
+	 * Removes handler, following connects to it are refused
+	 */
+	void unbind(const std::string &name) {
+		boost::mutex::scoped_lock lock(mutex);
+		handlers.erase(name);
+	}
+
+	/**
+	 * Returns handler bound to name, empty function if there is none
+	 */
+	LoopbackHandler find(const std::string &name) {
+		boost::mutex::scoped_lock lock(mutex);
+		std::map<std::string, LoopbackHandler>::iterator it = handlers.find(name);
+		return it == handlers.end() ? LoopbackHandler() : it->second;
+	}
+
+private:
+	LoopbackRegistry() {
+	}
+
+	boost::mutex mutex;
+	std::map<std::string, LoopbackHandler> handlers;
+};
+
+/**
+ * @brief Socket that passes frames to an in-process handler instead of kernel
+ *
+ * Each written frame is decoded, its message is handled synchronously within the
+ * socket's strand and the framed reply is queued for reading. Request ids of pipelined
+ * requests are echoed, so replies are matched like replies of server.
+ * Handler exceptions reset the connection
+ * @see LoopbackRegistry
+ */
+class LoopbackSocket: public AbstractSocket
+{
+public:
+	LoopbackSocket(asio::io_service &io_service) :
+		AbstractSocket(io_service) {
+	}
+	virtual ~LoopbackSocket() {
+	}
+
+	static boost::shared_ptr<AbstractSocket> create(asio::io_service &io_service, const std::string &/*address*/) {
+		return boost::shared_ptr<AbstractSocket>(new LoopbackSocket(io_service));
+	}
+
+	/**
+	 * Connects to handler bound to host
+	 */
+	virtual void asyncConnect(const std::string &host, int /*port*/, Handler handler) {
+		close();
+		server = LoopbackRegistry::instance().find(host);
+		ErrorCode ec;
+		if (server) {
+			connected = true;
+		} else {
+			ec = asio::error::connection_refused;
+		}
+		strand.post(boost::bind(handler, ec));
+	}
+
+	using AbstractSocket::asyncWrite;
+	virtual void asyncWrite(const ConstBuffers &buffers, Handler handler) {
+		ErrorCode ec;
+		if (!connected) {
+			ec = asio::error::not_connected;
+		} else {
+			request.resize(asio::buffer_size(buffers));
+			asio::buffer_copy(asio::buffer(request), buffers);
+			ec = handleRequest();
+			if (ec)
+				close();
+		}
+		strand.post(boost::bind(handler, ec));
+	}
+
+	virtual void asyncRead(ReadHandler handler) {
+		// Reply buffer may still be in use by caller, so reply is delivered later
+		strand.post(boost::bind(&LoopbackSocket::deliverReply, this, handler));
+	}
+
+	virtual void close() {
+		connected = false;
+		replies.clear();
+		if (pendingRead) {
+			strand.post(boost::bind(&LoopbackSocket::failRead, this, pendingRead, ErrorCode(asio::error::operation_aborted)));
+			pendingRead.clear();
+		}
+	}
+
+protected:
+	/**
+	 * Passes frames of request buffer to server and queues their replies
+	 */
+	ErrorCode handleRequest() {
+		size_t offset = 0;
+		while (offset < request.size()) {
+			size_t length = 0;
+			if (request.size() - offset < 8 || !ProtocolEngine::parseHeader(&request[offset], length)
+					|| request.size() - offset - 8 < length)
+				return asio::error::invalid_argument;
+			const unsigned char *content = &request[0] + offset + 8;
+			offset += 8 + length;
+			try {
+				ProtobufSlice message, id;
+				ProtocolEngine::decodeReply(content, length, message, id);
+				std::string replyMessage = server(message.toString());
+				size_t size = lengthDelimitedFieldSize(1, replyMessage.size());
+				if (!id.empty())
+					size += lengthDelimitedFieldSize(13, id.size);
+				// Room for terminator, so reply can be parsed in place without growing
+				replies.push_back(std::vector<unsigned char>());
+				replies.back().reserve(size + 1);
+				replies.back().resize(size);
+				unsigned char *out = &replies.back()[0];
+				out = writeStringField(out, 1, replyMessage);
+				if (!id.empty())
+					writeStringField(out, 13, id.toString());
+			} catch (...) {
+				return asio::error::connection_reset;
+			}
+		}
+		if (pendingRead) {
+			strand.post(boost::bind(&LoopbackSocket::deliverReply, this, pendingRead));
+			pendingRead.clear();
+		}
+		return ErrorCode();
+	}
+
+	void deliverReply(ReadHandler handler) {
+		if (!connected) {
+			return failRead(handler, asio::error::not_connected);
+		}
+		if (replies.empty()) {
+			// Reply of request that is still being written
+			pendingRead = handler;
+			return;
+		}
+		replyBuffer.swap(replies.front());
+		replies.pop_front();
+		handler(ErrorCode(), replyBuffer);
+	}
+
+	void failRead(ReadHandler handler, const ErrorCode &ec) {
+		replyBuffer.clear();
+		handler(ec, replyBuffer);
+	}
+
+	LoopbackHandler server;
+	std::vector<unsigned char> request; /// Frames of request being written
+	std::deque<std::vector<unsigned char> > replies; /// Replies not read yet
+	ReadHandler pendingRead; /// Read waiting for reply
+};
+
+inline TransportRegistry::TransportRegistry() {
+	factories["inproc"] = &LoopbackSocket::create;
+#ifdef CPS_USE_IO_URING
+	factories["uring"] = &IoUringSocket::create;
+#endif
+}
+}
+
+#endif //#ifndef CPS_TRANSPORT_HPP_
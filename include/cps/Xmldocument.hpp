@@ -6,7 +6,8 @@
 
 #include <map>
 #include <list>
-#include <stack>
+#include <cstring>
+#include <vector>
 
 namespace CPS
 {
@@ -497,6 +498,35 @@ public:
         return ret;
     }
 
+    /**
+     * Parses XML where it is, without copying it. Parsed nodes refer into buffer,
+     * so buffer is taken over by document
+     * @param buffer buffer holding XML, it is left empty
+     * @param offset start of XML in buffer
+     * @param length length of XML
+     */
+    static XMLDocument* parseInPlace(std::vector<unsigned char> &buffer, size_t offset, size_t length) {
+        XMLDocument *ret = new XMLDocument();
+        ret->buffer.swap(buffer);
+        // Terminator overwrites byte following XML, buffer grows only if XML is at its end
+        if (offset + length >= ret->buffer.size())
+            ret->buffer.resize(offset + length + 1);
+        ret->buffer[offset + length] = 0;
+        ret->pDoc = new rapidxml::xml_document<>();
+        char *xml_string = reinterpret_cast<char *>(&ret->buffer[offset]);
+        try {
+#ifdef CPS_XMLDOCUMENT_HPP_PARSE_FULL
+            ret->pDoc->parse<rapidxml::parse_full>(xml_string);
+#else // CPS_XMLDOCUMENT_HPP_PARSE_FULL
+            ret->pDoc->parse<0>(xml_string);
+#endif // CPS_XMLDOCUMENT_HPP_PARSE_FULL
+        } catch (...) {
+            delete ret;
+            throw;
+        }
+        return ret;
+    }
+
     NodeSet FindFast(const char *xp_string, bool multiple_matches = true) {
         NodeSet result;
         while (*xp_string == '/') {
@@ -675,6 +705,7 @@ public:
 
 private:
     rapidxml::xml_document<>* pDoc;
+    std::vector<unsigned char> buffer; /// XML parsed by parseInPlace(), nodes refer into it
 
     void findXpath(Node *const_child, Node *child, bool multiple_matches,
                    const char *start_pos, void (*func)(void *, Node *), void *userdata) {
@@ -793,27 +824,35 @@ inline void AddNodeToSet(void *userdata, Node *node)
 
 inline std::string xmlUtilCreatePath(const char * xpath, const char * value)
 {
-	std::string xp(xpath), output;
-	std::stack<std::string> xp_stack;
-    size_t pos, start = 0;
-    while ((pos = xp.find('/', start)) != std::string::npos) {
-        if (start + 1 <= pos)
-            xp_stack.push(xp.substr(start, pos - start));
-        start = pos + 1;
-    }
-    //if we are not at the end of xpath push last tag
-    if (start < xp.size())
-        xp_stack.push(xp.substr(start));
-    while (xp_stack.size()) {
-        if (!output.size())
-            output = std::string(
-                         "<" + xp_stack.top() + ">" + value + "</" + xp_stack.top()
-                         + ">");
-        else
-            output = std::string(
-                         "<" + xp_stack.top() + ">" + output + "</" + xp_stack.top()
-                         + ">");
-        xp_stack.pop();
+    // Tags of xpath as offset and length, output is then written in a single pass
+    std::vector<std::pair<size_t, size_t> > tags;
+    size_t tagsLength = 0, start = 0, pos = 0;
+    for (;; pos++) {
+        if (xpath[pos] == '/' || xpath[pos] == 0) {
+            if (pos > start) {
+                tags.push_back(std::make_pair(start, pos - start));
+                tagsLength += pos - start;
+            }
+            if (xpath[pos] == 0)
+                break;
+            start = pos + 1;
+        }
+    }
+    std::string output;
+    if (tags.empty())
+        return output;
+    size_t valueLength = strlen(value);
+    output.reserve(2 * tagsLength + 5 * tags.size() + valueLength);
+    for (size_t i = 0; i < tags.size(); i++) {
+        output += '<';
+        output.append(xpath + tags[i].first, tags[i].second);
+        output += '>';
+    }
+    output.append(value, valueLength);
+    for (size_t i = tags.size(); i-- > 0;) {
+        output.append("</", 2);
+        output.append(xpath + tags[i].first, tags[i].second);
+        output += '>';
     }
     return output;
 }
@@ -55,6 +55,13 @@ public:
     AlternativesResponse(std::string rawResponse) :
         Response(rawResponse) {
     }
+    /**
+     * Constructs Response object parsing reply in place
+     * @see Response(std::vector<unsigned char> &, size_t, size_t, std::string, std::string)
+     */
+    AlternativesResponse(std::vector<unsigned char> &reply, size_t offset, size_t length) :
+        Response(reply, offset, length) {
+    }
     virtual ~AlternativesResponse() {}
 
     /**
@@ -22,6 +22,13 @@ public:
     ListFacetsResponse(std::string rawResponse) :
         Response(rawResponse) {
     }
+    /**
+     * Constructs Response object parsing reply in place
+     * @see Response(std::vector<unsigned char> &, size_t, size_t, std::string, std::string)
+     */
+    ListFacetsResponse(std::vector<unsigned char> &reply, size_t offset, size_t length) :
+        Response(reply, offset, length) {
+    }
     virtual ~ListFacetsResponse() {}
 
     /**
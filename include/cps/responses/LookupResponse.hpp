@@ -30,6 +30,13 @@ public:
     LookupResponse(std::string rawResponse) :
         Response(rawResponse) {
     }
+    /**
+     * Constructs Response object parsing reply in place
+     * @see Response(std::vector<unsigned char> &, size_t, size_t, std::string, std::string)
+     */
+    LookupResponse(std::vector<unsigned char> &reply, size_t offset, size_t length) :
+        Response(reply, offset, length) {
+    }
     virtual ~LookupResponse() {
         _documentsString.clear();
         for (unsigned int i = 0; i < _documentsXML.size(); i++) delete _documentsXML[i];
@@ -77,6 +77,15 @@ public:
     	single = doc->FindFast("cps:reply/cps:content/all").size() == 0;
     	prefix = single ? "" : "all/";
     }
+    /**
+     * Constructs Response object parsing reply in place
+     * @see Response(std::vector<unsigned char> &, size_t, size_t, std::string, std::string)
+     */
+    StatusResponse(std::vector<unsigned char> &reply, size_t offset, size_t length) :
+        Response(reply, offset, length) {
+    	single = doc->FindFast("cps:reply/cps:content/all").size() == 0;
+    	prefix = single ? "" : "all/";
+    }
     virtual ~StatusResponse() {
     }
 
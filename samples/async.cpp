@@ -0,0 +1,73 @@
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+void onLookup(boost::shared_ptr<CPS::LookupResponse> lookup_resp, boost::exception_ptr error) {
+    if (error) {
+        try {
+            boost::rethrow_exception(error);
+        } catch (CPS::Exception &e) {
+            std::cerr << e.what() << std::endl;
+        }
+        return;
+    }
+    std::cout << "Found " << lookup_resp->getDocumentsXML().size() << " documents" << std::endl;
+}
+
+int main() {
+    try
+    {
+        // Connections share io_service that is run by two threads
+        boost::asio::io_service io_service;
+        boost::asio::io_service::work work(io_service);
+        boost::thread_group threads;
+        for (int i = 0; i < 2; i++) {
+            threads.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+        }
+
+        CPS::Connection *conn = new CPS::Connection(io_service, "tcp://127.0.0.1:5550", "storage", "user", "password");
+        CPS::Connection *conn2 = new CPS::Connection(io_service, "tcp://127.0.0.1:5550", "storage", "user", "password");
+        // Up to 4 requests of second connection are sent without waiting for previous replies
+        conn2->setMaxPipelinedRequests(4);
+
+        // Completion handler is called from one of io_service threads
+        conn->sendRequestAsync<CPS::LookupResponse>(CPS::LookupRequest("id1"), &onLookup);
+
+        // Send search and facet listing without waiting for each other.
+        // Requests of one connection complete in the order they were sent
+        boost::unique_future<boost::shared_ptr<CPS::SearchResponse> > search_future =
+                conn->sendRequestAsync<CPS::SearchResponse>(CPS::SearchRequest("<category>cars</category>"));
+        boost::unique_future<boost::shared_ptr<CPS::ListFacetsResponse> > facets_future =
+                conn2->sendRequestAsync<CPS::ListFacetsResponse>(CPS::ListFacetsRequest("category"));
+
+        std::vector<boost::unique_future<boost::shared_ptr<CPS::RetrieveResponse> > > retrieve_futures;
+        for (int i = 0; i < 10; i++) {
+            retrieve_futures.push_back(conn2->sendRequestAsync<CPS::RetrieveResponse>(CPS::RetrieveRequest("id" + CPS::Utils::toString(i))));
+        }
+
+        // get() waits for the reply and throws CPS::Exception if request has failed
+        std::cout << "Found: " << search_future.get()->getHits() << std::endl;
+        std::cout << "Facets: " << facets_future.get()->getFacets().size() << std::endl;
+        for (unsigned int i = 0; i < retrieve_futures.size(); i++) {
+            std::cout << "Retrieved: " << retrieve_futures[i].get()->getDocumentsXML().size() << std::endl;
+        }
+
+        // Clean Up
+        io_service.stop();
+        threads.join_all();
+        delete conn;
+        delete conn2;
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main() {
+    try
+    {
+        std::vector<std::string> nodes;
+        nodes.push_back("tcp://192.168.0.1:5550");
+        nodes.push_back("tcp://192.168.0.2:5550");
+        nodes.push_back("http://192.168.0.3:80/cgi-bin/cps2-cgi");
+
+        // Two connections to every node
+        CPS::ClusterConnection *cluster = new CPS::ClusterConnection(nodes, "storage", "user", "password",
+                "document", "document/id", CPS::Request::MapStringStringType(), 2);
+        // Prefer nodes that answered fastest recently
+        cluster->setBalancingStrategy(CPS::ClusterConnection::LOWEST_LATENCY);
+        cluster->addNodeLabel("tcp://192.168.0.2:5550", "backup");
+        std::cout << cluster->checkHealth() << " of " << cluster->size() << " nodes available" << std::endl;
+
+        for (int i = 0; i < 100; i++) {
+            CPS::SearchResponse *search_resp = cluster->sendRequest<CPS::SearchResponse>(
+                    CPS::SearchRequest("*" + CPS::Utils::toString(i) + "*"));
+            delete search_resp;
+        }
+
+        // Sent only to nodes labeled "backup"
+        CPS::StatusRequest status_req;
+        status_req.setClusterLabel("backup");
+        delete cluster->sendRequest(status_req);
+
+        std::vector<CPS::NodeStatistics> stats = cluster->getNodeStatistics();
+        for (unsigned int i = 0; i < stats.size(); i++) {
+            std::cout << stats[i].connectionString << ": " << stats[i].requests << " requests, "
+                      << stats[i].latency * 1000 << " ms average, "
+                      << (stats[i].healthy ? "healthy" : "failed") << std::endl;
+        }
+
+        // Clean Up
+        delete cluster;
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "AsyncTest.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <vector>
+
+AsyncTest::AsyncTest(CPS::Connection& connection)
+  : TestCase(connection)
+{
+}
+
+void AsyncTest::run_tests()
+{
+  RUN_TEST(test_insert_many_documents_async_and_delete_them);
+  RUN_TEST(test_lookup_many_documents_with_handler_and_delete_them);
+}
+
+void AsyncTest::test_insert_many_documents_async_and_delete_them()
+{
+  static const char* doc_template =
+      "<document><id>{ID}</id><title>Test document 1</title><body>Lorem ipsum dolor sit amet, consectetur adipiscing elit. Nullam a nisl magna</body></document>";
+  static const char* id_placeholder = "{ID}";
+
+  // Send one insert request per document without waiting for replies
+  std::vector<boost::unique_future<boost::shared_ptr<CPS::InsertResponse> > > insert_futures;
+  std::vector<std::string> expected_ids;
+  for (int i = 0; i < 10; ++i)
+  {
+    std::string docid = make_docid("test_insert_many_documents_async_and_delete_them", i);
+    std::string doc(doc_template);
+    doc.replace(doc.find(id_placeholder), strlen(id_placeholder), docid);
+    expected_ids.push_back(docid);
+    insert_futures.push_back(
+        connection().sendRequestAsync<CPS::InsertResponse>(CPS::InsertRequest(doc)));
+  }
+  // Process all requests
+  connection().getIoService().run();
+  std::vector<std::string> inserted_ids;
+  for (auto& insert_future : insert_futures)
+  {
+    assert(insert_future.is_ready());
+    auto ids = insert_future.get()->getModifiedIds();
+    assert(ids.size() == 1);
+    inserted_ids.push_back(ids[0]);
+  }
+  std::sort(inserted_ids.begin(), inserted_ids.end());
+  std::sort(expected_ids.begin(), expected_ids.end());
+  std::cout << "Insert ids: " << CPS::Utils::join(inserted_ids) << std::endl;
+  assert(inserted_ids == expected_ids);
+  // Delete documents
+  CPS::DeleteRequest delete_req(inserted_ids);
+  std::unique_ptr<CPS::DeleteResponse> delete_resp(
+      connection().sendRequest<CPS::DeleteResponse>(delete_req));
+  print_errors(std::cout, delete_resp->getErrors());
+  auto deleted_ids = delete_resp->getModifiedIds();
+  std::cout << "Delete ids: " << CPS::Utils::join(deleted_ids) << std::endl;
+  assert(deleted_ids.size() == inserted_ids.size());
+}
+
+void AsyncTest::test_lookup_many_documents_with_handler_and_delete_them()
+{
+  std::vector<std::string> docs_vector;
+  for (int i = 0; i < 5; ++i)
+  {
+    std::string docid = make_docid("test_lookup_many_documents_with_handler_and_delete_them", i);
+    docs_vector.push_back("<document><id>" + docid + "</id><title>Test document 1</title></document>");
+  }
+  CPS::InsertRequest insert_req(docs_vector);
+  std::unique_ptr<CPS::InsertResponse> insert_resp(
+      connection().sendRequest<CPS::InsertResponse>(insert_req));
+  auto inserted_ids = insert_resp->getModifiedIds();
+  assert(inserted_ids.size() == docs_vector.size());
+  // Look up every document with its own request
+  std::vector<std::string> found_ids;
+  int failures = 0;
+  for (const auto& docid : inserted_ids)
+  {
+    connection().sendRequestAsync<CPS::LookupResponse>(CPS::LookupRequest(docid),
+        [&found_ids, &failures](boost::shared_ptr<CPS::LookupResponse> lookup_resp, boost::exception_ptr error)
+    {
+      if (error)
+      {
+        ++failures;
+        return;
+      }
+      for (auto doc : lookup_resp->getDocumentsXML())
+      {
+        found_ids.push_back(get_docid(doc));
+      }
+    });
+  }
+  connection().getIoService().run();
+  std::sort(found_ids.begin(), found_ids.end());
+  std::sort(inserted_ids.begin(), inserted_ids.end());
+  std::cout << "Found ids: " << CPS::Utils::join(found_ids) << std::endl;
+  assert(failures == 0);
+  assert(found_ids == inserted_ids);
+  // Delete documents
+  CPS::DeleteRequest delete_req(inserted_ids);
+  std::unique_ptr<CPS::DeleteResponse> delete_resp(
+      connection().sendRequest<CPS::DeleteResponse>(delete_req));
+  auto deleted_ids = delete_resp->getModifiedIds();
+  std::cout << "Delete ids: " << CPS::Utils::join(deleted_ids) << std::endl;
+  assert(deleted_ids.size() == inserted_ids.size());
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#ifndef ASYNCTEST_HPP_
+#define ASYNCTEST_HPP_
+
+#include "TestCase.hpp"
+
+class AsyncTest : public TestCase
+{
+public:
+  AsyncTest(CPS::Connection& connection);
+
+protected:
+  virtual void run_tests();
+
+private:
+  void test_insert_many_documents_async_and_delete_them();
+  void test_lookup_many_documents_with_handler_and_delete_them();
+};
+
+#endif /* ASYNCTEST_HPP_ */
@@ -0,0 +1,246 @@
+#include "HttpSocketTest.hpp"
+
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+const std::string reply_xml =
+    "<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>status</cps:command>"
+    "<cps:seconds>0</cps:seconds><cps:content><status>ok</status></cps:content></cps:reply>";
+
+/**
+ * Local HTTP server running in its own thread
+ */
+class Server
+{
+public:
+  Server(const std::vector<std::string>& replies, size_t piece_size, int& connections, std::vector<std::string>& request_lines)
+    : acceptor_(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+      replies_(replies), piece_size_(piece_size), connections_(connections), request_lines_(request_lines)
+  {
+    connections_ = 0;
+    request_lines_.clear();
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  ~Server()
+  {
+    boost::system::error_code ec;
+    acceptor_.close(ec);
+    thread_.join();
+  }
+
+  unsigned short port() const
+  {
+    return acceptor_.local_endpoint().port();
+  }
+
+private:
+  void run()
+  {
+    size_t next = 0;
+    while (next < replies_.size())
+    {
+      boost::asio::ip::tcp::socket socket(io_service_);
+      boost::system::error_code ec;
+      acceptor_.accept(socket, ec);
+      if (ec)
+      {
+        return;
+      }
+      ++connections_;
+      boost::asio::streambuf request;
+      while (next < replies_.size())
+      {
+        // Request body is skipped, its length is taken from headers
+        size_t length = boost::asio::read_until(socket, request, "\r\n\r\n", ec);
+        if (ec)
+        {
+          break;
+        }
+        std::string headers(boost::asio::buffer_cast<const char*>(request.data()), length);
+        request.consume(length);
+        request_lines_.push_back(headers.substr(0, headers.find("\r\n")));
+        size_t body_length = atoi(headers.c_str() + headers.find("Content-Length: ") + 16);
+        if (request.size() < body_length)
+        {
+          boost::asio::read(socket, request, boost::asio::transfer_exactly(body_length - request.size()), ec);
+        }
+        request.consume(body_length);
+        const std::string& reply = replies_[next++];
+        for (size_t pos = 0; pos < reply.size() && !ec; pos += piece_size_)
+        {
+          boost::asio::write(socket, boost::asio::buffer(reply.data() + pos, std::min(piece_size_, reply.size() - pos)), ec);
+          std::this_thread::yield();
+        }
+        if (reply.compare(0, 8, "HTTP/1.0") == 0)
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  boost::asio::io_service io_service_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  std::vector<std::string> replies_;
+  size_t piece_size_;
+  int& connections_;
+  std::vector<std::string>& request_lines_;
+  std::thread thread_;
+};
+
+std::string with_length(const std::string& status, const std::string& body)
+{
+  return "HTTP/1.1 " + status + "\r\nContent-Type: text/xml\r\ncontent-LENGTH: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+std::string send_status(CPS::Connection& conn)
+{
+  std::unique_ptr<CPS::Response> resp(conn.sendRequest(CPS::StatusRequest()));
+  return resp->getParam<std::string>("status");
+}
+
+}
+
+HttpSocketTest::HttpSocketTest(CPS::Connection& connection)
+  : TestCase(connection), piece_size_(1), connections_(0)
+{
+}
+
+void HttpSocketTest::set_up()
+{
+}
+
+void HttpSocketTest::tear_down()
+{
+  server_.reset();
+}
+
+void HttpSocketTest::run_tests()
+{
+  RUN_TEST(test_content_length_reply_in_pieces);
+  RUN_TEST(test_chunked_reply_with_extensions_and_trailer);
+  RUN_TEST(test_reply_without_length_ends_with_connection);
+  RUN_TEST(test_error_status_keeps_connection);
+  RUN_TEST(test_invalid_status_line);
+  RUN_TEST(test_url_query_is_sent);
+}
+
+std::string HttpSocketTest::serve(const std::vector<std::string>& replies, size_t piece_size)
+{
+  std::shared_ptr<Server> server(new Server(replies, piece_size, connections_, request_lines_));
+  server_ = server;
+  return "http://127.0.0.1:" + std::to_string(server->port());
+}
+
+void HttpSocketTest::test_content_length_reply_in_pieces()
+{
+  // Headers and body arrive split at every possible place
+  std::vector<std::string> replies;
+  for (size_t piece_size = 1; piece_size <= 7; ++piece_size)
+  {
+    replies.clear();
+    replies.push_back(with_length("200 OK", reply_xml));
+    replies.push_back(with_length("200 OK", reply_xml));
+    CPS::Connection conn(serve(replies, piece_size) + "/", "db", "user", "password");
+    assert(send_status(conn) == "ok");
+    assert(send_status(conn) == "ok");
+    server_.reset();
+    // Keep-alive connection is reused
+    assert(connections_ == 1);
+  }
+}
+
+void HttpSocketTest::test_chunked_reply_with_extensions_and_trailer()
+{
+  std::string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: Chunked\r\n\r\n";
+  for (size_t pos = 0; pos < reply_xml.size(); pos += 50)
+  {
+    std::string chunk = reply_xml.substr(pos, 50);
+    char size[16];
+    sprintf(size, "%x", static_cast<unsigned int>(chunk.size()));
+    chunked += std::string(size) + ";name=value\r\n" + chunk + "\r\n";
+  }
+  chunked += "0\r\nX-Trailer: 1\r\n\r\n";
+  std::vector<std::string> replies(3, chunked);
+  CPS::Connection conn(serve(replies, 3) + "/", "db", "user", "password");
+  for (int i = 0; i < 3; ++i)
+  {
+    assert(send_status(conn) == "ok");
+  }
+  server_.reset();
+  assert(connections_ == 1);
+}
+
+void HttpSocketTest::test_reply_without_length_ends_with_connection()
+{
+  std::vector<std::string> replies(2, "HTTP/1.0 200 OK\r\nContent-Type: text/xml\r\n\r\n" + reply_xml);
+  CPS::Connection conn(serve(replies, 64) + "/", "db", "user", "password");
+  assert(send_status(conn) == "ok");
+  assert(send_status(conn) == "ok");
+  server_.reset();
+  assert(connections_ == 2);
+}
+
+void HttpSocketTest::test_error_status_keeps_connection()
+{
+  std::vector<std::string> replies;
+  replies.push_back(with_length("503 Service Unavailable", ""));
+  replies.push_back(with_length("200 OK", reply_xml));
+  CPS::Connection conn(serve(replies, 5) + "/", "db", "user", "password");
+  conn.setRetryPolicy(CPS::RetryPolicy::none());
+  try
+  {
+    send_status(conn);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    std::cout << e.what() << std::endl;
+    assert(e.errorCode == 9007);
+    const int* status = boost::get_error_info<CPS::HttpStatus>(e);
+    assert(status && *status == 503);
+  }
+  // Whole reply was read, so connection is reused
+  assert(send_status(conn) == "ok");
+  server_.reset();
+  assert(connections_ == 1);
+}
+
+void HttpSocketTest::test_invalid_status_line()
+{
+  std::vector<std::string> replies(1, "HTTP/2 200\r\n\r\n");
+  CPS::Connection conn(serve(replies, 1) + "/", "db", "user", "password");
+  conn.setRetryPolicy(CPS::RetryPolicy::none());
+  try
+  {
+    send_status(conn);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    std::cout << e.what() << std::endl;
+  }
+}
+
+void HttpSocketTest::test_url_query_is_sent()
+{
+  // Query of HTTP URL is not taken for socket options
+  std::vector<std::string> replies(1, with_length("200 OK", reply_xml));
+  CPS::Connection conn(serve(replies, 64) + "/cps?account=1&x=y", "db", "user", "password");
+  assert(send_status(conn) == "ok");
+  server_.reset();
+  assert(request_lines_.size() == 1);
+  assert(request_lines_[0] == "POST /cps?account=1&x=y HTTP/1.1");
+}
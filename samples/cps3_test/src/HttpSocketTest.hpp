@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef HTTPSOCKETTEST_HPP_
+#define HTTPSOCKETTEST_HPP_
+
+#include "TestCase.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Tests of HTTP reply parsing, run against local server sending prepared replies
+ * in small pieces instead of the database, so they do not use the connection of the suite
+ */
+class HttpSocketTest : public TestCase
+{
+public:
+  HttpSocketTest(CPS::Connection& connection);
+
+protected:
+  virtual void set_up();
+  virtual void tear_down();
+  virtual void run_tests();
+
+private:
+  /**
+   * Sends replies to requests in given order, each written in pieces of piece_size bytes.
+   * Connection is closed after each reply that starts with HTTP/1.0
+   * @return connection string of server without path
+   */
+  std::string serve(const std::vector<std::string>& replies, size_t piece_size);
+
+  void test_content_length_reply_in_pieces();
+  void test_chunked_reply_with_extensions_and_trailer();
+  void test_reply_without_length_ends_with_connection();
+  void test_error_status_keeps_connection();
+  void test_invalid_status_line();
+  void test_url_query_is_sent();
+
+  std::vector<std::string> replies_;
+  size_t piece_size_;
+  int connections_; /// Number of connections accepted by server
+  std::vector<std::string> request_lines_; /// Request lines received by server
+  std::shared_ptr<void> server_;
+};
+
+#endif /* HTTPSOCKETTEST_HPP_ */
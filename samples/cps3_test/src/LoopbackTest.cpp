@@ -0,0 +1,240 @@
+#include "LoopbackTest.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+const char* server_name = "cps3_test";
+
+std::string get_tag(const std::string& xml, const std::string& tag)
+{
+  size_t start = xml.find("<" + tag + ">");
+  if (start == std::string::npos)
+  {
+    return std::string();
+  }
+  start += tag.size() + 2;
+  return xml.substr(start, xml.find("</" + tag + ">", start) - start);
+}
+
+}
+
+LoopbackTest::LoopbackTest(CPS::Connection& connection)
+  : TestCase(connection)
+{
+}
+
+void LoopbackTest::set_up()
+{
+  queries_.clear();
+  CPS::LoopbackRegistry::instance().bind(server_name,
+      [this](const std::string& request) { return handle_request(request); });
+}
+
+void LoopbackTest::tear_down()
+{
+  CPS::LoopbackRegistry::instance().unbind(server_name);
+}
+
+void LoopbackTest::run_tests()
+{
+  RUN_TEST(test_mix_blocking_and_async_requests);
+  RUN_TEST(test_retry_classification);
+  RUN_TEST(test_acquire_deadline_and_cancel);
+  RUN_TEST(test_adaptive_timeout_commands);
+}
+
+std::string LoopbackTest::handle_request(const std::string& request)
+{
+  // Reply echoes query of search request
+  std::string query = get_tag(request, "query");
+  queries_.push_back(query);
+  return "<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>" + get_tag(request, "cps:command") +
+      "</cps:command><cps:seconds>0</cps:seconds><cps:content><hits>0</hits><found>0</found>"
+      "<query>" + query + "</query></cps:content></cps:reply>";
+}
+
+void LoopbackTest::test_mix_blocking_and_async_requests()
+{
+  CPS::Connection conn(std::string("inproc://") + server_name, "db", "user", "password");
+  std::vector<std::string> expected;
+  std::vector<std::string> replies;
+  auto handler = [&replies](boost::shared_ptr<CPS::SearchResponse> resp, boost::exception_ptr error)
+  {
+    assert(!error);
+    replies.push_back(resp->getParam<std::string>("query"));
+  };
+  // Blocking request is sent after asynchronous requests queued before it
+  for (int i = 0; i < 5; ++i)
+  {
+    std::string query = "async" + std::to_string(i);
+    expected.push_back(query);
+    conn.sendRequestAsync<CPS::SearchResponse>(CPS::SearchRequest(query), handler);
+  }
+  expected.push_back("sync");
+  std::unique_ptr<CPS::SearchResponse> resp(conn.sendRequest<CPS::SearchResponse>(CPS::SearchRequest("sync")));
+  assert(resp->getParam<std::string>("query") == "sync");
+  assert(replies.size() == 5);
+  // Pipelined requests are not mixed up with blocking request either
+  conn.setMaxPipelinedRequests(4);
+  for (int i = 5; i < 10; ++i)
+  {
+    std::string query = "async" + std::to_string(i);
+    expected.push_back(query);
+    conn.sendRequestAsync<CPS::SearchResponse>(CPS::SearchRequest(query), handler);
+    if (i == 7)
+    {
+      expected.push_back("sync2");
+      resp.reset(conn.sendRequest<CPS::SearchResponse>(CPS::SearchRequest("sync2")));
+      assert(resp->getParam<std::string>("query") == "sync2");
+    }
+  }
+  conn.getIoService().run();
+  std::cout << "Server received: " << CPS::Utils::join(queries_) << std::endl;
+  assert(queries_ == expected);
+  assert(replies.size() == 10);
+  for (int i = 0; i < 10; ++i)
+  {
+    assert(replies[i] == "async" + std::to_string(i));
+  }
+}
+
+void LoopbackTest::test_retry_classification()
+{
+  // Exceptions are classified by their socket error, like failures of asynchronous requests
+  assert(CPS::Connection::isTransient(CPS::socketException("", boost::asio::error::eof)));
+  assert(CPS::Connection::isTransient(CPS::socketException("", boost::asio::error::connection_refused)));
+  assert(CPS::Connection::isTransient(CPS::socketException("", CPS::ErrorCode(503, CPS::httpStatusCategory()))));
+  assert(!CPS::Connection::isTransient(CPS::socketException("", CPS::ErrorCode(400, CPS::httpStatusCategory()))));
+  assert(!CPS::Connection::isTransient(CPS::socketException("", boost::asio::error::invalid_argument)));
+  assert(!CPS::Connection::isTransient(CPS::socketException("", boost::asio::error::operation_aborted)));
+  assert(!CPS::Connection::isTransient(CPS::Exception("Invalid header received")));
+  assert(!CPS::Connection::isTransient(CPS::Exception("Request deadline exceeded", 9008)));
+
+  CPS::RetryPolicy policy;
+  assert(policy.isIdempotent("search"));
+  assert(policy.isIdempotent("update"));
+  assert(!policy.isIdempotent("insert"));
+  assert(!policy.isIdempotent("partial-replace"));
+
+  // Backoff stays within bound when policy is shared by threads
+  std::vector<std::thread> threads;
+  std::atomic<bool> in_range(true);
+  for (int i = 0; i < 4; ++i)
+  {
+    threads.push_back(std::thread([&policy, &in_range]()
+    {
+      for (int j = 0; j < 10000; ++j)
+      {
+        int backoff = policy.getBackoff(j % 3);
+        if (backoff < 0 || backoff > policy.initialBackoff * 4)
+        {
+          in_range = false;
+        }
+      }
+    }));
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+  assert(in_range);
+}
+
+void LoopbackTest::test_acquire_deadline_and_cancel()
+{
+  CPS::ConnectionPool pool(1, std::string("inproc://") + server_name, "db", "user", "password");
+  boost::shared_ptr<CPS::Connection> busy = pool.acquire();
+
+  // Waiting for connection ends at deadline of the request
+  CPS::SearchRequest request("late");
+  request.setTimeout(50);
+  auto start = std::chrono::steady_clock::now();
+  try
+  {
+    delete pool.sendRequest<CPS::SearchResponse>(request);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9008);
+  }
+  assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+
+  // Cancelling token wakes the waiting thread
+  CPS::CancellationToken token;
+  request.setDeadline(boost::posix_time::ptime());
+  request.setCancellationToken(token);
+  std::thread canceller([&token]()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    token.cancel();
+  });
+  try
+  {
+    pool.acquire(request);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9009);
+  }
+  canceller.join();
+  assert(pool.getStatistics().timeouts == 1);
+
+  // Request gets the connection once it is released
+  busy.reset();
+  request.setCancellationToken(CPS::CancellationToken::none());
+  request.setTimeout(1000);
+  std::unique_ptr<CPS::SearchResponse> resp(pool.sendRequest<CPS::SearchResponse>(request));
+  assert(resp->getParam<std::string>("query") == "late");
+
+  // Unsubscribing waits for callback that is running in cancelling thread
+  CPS::CancellationToken slow;
+  std::atomic<bool> finished(false);
+  unsigned long long id = slow.subscribe([&finished]()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    finished = true;
+  });
+  unsigned long long own = 0;
+  own = slow.subscribe([&slow, &own]() { slow.unsubscribe(own); });
+  std::thread slow_canceller([&slow]() { slow.cancel(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  slow.unsubscribe(id);
+  assert(finished);
+  slow_canceller.join();
+}
+
+void LoopbackTest::test_adaptive_timeout_commands()
+{
+  CPS::Connection conn(std::string("inproc://") + server_name, "db", "user", "password");
+  CPS::AdaptiveTimeoutPolicy policy;
+  policy.minSamples = 1;
+  assert(policy.isAdapted("search"));
+  assert(!policy.isAdapted("insert"));
+  conn.setAdaptiveTimeoutPolicy(policy);
+
+  // Commands that modify data keep socket timeout, as their time depends on size of documents
+  delete conn.sendRequest(CPS::SearchRequest("a"));
+  delete conn.sendRequest(CPS::InsertRequest("1", "<title>a</title>"));
+  std::map<std::string, long> timeouts = conn.getAdaptiveTimeouts();
+  assert(timeouts.size() == 1);
+  assert(timeouts["search"] == policy.minTimeout);
+
+  policy.addAdaptedCommand("insert");
+  policy.removeAdaptedCommand("search");
+  conn.setAdaptiveTimeoutPolicy(policy);
+  delete conn.sendRequest(CPS::SearchRequest("a"));
+  delete conn.sendRequest(CPS::InsertRequest("1", "<title>a</title>"));
+  timeouts = conn.getAdaptiveTimeouts();
+  assert(timeouts.size() == 1);
+  assert(timeouts.count("insert") == 1);
+}
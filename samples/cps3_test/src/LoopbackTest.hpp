@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef LOOPBACKTEST_HPP_
+#define LOOPBACKTEST_HPP_
+
+#include "TestCase.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Tests of request processing in client, run against in-process server bound to inproc://
+ * instead of the database, so they do not use the connection of the suite
+ */
+class LoopbackTest : public TestCase
+{
+public:
+  LoopbackTest(CPS::Connection& connection);
+
+protected:
+  virtual void set_up();
+  virtual void tear_down();
+  virtual void run_tests();
+
+private:
+  std::string handle_request(const std::string& request);
+
+  void test_mix_blocking_and_async_requests();
+  void test_retry_classification();
+  void test_acquire_deadline_and_cancel();
+  void test_adaptive_timeout_commands();
+
+  std::vector<std::string> queries_; /// Queries in the order server received them
+};
+
+#endif /* LOOPBACKTEST_HPP_ */
@@ -0,0 +1,354 @@
+#include "ProtocolTest.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+std::string reply_xml(const std::string& query)
+{
+  return "<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>search</cps:command>"
+      "<cps:seconds>0</cps:seconds><cps:content><hits>0</hits><found>0</found>"
+      "<query>" + query + "</query></cps:content></cps:reply>";
+}
+
+/**
+ * Frames reply message the way server does, id is empty for replies of requests that are not pipelined
+ */
+std::string reply_frame(const std::string& message, const std::string& id)
+{
+  CPS::ProtocolEngine::Frame frame;
+  frame.encode(message.size(), "", id);
+  std::string bytes(frame.size(), '\0');
+  frame.write(&bytes[0], message.data());
+  return bytes;
+}
+
+/**
+ * Splits framed requests written by engine into messages and request ids
+ */
+void read_requests(const std::string& output, std::vector<std::string>& messages, std::vector<std::string>& ids)
+{
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(output.data());
+  size_t offset = 0;
+  while (offset < output.size())
+  {
+    size_t length = 0;
+    assert(CPS::ProtocolEngine::parseHeader(bytes + offset, length));
+    offset += CPS::ProtocolEngine::headerSize;
+    CPS::ProtobufReader reader(bytes + offset, length);
+    std::string id;
+    while (reader.next())
+    {
+      if (reader.fieldNumber == 1)
+      {
+        messages.push_back(reader.data.toString());
+      }
+      else if (reader.fieldNumber == 2)
+      {
+        assert(reader.data.equals("db"));
+      }
+      else if (reader.fieldNumber == 12)
+      {
+        assert(reader.value == 1);
+      }
+      else if (reader.fieldNumber == 13)
+      {
+        id = reader.data.toString();
+      }
+    }
+    ids.push_back(id);
+    offset += length;
+  }
+  assert(offset == output.size());
+}
+
+/**
+ * Response type written for versions that copied replies into strings
+ */
+class StringResponse : public CPS::Response
+{
+public:
+  StringResponse(std::string raw)
+    : CPS::Response(raw)
+  {
+  }
+};
+
+/**
+ * Passes bytes to engine in pieces of given size
+ */
+void receive(CPS::ProtocolEngine& engine, const std::string& bytes, size_t piece_size)
+{
+  for (size_t i = 0; i < bytes.size(); i += piece_size)
+  {
+    engine.receive(bytes.data() + i, std::min(piece_size, bytes.size() - i));
+  }
+}
+
+}
+
+ProtocolTest::ProtocolTest(CPS::Connection& connection)
+  : TestCase(connection)
+{
+}
+
+void ProtocolTest::set_up()
+{
+}
+
+void ProtocolTest::tear_down()
+{
+}
+
+void ProtocolTest::run_tests()
+{
+  RUN_TEST(test_pipelined_replies_out_of_order);
+  RUN_TEST(test_replies_without_id_in_order);
+  RUN_TEST(test_invalid_reply_stream);
+  RUN_TEST(test_varint_round_trip_and_overflow);
+  RUN_TEST(test_fields_after_varint_field);
+  RUN_TEST(test_in_place_decode_at_offsets);
+}
+
+void ProtocolTest::test_pipelined_replies_out_of_order()
+{
+  for (size_t piece_size = 1; piece_size <= 64; piece_size *= 4)
+  {
+    CPS::ProtocolEngine engine;
+    std::vector<unsigned long long> sent;
+    for (int i = 0; i < 3; ++i)
+    {
+      sent.push_back(engine.send("<cps:request>" + std::to_string(i) + "</cps:request>", "db"));
+    }
+    assert(engine.getOutstanding() == 3);
+    std::vector<std::string> messages;
+    std::vector<std::string> ids;
+    read_requests(engine.getOutput(), messages, ids);
+    assert(messages.size() == 3);
+    for (int i = 0; i < 3; ++i)
+    {
+      assert(messages[i] == "<cps:request>" + std::to_string(i) + "</cps:request>");
+      assert(ids[i] == std::to_string(sent[i]));
+    }
+    engine.consumeOutput(10);
+    assert(engine.getOutput().size() > 0);
+    engine.consumeOutput(engine.getOutput().size());
+    assert(engine.getOutput().empty());
+
+    // Replies are matched to requests by id, whatever order they arrive in
+    const int order[] = {2, 0, 1};
+    std::string bytes;
+    for (int i : order)
+    {
+      bytes += reply_frame(reply_xml("q" + std::to_string(i)), ids[i]);
+    }
+    receive(engine, bytes, piece_size);
+    for (int i : order)
+    {
+      assert(engine.hasReply());
+      unsigned long long id = 0;
+      std::unique_ptr<CPS::Response> resp(engine.nextResponse<CPS::Response>(id));
+      assert(id == sent[i]);
+      assert(resp->getParam<std::string>("query") == "q" + std::to_string(i));
+    }
+    assert(!engine.hasReply());
+    assert(engine.getOutstanding() == 0);
+  }
+}
+
+void ProtocolTest::test_replies_without_id_in_order()
+{
+  CPS::ProtocolEngine engine(false);
+  unsigned long long first = engine.send("<cps:request>a</cps:request>");
+  unsigned long long second = engine.send("<cps:request>b</cps:request>");
+  std::vector<std::string> messages;
+  std::vector<std::string> ids;
+  read_requests(engine.getOutput(), messages, ids);
+  assert(ids.size() == 2 && ids[0].empty() && ids[1].empty());
+
+  // Reply without id belongs to oldest request, reply that arrives in pieces waits for the rest
+  std::string bytes = reply_frame(reply_xml("a"), "") + reply_frame(reply_xml("b"), "");
+  engine.receive(bytes.data(), bytes.size() - 5);
+  assert(engine.hasReply());
+  unsigned long long id = 0;
+  std::unique_ptr<CPS::Response> resp(engine.nextResponse<CPS::Response>(id));
+  assert(id == first && resp->getParam<std::string>("query") == "a");
+  assert(!engine.hasReply());
+  engine.receive(bytes.data() + bytes.size() - 5, 5);
+  resp.reset(engine.nextResponse<CPS::Response>(id));
+  assert(id == second && resp->getParam<std::string>("query") == "b");
+
+  // Server error is thrown with response attached
+  engine.send("<cps:request>c</cps:request>");
+  std::string error_reply = "<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>search</cps:command>"
+      "<cps:seconds>0</cps:seconds><cps:error><code>2824</code><level>REJECTED</level>"
+      "<message>Invalid query</message></cps:error></cps:reply>";
+  bytes = reply_frame(error_reply, "");
+  engine.receive(bytes.data(), bytes.size());
+  try
+  {
+    delete engine.nextResponse<CPS::Response>(id);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 2824);
+    assert(e.getResponse());
+  }
+  assert(!engine.hasReply());
+}
+
+void ProtocolTest::test_invalid_reply_stream()
+{
+  CPS::ProtocolEngine engine;
+  unsigned long long id = engine.send("<cps:request>a</cps:request>");
+  std::string bytes = reply_frame(reply_xml("a"), "999");
+  try
+  {
+    engine.receive(bytes.data(), bytes.size());
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9005);
+  }
+
+  // Connection is closed after invalid bytes, outstanding requests are lost
+  std::vector<unsigned long long> lost = engine.reset();
+  assert(lost.size() == 1 && lost[0] == id);
+  engine.send("<cps:request>b</cps:request>");
+  try
+  {
+    engine.receive("HTTP/1.1", 8);
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9005);
+  }
+}
+
+void ProtocolTest::test_varint_round_trip_and_overflow()
+{
+  const unsigned long long values[] = {0, 1, 127, 128, 300, 16383, 16384, 2097151, 2097152, 0xFFFFFFFFULL,
+      0x100000000ULL, 1ULL << 56, 1ULL << 63, std::numeric_limits<unsigned long long>::max()};
+  for (unsigned long long value : values)
+  {
+    unsigned char buffer[10];
+    size_t size = CPS::writeVarint(buffer, value);
+    assert(size == CPS::varintSize(value));
+    assert(CPS::varintToBytes(value) == std::string(reinterpret_cast<char*>(buffer), size));
+    unsigned long long result = 1;
+    assert(CPS::readVarint(buffer, size, result) == size);
+    assert(result == value);
+    // Varint cut short is not complete
+    assert(CPS::readVarint(buffer, size - 1, result) == 0);
+  }
+  assert(CPS::varintSize(127) == 1 && CPS::varintSize(128) == 2);
+  assert(CPS::varintSize(std::numeric_limits<unsigned long long>::max()) == 10);
+
+  // Tenth byte may only hold the highest bit of 64
+  unsigned char overflow[11] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02, 0x00};
+  unsigned char too_long[11] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+  unsigned char* invalid[] = {overflow, too_long};
+  for (unsigned char* bytes : invalid)
+  {
+    unsigned long long result = 0;
+    try
+    {
+      CPS::readVarint(bytes, 11, result);
+      assert(false);
+    }
+    catch (CPS::Exception& e)
+    {
+      assert(e.errorCode == 9005);
+    }
+  }
+}
+
+void ProtocolTest::test_fields_after_varint_field()
+{
+  // Field following a varint field starts right after it, as in frames of pipelined requests
+  CPS::Protobuf message;
+  message.newFieldString(1, "<cps:request/>");
+  message.newFieldBool(12, true);
+  message.newFieldString(13, "42");
+  std::string encoded = message.toString();
+  std::vector<unsigned char> bytes(encoded.begin(), encoded.end());
+
+  CPS::Protobuf decoded;
+  decoded.fromBytes(bytes);
+  assert(decoded.fields.size() == 3);
+  assert(decoded.getField(1)->data == "<cps:request/>");
+  assert(decoded.getField(12)->wireType == CPS::ProtobufWireType_Varint);
+  assert(decoded.getField(12)->data == "1");
+  assert(decoded.getField(13)->data == "42");
+
+  CPS::ProtobufReader reader(&bytes[0], bytes.size());
+  assert(reader.next() && reader.fieldNumber == 1 && reader.data.equals("<cps:request/>"));
+  assert(reader.next() && reader.fieldNumber == 12 && reader.value == 1);
+  assert(reader.next() && reader.fieldNumber == 13 && reader.data.equals("42"));
+  assert(!reader.next());
+  assert(reader.getPosition() == bytes.size());
+}
+
+void ProtocolTest::test_in_place_decode_at_offsets()
+{
+  static_assert(CPS::ParsesInPlace<CPS::Response>::value, "");
+  static_assert(CPS::ParsesInPlace<CPS::SearchResponse>::value, "");
+  static_assert(!CPS::ParsesInPlace<StringResponse>::value, "");
+
+  std::string xml = reply_xml("q");
+  const size_t prefixes[] = {0, 1, 7, 100};
+  for (size_t prefix : prefixes)
+  {
+    // Reply followed by other bytes and reply at the end of buffer
+    for (size_t suffix = 0; suffix <= 3; suffix += 3)
+    {
+      std::string bytes = std::string(prefix, '#') + xml + std::string(suffix, '#');
+      std::vector<unsigned char> buffer(bytes.begin(), bytes.end());
+      std::unique_ptr<CPS::SearchResponse> resp(CPS::ProtocolEngine::createResponse<CPS::SearchResponse>(
+          buffer, prefix, xml.size(), "document", "document/id"));
+      assert(buffer.empty());
+      assert(resp->getParam<std::string>("query") == "q");
+      assert(resp->getCommand() == "search");
+
+      // Response type without in-place constructor gets a copy and leaves buffer as is
+      buffer.assign(bytes.begin(), bytes.end());
+      std::unique_ptr<StringResponse> copied(CPS::ProtocolEngine::createResponse<StringResponse>(
+          buffer, prefix, xml.size(), "document", "document/id"));
+      assert(buffer.size() == bytes.size());
+      assert(copied->getParam<std::string>("query") == "q");
+    }
+  }
+
+  // Reply message inside frame content is found without copying it out
+  std::string frame = reply_frame(xml, "7");
+  std::vector<unsigned char> content(frame.begin() + CPS::ProtocolEngine::headerSize, frame.end());
+  CPS::ProtobufSlice message;
+  CPS::ProtobufSlice id;
+  CPS::ProtocolEngine::decodeReply(content, message, id);
+  assert(id.equals("7"));
+  assert(message.data > &content[0] && message.equals(xml));
+  std::unique_ptr<CPS::Response> resp(CPS::ProtocolEngine::createResponse<CPS::Response>(
+      content, message.data - &content[0], message.size, "document", "document/id"));
+  assert(resp->getParam<std::string>("query") == "q");
+
+  // Invalid XML is reported as invalid response
+  std::vector<unsigned char> invalid(xml.begin(), xml.end() - 5);
+  try
+  {
+    delete CPS::ProtocolEngine::createResponse<CPS::Response>(invalid, 0, invalid.size(), "document", "document/id");
+    assert(false);
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9001);
+  }
+}
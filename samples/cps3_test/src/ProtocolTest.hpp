@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef PROTOCOLTEST_HPP_
+#define PROTOCOLTEST_HPP_
+
+#include "TestCase.hpp"
+
+/**
+ * Tests of binary protocol framing and decoding, run on prepared bytes
+ * without any I/O, so they do not use the connection of the suite
+ */
+class ProtocolTest : public TestCase
+{
+public:
+  ProtocolTest(CPS::Connection& connection);
+
+protected:
+  virtual void set_up();
+  virtual void tear_down();
+  virtual void run_tests();
+
+private:
+  void test_pipelined_replies_out_of_order();
+  void test_replies_without_id_in_order();
+  void test_invalid_reply_stream();
+  void test_varint_round_trip_and_overflow();
+  void test_fields_after_varint_field();
+  void test_in_place_decode_at_offsets();
+};
+
+#endif /* PROTOCOLTEST_HPP_ */
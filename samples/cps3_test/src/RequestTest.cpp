@@ -0,0 +1,173 @@
+#include "RequestTest.hpp"
+
+#include <cassert>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+typedef std::map<std::string, std::vector<std::string>> Envelope;
+
+/**
+ * Serializes request with envelope given as map and as string, both have to be the same
+ * and exactly as long as computed, so no byte is left unwritten
+ */
+std::string request_xml(const CPS::Request& request, const std::string& root, const std::string& id,
+    const Envelope& envelope, long long transaction_id)
+{
+  std::string xml = request.getRequestXml(root, id, envelope, false, transaction_id);
+  std::string serialized;
+  for (const auto& param : envelope)
+  {
+    for (const auto& value : param.second)
+    {
+      CPS::Request::appendEnvelopeParam(serialized, param.first, value);
+    }
+  }
+  assert(request.getRequestXml(root, id, serialized, transaction_id) == xml);
+  assert(xml.find('\0') == std::string::npos);
+  const std::string begin = "<cps:request xmlns:cps=\"www.clusterpoint.com\">";
+  assert(xml.compare(0, begin.size(), begin) == 0);
+  const std::string end = "</cps:content></cps:request>";
+  assert(xml.size() > end.size() && xml.compare(xml.size() - end.size(), end.size(), end) == 0);
+  return xml;
+}
+
+bool is_valid_param(const std::string& name)
+{
+  CPS::Request request("search");
+  try
+  {
+    request.setParam(name, "1");
+    return true;
+  }
+  catch (CPS::Exception& e)
+  {
+    assert(e.errorCode == 9002);
+    return false;
+  }
+}
+
+}
+
+RequestTest::RequestTest(CPS::Connection& connection)
+  : TestCase(connection)
+{
+}
+
+void RequestTest::set_up()
+{
+}
+
+void RequestTest::tear_down()
+{
+}
+
+void RequestTest::run_tests()
+{
+  RUN_TEST(test_request_xml_size_matches_written);
+  RUN_TEST(test_param_names);
+}
+
+void RequestTest::test_request_xml_size_matches_written()
+{
+  Envelope envelope;
+  envelope["storage"].push_back("db");
+  envelope["user"].push_back("user");
+  envelope["password"].push_back("pass\x01word\n");
+  envelope["command"].push_back("search");
+
+  CPS::SearchRequest search("<title>cars &amp; trucks</title>", 5, 10);
+  search.setParam("facet", std::vector<std::string>{"category", "car_params/make"});
+  search.setOrdering(CPS::Ordering::NumericOrdering("year", CPS::Ordering::Descending));
+  std::string xml = request_xml(search, "document", "document/id", envelope, -1);
+  assert(xml.find("<cps:password>pass word </cps:password>") != std::string::npos);
+  assert(xml.find("<transaction_id>") == std::string::npos);
+  assert(xml.find("<facet>category</facet><facet>car_params/make</facet>") != std::string::npos);
+  std::unique_ptr<CPS::XMLDocument> doc(CPS::XMLDocument::parseFromMemory(xml));
+  assert(doc->FindFast("cps:request/cps:content/query", false).size() == 1);
+
+  // Exact bytes of small request
+  CPS::Request status("status");
+  Envelope storage;
+  storage["storage"].push_back("db");
+  assert(request_xml(status, "document", "document/id", storage, 42) ==
+      "<cps:request xmlns:cps=\"www.clusterpoint.com\"><cps:storage>db</cps:storage><cps:content>"
+      "<transaction_id>42</transaction_id></cps:content></cps:request>");
+  assert(request_xml(status, "document", "document/id", Envelope(), -1) ==
+      "<cps:request xmlns:cps=\"www.clusterpoint.com\"><cps:content></cps:content></cps:request>");
+
+  // Documents with and without ids under roots and id paths of different depth
+  std::map<std::string, std::string> with_ids;
+  with_ids["1"] = "<title>first</title>";
+  with_ids["2"] = "<title>second</title>";
+  std::vector<std::string> without_ids;
+  without_ids.push_back("<document><id>3</id><title>third</title></document>");
+  without_ids.push_back("<title>fourth</title>");
+  const char* paths[][2] = {
+    {"document", "document/id"},
+    {"document", "document/meta/id"},
+    {"/docs/document", "/docs/document/id"},
+    {"document", "document"},
+    {"/", "/id"}
+  };
+  for (auto& path : paths)
+  {
+    CPS::InsertRequest insert(with_ids);
+    insert.setDocuments(without_ids);
+    for (long long transaction_id : {-1LL, 0LL, 1234567890123LL})
+    {
+      xml = request_xml(insert, path[0], path[1], envelope, transaction_id);
+      // Documents are left out when root has no tags, like when XML tree is built
+      bool has_root = std::string(path[0]) != "/";
+      assert((xml.find("<title>second</title>") != std::string::npos) == has_root);
+      assert((xml.find("<title>fourth</title>") != std::string::npos) == has_root);
+      assert((xml.find("<title>third</title>") != std::string::npos) == has_root);
+    }
+  }
+  xml = request_xml(CPS::InsertRequest(with_ids), "document", "document/meta/id", envelope, -1);
+  assert(xml.find("<document><meta><id>1</id></meta><title>first</title></document>") != std::string::npos);
+}
+
+void RequestTest::test_param_names()
+{
+  // Param name tables are checked to be sorted by debug builds on first use,
+  // then every name is found by binary search
+  const char* text_names[] = {"added_external_id", "added_id", "aggregate",
+      "case_sensitive", "cr", "deleted_external_id", "deleted_id",
+      "description", "docs", "exact-match", "facet", "facet_size",
+      "fail_if_exists", "file", "finalize", "for", "force", "from",
+      "full", "group", "group_size", "h", "id", "idif", "iterator_id",
+      "len", "message", "offset", "path", "persistent", "position",
+      "quota", "rate2_ordering", "rate_from", "rate_to", "relevance",
+      "return_doc", "return_internal", "sequence_check", "stem-lang",
+      "step_size", "text", "transaction_id", "type"};
+  for (const char* name : text_names)
+  {
+    assert(is_valid_param(name));
+  }
+  const char* raw_names[] = {"list", "ordering", "query", "shapes"};
+  for (const char* name : raw_names)
+  {
+    assert(is_valid_param(name));
+  }
+
+  // Names before, after and between table entries, prefixes and extensions of them
+  const char* invalid_names[] = {"", "a", "added", "added_id_", "zzz", "u", "typ", "types", "facet_",
+      "facet_s", "Facet", "query ", "li", "ordering2", "shape", "stem_lang", "rate", "h2"};
+  for (const char* name : invalid_names)
+  {
+    assert(!is_valid_param(name));
+  }
+
+  // Text and raw params are written alike but kept apart
+  CPS::Request request("search");
+  request.setParam("query", "<title>a</title>");
+  request.setParam("docs", "10");
+  request.setParam("docs", "20", true);
+  std::string xml = request.getRequestXml("document", "document/id", Envelope(), false, -1);
+  assert(xml.find("<docs>20</docs><query><title>a</title></query>") != std::string::npos);
+}
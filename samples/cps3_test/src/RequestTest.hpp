@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef REQUESTTEST_HPP_
+#define REQUESTTEST_HPP_
+
+#include "TestCase.hpp"
+
+/**
+ * Tests of request serialization, they do not send anything
+ * and do not use the connection of the suite
+ */
+class RequestTest : public TestCase
+{
+public:
+  RequestTest(CPS::Connection& connection);
+
+protected:
+  virtual void set_up();
+  virtual void tear_down();
+  virtual void run_tests();
+
+private:
+  void test_request_xml_size_matches_written();
+  void test_param_names();
+};
+
+#endif /* REQUESTTEST_HPP_ */
@@ -1,7 +1,13 @@
 #include "TestSuite.hpp"
+#include "AsyncTest.hpp"
 #include "BasicIOTest.hpp"
+#include "HttpSocketTest.hpp"
+#include "LoopbackTest.hpp"
 #include "PerformanceTest.hpp"
+#include "ProtocolTest.hpp"
+#include "RequestTest.hpp"
 #include "SamplesTest.hpp"
+#include "TimerWheelTest.hpp"
 
 #include <iostream>
 
@@ -98,6 +104,12 @@ void TestSuite::run()
 {
   BasicIOTest(connection_).run();
   SamplesTest(connection_).run();
+  AsyncTest(connection_).run();
+  LoopbackTest(connection_).run();
+  HttpSocketTest(connection_).run();
+  TimerWheelTest(connection_).run();
+  ProtocolTest(connection_).run();
+  RequestTest(connection_).run();
   PerformanceTest(connection_).run();
 
   std::cout << "*** ALL TESTS PASSED ***" << std::endl;
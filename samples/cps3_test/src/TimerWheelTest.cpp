@@ -0,0 +1,134 @@
+#include "TimerWheelTest.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const char* server_name = "cps3_timer_test";
+
+boost::posix_time::ptime now()
+{
+  return CPS::TimerWheel::now();
+}
+
+}
+
+TimerWheelTest::TimerWheelTest(CPS::Connection& connection)
+  : TestCase(connection)
+{
+}
+
+void TimerWheelTest::set_up()
+{
+  CPS::LoopbackRegistry::instance().bind(server_name, [](const std::string&)
+  {
+    return std::string("<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>search</cps:command>"
+        "<cps:seconds>0</cps:seconds><cps:content><hits>0</hits><found>0</found></cps:content></cps:reply>");
+  });
+}
+
+void TimerWheelTest::tear_down()
+{
+  CPS::LoopbackRegistry::instance().unbind(server_name);
+}
+
+void TimerWheelTest::run_tests()
+{
+  RUN_TEST(test_timers_fire_in_order_and_not_early);
+  RUN_TEST(test_cancel_and_replace_timeout);
+  RUN_TEST(test_idle_connections_hold_no_timeouts);
+}
+
+void TimerWheelTest::test_timers_fire_in_order_and_not_early()
+{
+  boost::asio::io_service io_service;
+  CPS::TimerWheel& wheel = boost::asio::use_service<CPS::TimerWheel>(io_service);
+  // Last timeout is more than one turn of the wheel away
+  const int delays[] = {30, 10, 20, 10, 700};
+  std::vector<std::unique_ptr<CPS::TimerWheel::Timer>> timers;
+  std::vector<int> fired;
+  std::vector<bool> early;
+  boost::posix_time::ptime start = now();
+  for (int i = 0; i < 5; ++i)
+  {
+    boost::posix_time::ptime expiry = start + boost::posix_time::milliseconds(delays[i]);
+    timers.emplace_back(new CPS::TimerWheel::Timer(io_service));
+    timers.back()->expiresAt(expiry, [i, expiry, &fired, &early]()
+    {
+      fired.push_back(i);
+      early.push_back(now() < expiry);
+    });
+  }
+  assert(wheel.size() == 5);
+  // io_service runs out of work once all timeouts have fired
+  io_service.run();
+  std::cout << "Fired after " << (now() - start).total_milliseconds() << "ms" << std::endl;
+  assert(fired.size() == 5);
+  assert((fired[0] == 1 && fired[1] == 3) || (fired[0] == 3 && fired[1] == 1));
+  assert(fired[2] == 2 && fired[3] == 0 && fired[4] == 4);
+  assert(std::find(early.begin(), early.end(), true) == early.end());
+  assert(wheel.size() == 0);
+}
+
+void TimerWheelTest::test_cancel_and_replace_timeout()
+{
+  boost::asio::io_service io_service;
+  CPS::TimerWheel& wheel = boost::asio::use_service<CPS::TimerWheel>(io_service);
+  CPS::TimerWheel::Timer cancelled(io_service);
+  CPS::TimerWheel::Timer replaced(io_service);
+  std::vector<std::string> fired;
+  cancelled.expiresFromNow(boost::posix_time::milliseconds(10), [&fired]() { fired.push_back("cancelled"); });
+  replaced.expiresFromNow(boost::posix_time::seconds(60), [&fired]() { fired.push_back("first"); });
+  replaced.expiresFromNow(boost::posix_time::milliseconds(20), [&fired]() { fired.push_back("second"); });
+  assert(wheel.size() == 2);
+  cancelled.cancel();
+  assert(cancelled.getExpiry() == boost::posix_time::pos_infin);
+  assert(wheel.size() == 1);
+  boost::posix_time::ptime start = now();
+  io_service.run();
+  // Replaced timeout of 60 seconds does not keep io_service running
+  assert(now() - start < boost::posix_time::seconds(5));
+  assert(fired.size() == 1 && fired[0] == "second");
+
+  // Cancelling last timeout lets io_service return at once
+  io_service.reset();
+  replaced.expiresFromNow(boost::posix_time::seconds(60), [&fired]() { fired.push_back("third"); });
+  replaced.cancel();
+  start = now();
+  io_service.run();
+  assert(now() - start < boost::posix_time::seconds(5));
+  assert(fired.size() == 1);
+}
+
+void TimerWheelTest::test_idle_connections_hold_no_timeouts()
+{
+  boost::asio::io_service io_service;
+  CPS::TimerWheel& wheel = boost::asio::use_service<CPS::TimerWheel>(io_service);
+  std::vector<std::unique_ptr<CPS::Connection>> connections;
+  int replies = 0;
+  for (int i = 0; i < 100; ++i)
+  {
+    connections.emplace_back(new CPS::Connection(io_service, std::string("inproc://") + server_name,
+        "db" + std::to_string(i), "user", "password"));
+    CPS::SearchRequest request("*");
+    request.setTimeout(60000);
+    connections.back()->sendRequestAsync<CPS::SearchResponse>(request,
+        [&replies](boost::shared_ptr<CPS::SearchResponse> resp, boost::exception_ptr error)
+    {
+      assert(!error && resp);
+      ++replies;
+    });
+  }
+  // Deadlines and socket timeouts of completed requests are removed from the wheel,
+  // so io_service does not wait for them
+  boost::posix_time::ptime start = now();
+  io_service.run();
+  assert(now() - start < boost::posix_time::seconds(30));
+  assert(replies == 100);
+  assert(wheel.size() == 0);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef TIMERWHEELTEST_HPP_
+#define TIMERWHEELTEST_HPP_
+
+#include "TestCase.hpp"
+
+/**
+ * Tests of timeouts shared by connections on the same io_service,
+ * they do not use the connection of the suite
+ */
+class TimerWheelTest : public TestCase
+{
+public:
+  TimerWheelTest(CPS::Connection& connection);
+
+protected:
+  virtual void set_up();
+  virtual void tear_down();
+  virtual void run_tests();
+
+private:
+  void test_timers_fire_in_order_and_not_early();
+  void test_cancel_and_replace_timeout();
+  void test_idle_connections_hold_no_timeouts();
+};
+
+#endif /* TIMERWHEELTEST_HPP_ */
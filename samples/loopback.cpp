@@ -0,0 +1,41 @@
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+
+// In-process server that answers every request with the same search reply
+std::string handleRequest(const std::string &/*request*/) {
+    return "<cps:reply xmlns:cps=\"www.clusterpoint.com\"><cps:command>search</cps:command><cps:seconds>0</cps:seconds>"
+            "<cps:content><hits>1</hits><found>1</found><from>0</from><to>1</to>"
+            "<results><document><id>id1</id><title>Test document 1</title></document></results></cps:content></cps:reply>";
+}
+
+int main() {
+    try
+    {
+        // Requests to inproc://bench are handled by handleRequest without touching network,
+        // so only request serialization and reply parsing of the client are measured
+        CPS::LoopbackRegistry::instance().bind("bench", &handleRequest);
+        CPS::Connection *conn = new CPS::Connection("inproc://bench", "storage", "user", "password");
+
+        const int count = 10000;
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        for (int i = 0; i < count; i++) {
+            CPS::SearchResponse *search_resp = conn->sendRequest<CPS::SearchResponse>(CPS::SearchRequest("<title>test</title>"));
+            delete search_resp;
+        }
+        boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+        std::cout << "Average request time: " << elapsed.total_microseconds() / count << " us" << std::endl;
+
+        // Clean Up
+        delete conn;
+        CPS::LoopbackRegistry::instance().unbind("bench");
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}
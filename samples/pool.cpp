@@ -0,0 +1,70 @@
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+void worker(CPS::ConnectionPool *pool, int id) {
+    try
+    {
+        for (int i = 0; i < 100; i++) {
+            // Connection is checked out only while request is being processed
+            CPS::LookupResponse *lookup_resp = pool->sendRequest<CPS::LookupResponse>(
+                    CPS::LookupRequest("id" + CPS::Utils::toString(id)));
+            delete lookup_resp;
+        }
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+int main() {
+    try
+    {
+        // Pool of 4 connections shared by 16 threads
+        CPS::ConnectionPool *pool = new CPS::ConnectionPool(4, "tcp://127.0.0.1:5550", "storage", "user", "password");
+        // Do not wait longer than a second for a free connection
+        pool->setAcquireTimeout(1000);
+        pool->connect();
+
+        boost::thread_group threads;
+        for (int i = 0; i < 16; i++) {
+            threads.create_thread(boost::bind(&worker, pool, i));
+        }
+        threads.join_all();
+
+        // Connection can also be held for several requests
+        {
+            boost::shared_ptr<CPS::Connection> conn = pool->acquire();
+            CPS::StatusResponse *status_resp = conn->sendRequest<CPS::StatusResponse>(CPS::StatusRequest());
+            std::cout << "Total " << status_resp->getRepository().documents << " documents." << std::endl;
+            delete status_resp;
+        } // Connection is returned to the pool here
+
+        // Requests to other storages are sent over the same connections
+        CPS::SearchRequest tenant_req("<title>cars</title>");
+        tenant_req.setStorage("tenant2");
+        tenant_req.setCredentials("tenant2_user", "tenant2_password");
+        delete pool->sendRequest(tenant_req);
+
+        CPS::PoolStatistics stats = pool->getStatistics();
+        std::cout << "Acquisitions: " << stats.acquisitions << std::endl;
+        std::cout << "Average wait: " << stats.getAverageWaitSeconds() << " s" << std::endl;
+        std::cout << "Utilization: " << stats.utilization * 100 << " %" << std::endl;
+
+        // Clean Up
+        delete pool;
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+int main() {
+    try
+    {
+        boost::asio::io_service io_service;
+        boost::asio::io_service::work work(io_service);
+        boost::thread io_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+
+        CPS::ConnectionPool *pool = new CPS::ConnectionPool(io_service, 4, "tcp://127.0.0.1:5550", "storage", "user", "password");
+
+        {
+            // Transaction keeps one connection of the pool until it ends
+            boost::shared_ptr<CPS::Connection> conn = pool->acquire();
+            conn->setMaxPipelinedRequests(4);
+            CPS::Transaction tx(conn);
+
+            // Inserts are written without waiting for each other's replies
+            for (int i = 0; i < 10; i++) {
+                std::string id = "id" + CPS::Utils::toString(i);
+                tx.sendRequestAsync<CPS::InsertResponse>(CPS::InsertRequest(id, "<document><title>Document " + id + "</title></document>"));
+            }
+
+            // Other connections of the pool are not affected by transaction
+            delete pool->sendRequest(CPS::StatusRequest());
+
+            // Commit waits for inserts and rolls back if any of them has failed
+            tx.commit();
+            std::cout << "Transaction " << tx.getId() << " committed" << std::endl;
+        } // Connection is returned to the pool here
+
+        // Clean Up
+        delete pool;
+        io_service.stop();
+        io_thread.join();
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+// io_uring transport is compiled in only when CPS_USE_IO_URING is defined before including the API
+#define CPS_USE_IO_URING
+#include "cps/CPS_API.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+int main() {
+    try
+    {
+        boost::asio::io_service io_service;
+        boost::asio::io_service::work work(io_service);
+        boost::thread_group threads;
+        for (int i = 0; i < 2; i++) {
+            threads.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+        }
+
+        // Requests of all uring:// connections on io_service are submitted to one ring.
+        // Kernels without io_uring fall back to ordinary sockets
+        bool enabled = boost::asio::use_service<CPS::IoUringService>(io_service).isEnabled();
+        std::cout << "io_uring " << (enabled ? "enabled" : "not available") << std::endl;
+
+        CPS::ConnectionPool *pool = new CPS::ConnectionPool(io_service, 4, "uring://127.0.0.1:5550", "storage", "user", "password");
+        pool->connect();
+
+        // Blocking requests work the same as over tcp://
+        CPS::StatusResponse *status_resp = pool->sendRequest<CPS::StatusResponse>(CPS::StatusRequest());
+        std::cout << "Total " << status_resp->getRepository().documents << " documents." << std::endl;
+        delete status_resp;
+
+        // Pipelined requests of a connection are written with one submission
+        boost::shared_ptr<CPS::Connection> conn = pool->acquire();
+        conn->setMaxPipelinedRequests(8);
+        std::vector<boost::unique_future<boost::shared_ptr<CPS::RetrieveResponse> > > retrieve_futures;
+        for (int i = 0; i < 10; i++) {
+            retrieve_futures.push_back(conn->sendRequestAsync<CPS::RetrieveResponse>(CPS::RetrieveRequest("id" + CPS::Utils::toString(i))));
+        }
+        for (unsigned int i = 0; i < retrieve_futures.size(); i++) {
+            std::cout << "Retrieved: " << retrieve_futures[i].get()->getDocumentsXML().size() << std::endl;
+        }
+        conn.reset();
+
+        // Clean Up
+        io_service.stop();
+        threads.join_all();
+        delete pool;
+    }
+    catch (CPS::Exception&  e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << boost::diagnostic_information(e);
+    }
+
+    return 0;
+}